@@ -0,0 +1,408 @@
+/**
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+
+#include "ed25519.h"
+#include "sha512.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/******************************************************************************/
+/* Field elements modulo 2^255-19 are held as sixteen signed limbs of
+ * sixteen bits each, following the compact reference implementation in
+ * TweetNaCl. The arithmetic takes the same time regardless of the
+ * values of the secret operands.
+ */
+
+typedef int64_t Field_[16];
+
+static const Field_ field0_;
+static const Field_ field1_ = { 1 };
+
+static const Field_ fieldD2_ = {
+    0xf159, 0x26b2, 0x9b94, 0xebd6, 0xb156, 0x8283, 0x149a, 0x00e0,
+    0xd130, 0xeef3, 0x80f2, 0x198e, 0xfce7, 0x56df, 0xd9dc, 0x2406,
+};
+
+static const Field_ fieldX_ = {
+    0xd51a, 0x8f25, 0x2d60, 0xc956, 0xa7b2, 0x9525, 0xc760, 0x692c,
+    0xdc5c, 0xfdd6, 0xe231, 0xc0a4, 0x53fe, 0xcd6e, 0x36d3, 0x2169,
+};
+
+static const Field_ fieldY_ = {
+    0x6658, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666,
+    0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666,
+};
+
+/* The order of the base point, in little endian bytes */
+
+static const int64_t groupL_[32] = {
+    0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58,
+    0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0x10,
+};
+
+/*----------------------------------------------------------------------------*/
+static void
+field_set_(Field_ aResult, const Field_ aValue)
+{
+    for (int ix = 0; ix < 16; ++ix)
+        aResult[ix] = aValue[ix];
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+field_carry_(Field_ aValue)
+{
+    for (int ix = 0; ix < 16; ++ix) {
+        aValue[ix] += 1 << 16;
+
+        int64_t carry = aValue[ix] >> 16;
+
+        if (15 > ix)
+            aValue[ix+1] += carry - 1;
+        else
+            aValue[0] += 38 * (carry - 1);
+
+        aValue[ix] -= carry * (1 << 16);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+field_select_(Field_ aLhs, Field_ aRhs, int aSwap)
+{
+    int64_t mask = ~(aSwap - 1);
+
+    for (int ix = 0; ix < 16; ++ix) {
+        int64_t bits = mask & (aLhs[ix] ^ aRhs[ix]);
+        aLhs[ix] ^= bits;
+        aRhs[ix] ^= bits;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+field_pack_(unsigned char *aBytes, const Field_ aValue)
+{
+    Field_ value;
+    Field_ reduced;
+
+    field_set_(value, aValue);
+    field_carry_(value);
+    field_carry_(value);
+    field_carry_(value);
+
+    for (int pass = 0; pass < 2; ++pass) {
+        reduced[0] = value[0] - 0xffed;
+        for (int ix = 1; ix < 15; ++ix) {
+            reduced[ix] = value[ix] - 0xffff - ((reduced[ix-1] >> 16) & 1);
+            reduced[ix-1] &= 0xffff;
+        }
+        reduced[15] = value[15] - 0x7fff - ((reduced[14] >> 16) & 1);
+
+        int borrow = (reduced[15] >> 16) & 1;
+        reduced[14] &= 0xffff;
+
+        field_select_(value, reduced, 1 - borrow);
+    }
+
+    for (int ix = 0; ix < 16; ++ix) {
+        aBytes[2*ix+0] = value[ix] & 0xff;
+        aBytes[2*ix+1] = value[ix] >> 8;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+field_parity_(const Field_ aValue)
+{
+    unsigned char bytes[32];
+    field_pack_(bytes, aValue);
+
+    return bytes[0] & 1;
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+field_add_(Field_ aResult, const Field_ aLhs, const Field_ aRhs)
+{
+    for (int ix = 0; ix < 16; ++ix)
+        aResult[ix] = aLhs[ix] + aRhs[ix];
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+field_sub_(Field_ aResult, const Field_ aLhs, const Field_ aRhs)
+{
+    for (int ix = 0; ix < 16; ++ix)
+        aResult[ix] = aLhs[ix] - aRhs[ix];
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+field_mul_(Field_ aResult, const Field_ aLhs, const Field_ aRhs)
+{
+    int64_t product[31] = { };
+
+    for (int ix = 0; ix < 16; ++ix) {
+        for (int jx = 0; jx < 16; ++jx)
+            product[ix+jx] += aLhs[ix] * aRhs[jx];
+    }
+
+    for (int ix = 0; ix < 15; ++ix)
+        product[ix] += 38 * product[ix+16];
+
+    for (int ix = 0; ix < 16; ++ix)
+        aResult[ix] = product[ix];
+
+    field_carry_(aResult);
+    field_carry_(aResult);
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+field_invert_(Field_ aResult, const Field_ aValue)
+{
+    Field_ value;
+
+    /* Raise to the power 2^255-21 */
+
+    field_set_(value, aValue);
+    for (int bx = 253; bx >= 0; --bx) {
+        field_mul_(value, value, value);
+        if (2 != bx && 4 != bx)
+            field_mul_(value, value, aValue);
+    }
+
+    field_set_(aResult, value);
+}
+
+/******************************************************************************/
+/* Points are held in extended twisted Edwards coordinates (X, Y, Z, T) */
+
+typedef Field_ Point_[4];
+
+static void
+point_add_(Point_ aLhs, Point_ aRhs)
+{
+    Field_ a, b, c, d, t, e, f, g, h;
+
+    field_sub_(a, aLhs[1], aLhs[0]);
+    field_sub_(t, aRhs[1], aRhs[0]);
+    field_mul_(a, a, t);
+    field_add_(b, aLhs[0], aLhs[1]);
+    field_add_(t, aRhs[0], aRhs[1]);
+    field_mul_(b, b, t);
+    field_mul_(c, aLhs[3], aRhs[3]);
+    field_mul_(c, c, fieldD2_);
+    field_mul_(d, aLhs[2], aRhs[2]);
+    field_add_(d, d, d);
+    field_sub_(e, b, a);
+    field_sub_(f, d, c);
+    field_add_(g, d, c);
+    field_add_(h, b, a);
+
+    field_mul_(aLhs[0], e, f);
+    field_mul_(aLhs[1], h, g);
+    field_mul_(aLhs[2], g, f);
+    field_mul_(aLhs[3], e, h);
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+point_select_(Point_ aLhs, Point_ aRhs, int aSwap)
+{
+    for (int ix = 0; ix < 4; ++ix)
+        field_select_(aLhs[ix], aRhs[ix], aSwap);
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+point_pack_(unsigned char *aBytes, Point_ aPoint)
+{
+    Field_ zInverse, x, y;
+
+    field_invert_(zInverse, aPoint[2]);
+    field_mul_(x, aPoint[0], zInverse);
+    field_mul_(y, aPoint[1], zInverse);
+
+    field_pack_(aBytes, y);
+    aBytes[31] ^= field_parity_(x) << 7;
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+point_scale_base_(Point_ aResult, const unsigned char *aScalar)
+{
+    Point_ base;
+
+    field_set_(base[0], fieldX_);
+    field_set_(base[1], fieldY_);
+    field_set_(base[2], field1_);
+    field_mul_(base[3], fieldX_, fieldY_);
+
+    field_set_(aResult[0], field0_);
+    field_set_(aResult[1], field1_);
+    field_set_(aResult[2], field1_);
+    field_set_(aResult[3], field0_);
+
+    /* Use a ladder so that each step does the same work whatever the
+     * value of the secret scalar.
+     */
+
+    for (int bx = 255; bx >= 0; --bx) {
+        int bit = (aScalar[bx/8] >> (bx & 7)) & 1;
+
+        point_select_(aResult, base, bit);
+        point_add_(base, aResult);
+        point_add_(aResult, aResult);
+        point_select_(aResult, base, bit);
+    }
+}
+
+/******************************************************************************/
+static void
+scalar_reduce_wide_(unsigned char *aResult, int64_t *aValue)
+{
+    int64_t carry;
+
+    /* Reduce the 64 limb value modulo the group order */
+
+    for (int ix = 63; ix >= 32; --ix) {
+        int jx;
+
+        carry = 0;
+        for (jx = ix - 32; jx < ix - 12; ++jx) {
+            aValue[jx] += carry - 16 * aValue[ix] * groupL_[jx - (ix - 32)];
+            carry = (aValue[jx] + 128) >> 8;
+            aValue[jx] -= carry * 256;
+        }
+        aValue[jx] += carry;
+        aValue[ix] = 0;
+    }
+
+    carry = 0;
+    for (int jx = 0; jx < 32; ++jx) {
+        aValue[jx] += carry - (aValue[31] >> 4) * groupL_[jx];
+        carry = aValue[jx] >> 8;
+        aValue[jx] &= 255;
+    }
+
+    for (int jx = 0; jx < 32; ++jx)
+        aValue[jx] -= carry * groupL_[jx];
+
+    for (int ix = 0; ix < 32; ++ix) {
+        aValue[ix+1] += aValue[ix] >> 8;
+        aResult[ix] = aValue[ix] & 255;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+scalar_reduce_(unsigned char *aDigest)
+{
+    int64_t value[64];
+
+    for (int ix = 0; ix < 64; ++ix)
+        value[ix] = aDigest[ix];
+
+    memset(aDigest, 0, 64);
+    scalar_reduce_wide_(aDigest, value);
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+ed25519_expand_(const unsigned char *aSeed, unsigned char *aExpanded)
+{
+    sha512(aSeed, ED25519_SEED_LEN, aExpanded);
+
+    aExpanded[0] &= 248;
+    aExpanded[31] &= 127;
+    aExpanded[31] |= 64;
+}
+
+/******************************************************************************/
+void
+ed25519_public(const unsigned char *aSeed, unsigned char *aPublic)
+{
+    unsigned char expanded[SHA512_DIGEST_LEN];
+    Point_ point;
+
+    ed25519_expand_(aSeed, expanded);
+    point_scale_base_(point, expanded);
+    point_pack_(aPublic, point);
+
+    explicit_bzero(expanded, sizeof(expanded));
+}
+
+/*----------------------------------------------------------------------------*/
+void
+ed25519_sign(
+    const unsigned char *aSeed, const unsigned char *aPublic,
+    const void *aMsg, size_t aMsgLen, unsigned char *aSignature)
+{
+    unsigned char expanded[SHA512_DIGEST_LEN];
+    unsigned char nonce[SHA512_DIGEST_LEN];
+    unsigned char challenge[SHA512_DIGEST_LEN];
+    int64_t value[64];
+    Point_ point;
+
+    struct Sha512 sha;
+
+    ed25519_expand_(aSeed, expanded);
+
+    /* The nonce is derived from the second half of the expanded
+     * secret and the message, so that signing is deterministic.
+     */
+
+    sha512_init(&sha);
+    sha512_update(&sha, expanded + 32, 32);
+    sha512_update(&sha, aMsg, aMsgLen);
+    sha512_final(&sha, nonce);
+    scalar_reduce_(nonce);
+
+    point_scale_base_(point, nonce);
+    point_pack_(aSignature, point);
+
+    sha512_init(&sha);
+    sha512_update(&sha, aSignature, 32);
+    sha512_update(&sha, aPublic, ED25519_PUBLIC_LEN);
+    sha512_update(&sha, aMsg, aMsgLen);
+    sha512_final(&sha, challenge);
+    scalar_reduce_(challenge);
+
+    for (int ix = 0; ix < 64; ++ix)
+        value[ix] = 0;
+    for (int ix = 0; ix < 32; ++ix)
+        value[ix] = nonce[ix];
+    for (int ix = 0; ix < 32; ++ix) {
+        for (int jx = 0; jx < 32; ++jx)
+            value[ix+jx] += challenge[ix] * (int64_t) expanded[jx];
+    }
+
+    scalar_reduce_wide_(aSignature + 32, value);
+
+    explicit_bzero(expanded, sizeof(expanded));
+    explicit_bzero(nonce, sizeof(nonce));
+    explicit_bzero(value, sizeof(value));
+}
+
+/******************************************************************************/
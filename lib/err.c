@@ -58,6 +58,21 @@ errorv_(const char *aFmt, va_list argp)
     errno = errCode;
 }
 
+/******************************************************************************/
+void
+info(const char *aFmt, ...)
+{
+    int errCode = errno;
+
+    va_list argp;
+
+    va_start(argp, aFmt);
+    alert_(aFmt, "INFO", 0, argp);
+    va_end(argp);
+
+    errno = errCode;
+}
+
 /******************************************************************************/
 void
 warn(const char *aFmt, ...)
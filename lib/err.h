@@ -26,6 +26,9 @@ extern const char DebugDisable[];
 PRINTF_FORMAT(1, 2)
 void debug(const char *aFmt, ...);
 
+PRINTF_FORMAT(1, 2)
+void info(const char *aFmt, ...);
+
 PRINTF_FORMAT(1, 2)
 void warn(const char *aFmt, ...);
 
@@ -49,6 +49,30 @@ Finally:
     return rc;
 }
 
+/*----------------------------------------------------------------------------*/
+int
+fd_inherit(int aFd)
+{
+    int rc = -1;
+
+    int arg;
+
+    arg = fcntl(aFd, F_GETFD);
+    if (-1 == arg)
+        goto Finally;
+
+    arg &= ~FD_CLOEXEC;
+
+    if (-1 == fcntl(aFd, F_SETFD, arg))
+        goto Finally;
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
 /*----------------------------------------------------------------------------*/
 int
 fd_nonblock(int aFd)
@@ -19,6 +19,7 @@
 #include <sys/types.h>
 
 int fd_cloexec(int aFd);
+int fd_inherit(int aFd);
 int fd_nonblock(int aFd);
 int fd_close(int aFd);
 
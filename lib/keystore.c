@@ -0,0 +1,465 @@
+/**
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+
+#include "keystore.h"
+
+#include "macros.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/******************************************************************************/
+#define KEYSTORE_TRIES_ 64
+
+/*----------------------------------------------------------------------------*/
+static size_t
+keystore_size_(unsigned aRecords)
+{
+    return sizeof(struct Keystore) + aRecords * sizeof(struct KeystoreRecord);
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+keystore_snapshot_(
+    const struct KeystoreRecord *aRecord, struct KeystoreEntry *aEntry)
+{
+    for (unsigned tx = 0; tx < KEYSTORE_TRIES_; ++tx) {
+
+        uint32_t seq = atomic_load_explicit(
+            &aRecord->mSeq, memory_order_acquire);
+
+        if (!(seq & 1)) {
+            memcpy(aEntry, &aRecord->mEntry, sizeof(*aEntry));
+
+            atomic_thread_fence(memory_order_acquire);
+
+            if (seq == atomic_load_explicit(
+                    &aRecord->mSeq, memory_order_relaxed))
+                return 0;
+        }
+
+        sched_yield();
+    }
+
+    explicit_bzero(aEntry, sizeof(*aEntry));
+
+    errno = EAGAIN;
+    return -1;
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+keystore_write_(struct KeystoreRecord *aRecord, const struct KeystoreEntry *aEntry)
+{
+    /* Only the holder of the writer lock changes records, so the
+     * sequence number can be advanced without contention.
+     */
+
+    uint32_t seq = atomic_load_explicit(&aRecord->mSeq, memory_order_relaxed);
+
+    atomic_store_explicit(&aRecord->mSeq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    if (aEntry)
+        memcpy(&aRecord->mEntry, aEntry, sizeof(*aEntry));
+    else
+        explicit_bzero(&aRecord->mEntry, sizeof(aRecord->mEntry));
+
+    atomic_store_explicit(&aRecord->mSeq, seq + 2, memory_order_release);
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+keystore_lock_(struct Keystore *self)
+{
+    int pid = getpid();
+
+    for (unsigned tx = 0; tx < KEYSTORE_TRIES_; ++tx) {
+
+        int holder = 0;
+
+        if (atomic_compare_exchange_strong(&self->mWriterPid, &holder, pid))
+            return 0;
+
+        if (kill(holder, 0) && ESRCH == errno &&
+                atomic_compare_exchange_strong(
+                    &self->mWriterPid, &holder, pid)) {
+
+            /* A record is left odd if the holder died while writing
+             * it. The content cannot be trusted, so wipe the record.
+             */
+
+            for (unsigned rx = 0; rx < self->mRecords; ++rx) {
+                struct KeystoreRecord *record = &self->mRecord[rx];
+
+                uint32_t seq = atomic_load(&record->mSeq);
+                if (seq & 1) {
+                    explicit_bzero(&record->mEntry, sizeof(record->mEntry));
+                    atomic_store(&record->mSeq, seq + 1);
+                }
+            }
+
+            return 0;
+        }
+
+        sched_yield();
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+keystore_unlock_(struct Keystore *self)
+{
+    atomic_store(&self->mWriterPid, 0);
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+keystore_find_(
+    const struct Keystore *self,
+    const unsigned char *aPublic, struct KeystoreEntry *aEntry)
+{
+    for (unsigned rx = 0; rx < self->mRecords; ++rx) {
+
+        if (keystore_snapshot_(&self->mRecord[rx], aEntry))
+            continue;
+
+        if (aEntry->mUsed &&
+                !memcmp(aEntry->mPublic, aPublic, ED25519_PUBLIC_LEN))
+            return rx;
+    }
+
+    explicit_bzero(aEntry, sizeof(*aEntry));
+
+    return -1;
+}
+
+/*----------------------------------------------------------------------------*/
+static struct Keystore *
+keystore_map_(int aFd, size_t aSize)
+{
+    int rc = -1;
+
+    struct Keystore *self = mmap(
+        0, aSize, PROT_READ | PROT_WRITE, MAP_SHARED, aFd, 0);
+
+    if (MAP_FAILED == self) {
+        self = 0;
+        goto Finally;
+    }
+
+    if (madvise(self, aSize, MADV_DONTDUMP))
+        goto Finally;
+
+    if (mlock(self, aSize))
+        goto Finally;
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        if (rc && self) {
+            munmap(self, aSize);
+            self = 0;
+        }
+    });
+
+    return self;
+}
+
+/******************************************************************************/
+struct Keystore *
+keystore_create(unsigned aRecords, int *aFd)
+{
+    int rc = -1;
+
+    int fd = -1;
+
+    struct Keystore *self = 0;
+
+    size_t size = keystore_size_(aRecords);
+
+    fd = memfd_create("keystore", MFD_CLOEXEC);
+    if (-1 == fd)
+        goto Finally;
+
+    if (ftruncate(fd, size))
+        goto Finally;
+
+    self = keystore_map_(fd, size);
+    if (!self)
+        goto Finally;
+
+    self->mRecords = aRecords;
+
+    *aFd = fd;
+    fd = -1;
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        if (-1 != fd)
+            close(fd);
+
+        if (rc)
+            self = keystore_close(self);
+    });
+
+    return self;
+}
+
+/*----------------------------------------------------------------------------*/
+struct Keystore *
+keystore_attach(int aFd)
+{
+    int rc = -1;
+
+    struct Keystore *self = 0;
+
+    struct stat fileStat;
+    if (fstat(aFd, &fileStat))
+        goto Finally;
+
+    if (sizeof(*self) > fileStat.st_size) {
+        errno = EINVAL;
+        goto Finally;
+    }
+
+    self = keystore_map_(aFd, fileStat.st_size);
+    if (!self)
+        goto Finally;
+
+    if (keystore_size_(self->mRecords) != fileStat.st_size) {
+        errno = EINVAL;
+        munmap(self, fileStat.st_size);
+        self = 0;
+        goto Finally;
+    }
+
+    rc = 0;
+
+Finally:
+
+    return rc ? 0 : self;
+}
+
+/*----------------------------------------------------------------------------*/
+struct Keystore *
+keystore_close(struct Keystore *self)
+{
+    if (self) {
+        size_t size = keystore_size_(self->mRecords);
+
+        explicit_bzero(self->mRecord, size - sizeof(*self));
+        munmap(self, size);
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+keystore_add(
+    struct Keystore *self,
+    const unsigned char *aPublic, const unsigned char *aSeed,
+    const char *aComment, size_t aCommentLen)
+{
+    int rc = -1;
+
+    int locked = 0;
+
+    struct KeystoreEntry entry;
+
+    /* Refuse keys whose public half does not match the private seed,
+     * because the signatures would not verify.
+     */
+
+    unsigned char public[ED25519_PUBLIC_LEN];
+    ed25519_public(aSeed, public);
+
+    if (memcmp(public, aPublic, sizeof(public))) {
+        errno = EINVAL;
+        goto Finally;
+    }
+
+    if (KEYSTORE_COMMENT_LEN < aCommentLen)
+        aCommentLen = KEYSTORE_COMMENT_LEN;
+
+    if (keystore_lock_(self))
+        goto Finally;
+
+    locked = 1;
+
+    int rx = keystore_find_(self, aPublic, &entry);
+
+    for (unsigned ix = 0; -1 == rx && ix < self->mRecords; ++ix) {
+        if (!keystore_snapshot_(&self->mRecord[ix], &entry) && !entry.mUsed)
+            rx = ix;
+    }
+
+    if (-1 == rx) {
+        errno = ENOSPC;
+        goto Finally;
+    }
+
+    entry.mUsed = 1;
+    entry.mCommentLen = aCommentLen;
+    memcpy(entry.mPublic, aPublic, sizeof(entry.mPublic));
+    memcpy(entry.mSeed, aSeed, sizeof(entry.mSeed));
+    memset(entry.mComment, 0, sizeof(entry.mComment));
+    memcpy(entry.mComment, aComment, aCommentLen);
+
+    keystore_write_(&self->mRecord[rx], &entry);
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        explicit_bzero(&entry, sizeof(entry));
+
+        if (locked)
+            keystore_unlock_(self);
+    });
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+keystore_remove(struct Keystore *self, const unsigned char *aPublic)
+{
+    int rc = -1;
+
+    int locked = 0;
+
+    struct KeystoreEntry entry;
+
+    if (keystore_lock_(self))
+        goto Finally;
+
+    locked = 1;
+
+    int rx = keystore_find_(self, aPublic, &entry);
+    if (-1 == rx) {
+        errno = ENOENT;
+        goto Finally;
+    }
+
+    keystore_write_(&self->mRecord[rx], 0);
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        explicit_bzero(&entry, sizeof(entry));
+
+        if (locked)
+            keystore_unlock_(self);
+    });
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+keystore_remove_all(struct Keystore *self)
+{
+    int rc = -1;
+
+    if (keystore_lock_(self))
+        goto Finally;
+
+    for (unsigned rx = 0; rx < self->mRecords; ++rx)
+        keystore_write_(&self->mRecord[rx], 0);
+
+    keystore_unlock_(self);
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+keystore_read(
+    const struct Keystore *self, unsigned aIndex, struct KeystoreEntry *aEntry)
+{
+    if (aIndex >= self->mRecords) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (keystore_snapshot_(&self->mRecord[aIndex], aEntry))
+        return -1;
+
+    explicit_bzero(aEntry->mSeed, sizeof(aEntry->mSeed));
+
+    if (!aEntry->mUsed) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+keystore_sign(
+    const struct Keystore *self, const unsigned char *aPublic,
+    const void *aMsg, size_t aMsgLen, unsigned char *aSignature)
+{
+    int rc = -1;
+
+    struct KeystoreEntry entry;
+
+    if (-1 == keystore_find_(self, aPublic, &entry)) {
+        errno = ENOENT;
+        goto Finally;
+    }
+
+    ed25519_sign(entry.mSeed, entry.mPublic, aMsg, aMsgLen, aSignature);
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        explicit_bzero(&entry, sizeof(entry));
+    });
+
+    return rc;
+}
+
+/******************************************************************************/
@@ -0,0 +1,90 @@
+#ifndef KEYSTORE_H_
+#define KEYSTORE_H_
+/**
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include "ed25519.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/******************************************************************************/
+/* A keystore holds private keys in a fixed number of records that are
+ * shared by all processes. The records are locked in memory so that
+ * they are never written to swap, and are excluded from core dumps.
+ * Only ed25519 keys are held, and the private seed of a key never
+ * leaves the keystore. The keystore is backed by an anonymous file
+ * whose descriptor is owned by the caller, so that the keystore can
+ * be attached again by a process that inherits the descriptor.
+ *
+ * Records are changed by at most one process at a time, and each
+ * record is guarded by a sequence number that is odd while the record
+ * is being written so that readers can retry.
+ */
+
+#define KEYSTORE_COMMENT_LEN 256
+
+struct KeystoreEntry {
+    uint32_t mUsed;
+    uint32_t mCommentLen;
+
+    unsigned char mPublic[ED25519_PUBLIC_LEN];
+    unsigned char mSeed[ED25519_SEED_LEN];
+
+    char mComment[KEYSTORE_COMMENT_LEN];
+};
+
+struct KeystoreRecord {
+    atomic_uint_least32_t mSeq;
+    uint32_t mReserved;
+
+    struct KeystoreEntry mEntry;
+};
+
+struct Keystore {
+    uint32_t mRecords;
+    uint32_t mReserved;
+
+    /* The writer lock records the pid of its holder so that it can be
+     * recovered if the holder dies.
+     */
+
+    atomic_int mWriterPid;
+    uint32_t mReserved2;
+
+    struct KeystoreRecord mRecord[];
+};
+
+struct Keystore *keystore_create(unsigned aRecords, int *aFd);
+struct Keystore *keystore_attach(int aFd);
+struct Keystore *keystore_close(struct Keystore *self);
+
+int keystore_add(
+    struct Keystore *self,
+    const unsigned char *aPublic, const unsigned char *aSeed,
+    const char *aComment, size_t aCommentLen);
+int keystore_remove(struct Keystore *self, const unsigned char *aPublic);
+int keystore_remove_all(struct Keystore *self);
+
+int keystore_read(
+    const struct Keystore *self, unsigned aIndex, struct KeystoreEntry *aEntry);
+int keystore_sign(
+    const struct Keystore *self, const unsigned char *aPublic,
+    const void *aMsg, size_t aMsgLen, unsigned char *aSignature);
+
+#endif
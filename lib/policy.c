@@ -0,0 +1,493 @@
+/**
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "policy.h"
+
+#include "err.h"
+
+#include "macros.h"
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/******************************************************************************/
+struct PolicyRule_ {
+    int mAllow;
+
+    int   mHasUid;
+    uid_t mUid;
+
+    char *mExe;
+
+    int mHasKey;
+    unsigned char mDigest[SHA256_DIGEST_LEN];
+
+    char *mType;
+    char *mComment;
+};
+
+struct Policy {
+    unsigned mRules;
+    struct PolicyRule_ *mRule;
+
+    /* Rules that do not name a key are searched in order. Rules that
+     * name a key are placed in an open addressed table. Rules naming
+     * the same key are inserted in order, so they are found in order
+     * by probing from the slot of the digest.
+     */
+
+    unsigned mGenericRules;
+    unsigned *mGenericRule;
+
+    size_t mSlots;
+    unsigned *mSlot;
+};
+
+/*----------------------------------------------------------------------------*/
+static size_t
+policy_hash_(const unsigned char *aDigest)
+{
+    size_t hash = 0;
+    for (int bx = 0; bx < sizeof(hash); ++bx)
+        hash = (hash << 8) | aDigest[bx];
+
+    return hash;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+policy_fingerprint_(const char *aFingerprint, unsigned char *aDigest)
+{
+    int rc = -1;
+
+    static const char prefix[] = "SHA256:";
+
+    if (strncmp(prefix, aFingerprint, sizeof(prefix) - 1)) {
+        errno = EINVAL;
+        goto Finally;
+    }
+
+    /* Decode the unpadded base64 digest printed by ssh-keygen(1) */
+
+    const char *base64 = aFingerprint + sizeof(prefix) - 1;
+
+    uint32_t bits = 0;
+    unsigned numBits = 0;
+    unsigned numBytes = 0;
+
+    for (const char *ch = base64; *ch; ++ch) {
+        unsigned value;
+
+        if ('A' <= *ch && *ch <= 'Z')
+            value = *ch - 'A';
+        else if ('a' <= *ch && *ch <= 'z')
+            value = *ch - 'a' + 26;
+        else if ('0' <= *ch && *ch <= '9')
+            value = *ch - '0' + 52;
+        else if ('+' == *ch)
+            value = 62;
+        else if ('/' == *ch)
+            value = 63;
+        else {
+            errno = EINVAL;
+            goto Finally;
+        }
+
+        bits = (bits << 6) | value;
+        numBits += 6;
+
+        if (8 <= numBits) {
+            if (SHA256_DIGEST_LEN <= numBytes) {
+                errno = EINVAL;
+                goto Finally;
+            }
+
+            numBits -= 8;
+            aDigest[numBytes++] = bits >> numBits;
+        }
+    }
+
+    if (SHA256_DIGEST_LEN != numBytes) {
+        errno = EINVAL;
+        goto Finally;
+    }
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+policy_uid_(const char *aUid, uid_t *aOut)
+{
+    int rc = -1;
+
+    char *end;
+
+    errno = 0;
+    unsigned long uid = strtoul(aUid, &end, 10);
+    if (!errno && end != aUid && !*end && uid == (uid_t) uid) {
+        *aOut = uid;
+
+    } else {
+        struct passwd *passwd = getpwnam(aUid);
+        if (!passwd) {
+            errno = EINVAL;
+            goto Finally;
+        }
+
+        *aOut = passwd->pw_uid;
+    }
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+policy_parse_rule_(struct PolicyRule_ *aRule, char *aLine)
+{
+    int rc = -1;
+
+    char *save;
+
+    char *action = strtok_r(aLine, " \t\n", &save);
+
+    if (!strcmp("allow", action))
+        aRule->mAllow = 1;
+    else if (!strcmp("deny", action))
+        aRule->mAllow = 0;
+    else {
+        errno = EINVAL;
+        goto Finally;
+    }
+
+    for (char *cond; (cond = strtok_r(0, " \t\n", &save)); ) {
+
+        if ('#' == *cond)
+            break;
+
+        char *value = strchr(cond, '=');
+        if (!value || !value[1]) {
+            errno = EINVAL;
+            goto Finally;
+        }
+
+        *value++ = 0;
+
+        char **field = 0;
+
+        if (!strcmp("uid", cond)) {
+            if (policy_uid_(value, &aRule->mUid))
+                goto Finally;
+            aRule->mHasUid = 1;
+
+        } else if (!strcmp("key", cond)) {
+            if (policy_fingerprint_(value, aRule->mDigest))
+                goto Finally;
+            aRule->mHasKey = 1;
+
+        } else if (!strcmp("exe", cond)) {
+            field = &aRule->mExe;
+        } else if (!strcmp("type", cond)) {
+            field = &aRule->mType;
+        } else if (!strcmp("comment", cond)) {
+            field = &aRule->mComment;
+        } else {
+            errno = EINVAL;
+            goto Finally;
+        }
+
+        if (field) {
+            free(*field);
+            *field = strdup(value);
+            if (!*field)
+                goto Finally;
+        }
+    }
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+policy_index_(struct Policy *self)
+{
+    int rc = -1;
+
+    unsigned keyRules = 0;
+    for (unsigned rx = 0; rx < self->mRules; ++rx)
+        keyRules += !!self->mRule[rx].mHasKey;
+
+    self->mSlots = 2;
+    while (self->mSlots < 2 * (size_t) keyRules)
+        self->mSlots *= 2;
+
+    self->mSlot = calloc(self->mSlots, sizeof(*self->mSlot));
+    self->mGenericRule = calloc(
+        self->mRules ? self->mRules : 1, sizeof(*self->mGenericRule));
+    if (!self->mSlot || !self->mGenericRule)
+        goto Finally;
+
+    for (unsigned rx = 0; rx < self->mRules; ++rx) {
+        const struct PolicyRule_ *rule = &self->mRule[rx];
+
+        if (!rule->mHasKey) {
+            self->mGenericRule[self->mGenericRules++] = rx;
+            continue;
+        }
+
+        size_t sx = policy_hash_(rule->mDigest) & (self->mSlots - 1);
+        while (self->mSlot[sx])
+            sx = (sx + 1) & (self->mSlots - 1);
+
+        self->mSlot[sx] = rx + 1;
+    }
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static unsigned
+policy_next_key_rule_(
+    const struct Policy *self, const unsigned char *aDigest, size_t *aSlot)
+{
+    while (self->mSlot[*aSlot]) {
+
+        unsigned rx = self->mSlot[*aSlot] - 1;
+
+        *aSlot = (*aSlot + 1) & (self->mSlots - 1);
+
+        if (!memcmp(self->mRule[rx].mDigest, aDigest, SHA256_DIGEST_LEN))
+            return rx;
+    }
+
+    return UINT_MAX;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+policy_match_(
+    const struct PolicyRule_ *aRule,
+    const struct PolicyClient *aClient, const struct PolicyKey *aKey,
+    char **aComment)
+{
+    if (aRule->mHasUid && aRule->mUid != aClient->mUid)
+        return 0;
+
+    if (aRule->mExe) {
+        if (!aClient->mExe || fnmatch(aRule->mExe, aClient->mExe, 0))
+            return 0;
+    }
+
+    if (aRule->mType) {
+        if (strlen(aRule->mType) != aKey->mTypeLen ||
+                memcmp(aRule->mType, aKey->mType, aKey->mTypeLen))
+            return 0;
+    }
+
+    if (aRule->mComment) {
+        if (!*aComment) {
+            *aComment = strndup(aKey->mComment, aKey->mCommentLen);
+            if (!*aComment)
+                return -1;
+        }
+
+        if (fnmatch(aRule->mComment, *aComment, 0))
+            return 0;
+    }
+
+    return 1;
+}
+
+/******************************************************************************/
+struct Policy *
+policy_load(const char *aPath)
+{
+    int rc = -1;
+
+    struct Policy *self = 0;
+
+    FILE *file = 0;
+    char *line = 0;
+    size_t lineSize = 0;
+
+    self = calloc(1, sizeof(*self));
+    if (!self)
+        goto Finally;
+
+    file = fopen(aPath, "re");
+    if (!file) {
+        warn("Unable to open policy %s", aPath);
+        goto Finally;
+    }
+
+    unsigned lineNo = 0;
+    unsigned maxRules = 0;
+
+    while (-1 != getline(&line, &lineSize, file)) {
+
+        ++lineNo;
+
+        char *text = line + strspn(line, " \t\n");
+        if (!*text || '#' == *text)
+            continue;
+
+        if (self->mRules == maxRules) {
+            maxRules = maxRules ? 2 * maxRules : 16;
+
+            struct PolicyRule_ *rules = realloc(
+                self->mRule, maxRules * sizeof(*rules));
+            if (!rules)
+                goto Finally;
+
+            self->mRule = rules;
+        }
+
+        struct PolicyRule_ *rule = &self->mRule[self->mRules++];
+        memset(rule, 0, sizeof(*rule));
+
+        if (policy_parse_rule_(rule, text)) {
+            warn("Unable to parse policy %s line %u", aPath, lineNo);
+            goto Finally;
+        }
+    }
+
+    if (ferror(file)) {
+        warn("Unable to read policy %s", aPath);
+        goto Finally;
+    }
+
+    if (policy_index_(self))
+        goto Finally;
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        free(line);
+
+        if (file)
+            fclose(file);
+
+        if (rc)
+            self = policy_close(self);
+    });
+
+    return self;
+}
+
+/*----------------------------------------------------------------------------*/
+struct Policy *
+policy_close(struct Policy *self)
+{
+    if (self) {
+        for (unsigned rx = 0; rx < self->mRules; ++rx) {
+            free(self->mRule[rx].mExe);
+            free(self->mRule[rx].mType);
+            free(self->mRule[rx].mComment);
+        }
+
+        free(self->mRule);
+        free(self->mGenericRule);
+        free(self->mSlot);
+        free(self);
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+policy_allow(
+    const struct Policy *self,
+    const struct PolicyClient *aClient, const struct PolicyKey *aKey)
+{
+    int allow = 1;
+
+    char *comment = 0;
+
+    /* Merge the rules that name the key with the rules that do not
+     * name any key, so that rules are considered in the order that
+     * they appear in the policy.
+     */
+
+    size_t slot = policy_hash_(aKey->mDigest) & (self->mSlots - 1);
+
+    unsigned keyRule = policy_next_key_rule_(self, aKey->mDigest, &slot);
+    unsigned genericIndex = 0;
+
+    while (1) {
+
+        unsigned genericRule = genericIndex < self->mGenericRules
+            ? self->mGenericRule[genericIndex]
+            : UINT_MAX;
+
+        unsigned rx;
+
+        if (keyRule < genericRule) {
+            rx = keyRule;
+            keyRule = policy_next_key_rule_(self, aKey->mDigest, &slot);
+        } else if (UINT_MAX != genericRule) {
+            rx = genericRule;
+            ++genericIndex;
+        } else
+            break;
+
+        /* A rule that cannot be evaluated might have denied the key,
+         * so the key is not allowed.
+         */
+
+        int match = policy_match_(&self->mRule[rx], aClient, aKey, &comment);
+
+        if (-1 == match) {
+            allow = -1;
+            break;
+        }
+
+        if (match) {
+            allow = self->mRule[rx].mAllow;
+            break;
+        }
+    }
+
+    free(comment);
+
+    return allow;
+}
+
+/******************************************************************************/
@@ -0,0 +1,60 @@
+#ifndef POLICY_H_
+#define POLICY_H_
+/**
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "sha256.h"
+
+#include <stddef.h>
+
+#include <sys/types.h>
+
+/******************************************************************************/
+/* A policy is an ordered list of rules that allow or deny keys to
+ * clients. The first rule whose conditions all match decides, and keys
+ * that match no rule are allowed. Rules that name a key fingerprint are
+ * indexed by digest so that a long list of such rules costs little for
+ * keys that they do not name.
+ *
+ * If a rule cannot be evaluated, policy_allow() returns -1 rather than
+ * decide, so that the caller can refuse the key.
+ */
+
+struct Policy;
+
+struct PolicyClient {
+    uid_t mUid;
+    const char *mExe;
+};
+
+struct PolicyKey {
+    const unsigned char *mDigest;
+
+    const char *mType;
+    size_t      mTypeLen;
+
+    const char *mComment;
+    size_t      mCommentLen;
+};
+
+struct Policy *policy_load(const char *aPath);
+struct Policy *policy_close(struct Policy *self);
+
+int policy_allow(
+    const struct Policy *self,
+    const struct PolicyClient *aClient, const struct PolicyKey *aKey);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef PROBE_H_
+#define PROBE_H_
+/**
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/******************************************************************************/
+/* Static tracepoints are compiled using the sys/sdt.h interface so that
+ * they can be used by bpftrace(8), dtrace(1), and SystemTap. Without
+ * sys/sdt.h, or when PROBE_DISABLE is defined, the tracepoints compile
+ * to nothing.
+ */
+
+#if defined(__has_include) && !defined(PROBE_DISABLE)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE_SDT_
+#endif
+#endif
+
+#ifdef PROBE_SDT_
+
+#define PROBE_NARGS_(_1, _2, _3, _4, _5, _6, N, ...) N
+#define PROBE_CONCAT_(Prefix, Suffix) Prefix ## Suffix
+#define PROBE_DTRACE_(N) PROBE_CONCAT_(DTRACE_PROBE, N)
+
+#define PROBE(Name, ...) \
+    PROBE_DTRACE_(PROBE_NARGS_(__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)) \
+        (ssh_double_agent, Name, __VA_ARGS__)
+
+#else
+
+#define PROBE(Name, ...) do { } while (0)
+
+#endif
+
+#endif
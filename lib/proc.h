@@ -23,6 +23,9 @@ pid_t x_proc_execute(char **aCmd);
 int proc_fd(pid_t aPid);
 int proc_fd_read(pid_t aProcFd);
 
+int proc_exe(pid_t aPid, char *aBuf, size_t aBufLen);
+int proc_cgroup(pid_t aPid, char *aBuf, size_t aBufLen);
+
 int x_proc_monitor_create(pid_t aParentPid, int aWatchFd);
 int x_proc_monitor_wait(int aMonitorFd);
 int x_proc_monitor_close(int aMonitorFd);
@@ -17,6 +17,7 @@
 #include "err.h"
 #include "fd.h"
 
+#include <libproc.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -88,4 +89,26 @@ Finally:
     return rc ? rc : events;
 }
 
+/*----------------------------------------------------------------------------*/
+int proc_exe(pid_t aPid, char *aBuf, size_t aBufLen)
+{
+    int rc = -1;
+
+    if (0 >= proc_pidpath(aPid, aBuf, aBufLen))
+        goto Finally;
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+int proc_cgroup(pid_t aPid, char *aBuf, size_t aBufLen)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
 /******************************************************************************/
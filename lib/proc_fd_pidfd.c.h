@@ -17,9 +17,12 @@
 #include "err.h"
 #include "fd.h"
 
+#include <limits.h>
 #include <poll.h>
+#include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <sys/syscall.h>
@@ -82,4 +85,78 @@ Finally:
     return rc ? rc : events;
 }
 
+/*----------------------------------------------------------------------------*/
+int proc_exe(pid_t aPid, char *aBuf, size_t aBufLen)
+{
+    int rc = -1;
+
+    char exePath[64];
+    snprintf(exePath, sizeof(exePath), "/proc/%d/exe", aPid);
+
+    ssize_t exeLen = readlink(exePath, aBuf, aBufLen);
+    if (-1 == exeLen)
+        goto Finally;
+
+    if (aBufLen <= exeLen) {
+        errno = ENAMETOOLONG;
+        goto Finally;
+    }
+
+    aBuf[exeLen] = 0;
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+int proc_cgroup(pid_t aPid, char *aBuf, size_t aBufLen)
+{
+    int rc = -1;
+
+    FILE *cgroupFile = 0;
+
+    char cgroupPath[64];
+    snprintf(cgroupPath, sizeof(cgroupPath), "/proc/%d/cgroup", aPid);
+
+    cgroupFile = fopen(cgroupPath, "re");
+    if (!cgroupFile)
+        goto Finally;
+
+    /* Only the unified hierarchy, which is listed with hierarchy id 0,
+     * names a single cgroup for the process.
+     */
+
+    char line[PATH_MAX + 8];
+    while (fgets(line, sizeof(line), cgroupFile)) {
+        if (strncmp("0::", line, 3))
+            continue;
+
+        size_t cgroupLen = strcspn(line + 3, "\n");
+        if (aBufLen <= cgroupLen) {
+            errno = ENAMETOOLONG;
+            goto Finally;
+        }
+
+        memcpy(aBuf, line + 3, cgroupLen);
+        aBuf[cgroupLen] = 0;
+
+        rc = 0;
+        goto Finally;
+    }
+
+    errno = ENOENT;
+
+Finally:
+
+    FINALLY({
+        if (cgroupFile)
+            fclose(cgroupFile);
+    });
+
+    return rc;
+}
+
 /******************************************************************************/
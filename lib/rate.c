@@ -0,0 +1,85 @@
+/**
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include "rate.h"
+
+#include <errno.h>
+
+/******************************************************************************/
+int
+rate_limit(struct RateLimit *self, unsigned aRate, unsigned aBurst)
+{
+    int rc = -1;
+
+    if (!aRate || !aBurst) {
+        errno = EINVAL;
+        goto Finally;
+    }
+
+    self->mIntervalNs = UINT64_C(1000000000) / aRate;
+    if (!self->mIntervalNs)
+        self->mIntervalNs = 1;
+
+    self->mBurstNs = self->mIntervalNs * (aBurst - 1);
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+uint64_t
+rate_acquire(
+    const struct RateLimit *self, atomic_uint_least64_t *aBucket,
+    uint64_t aNowNs)
+{
+    /* The bucket records the time at which it will be empty if no more
+     * tokens are taken. A token can be taken if that time is no further
+     * ahead than the burst allows, otherwise return the time remaining
+     * until a token can be taken.
+     */
+
+    uint64_t emptyNs = atomic_load_explicit(aBucket, memory_order_relaxed);
+
+    while (1) {
+        uint64_t fromNs = emptyNs > aNowNs ? emptyNs : aNowNs;
+
+        if (fromNs - aNowNs > self->mBurstNs)
+            return fromNs - aNowNs - self->mBurstNs;
+
+        if (atomic_compare_exchange_weak_explicit(
+                aBucket, &emptyNs, fromNs + self->mIntervalNs,
+                memory_order_relaxed, memory_order_relaxed))
+            return 0;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+int
+rate_idle(atomic_uint_least64_t *aBucket, uint64_t aNowNs)
+{
+    /* A bucket that has refilled completely is indistinguishable from
+     * a bucket that has never been used.
+     */
+
+    return atomic_load_explicit(aBucket, memory_order_relaxed) <= aNowNs;
+}
+
+/******************************************************************************/
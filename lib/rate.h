@@ -0,0 +1,44 @@
+#ifndef RATE_H_
+#define RATE_H_
+/**
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/******************************************************************************/
+/* A rate limit is a token bucket that earns one token in each interval,
+ * and holds at most a burst of tokens. The state of each bucket is the
+ * single time at which the bucket would next be empty, so that buckets
+ * can be shared by processes, and updated without locking.
+ */
+
+struct RateLimit {
+    uint64_t mIntervalNs;
+    uint64_t mBurstNs;
+};
+
+int rate_limit(struct RateLimit *self, unsigned aRate, unsigned aBurst);
+
+uint64_t rate_acquire(
+    const struct RateLimit *self, atomic_uint_least64_t *aBucket,
+    uint64_t aNowNs);
+
+int rate_idle(atomic_uint_least64_t *aBucket, uint64_t aNowNs);
+
+#endif
@@ -0,0 +1,181 @@
+/**
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "sha256.h"
+
+#include <string.h>
+
+/******************************************************************************/
+static const uint32_t sha256K_[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32_(Value, Bits) (((Value) >> (Bits)) | ((Value) << (32 - (Bits))))
+
+/*----------------------------------------------------------------------------*/
+static void
+sha256_block_(struct Sha256 *self, const unsigned char *aBlock)
+{
+    uint32_t w[64];
+
+    for (int ix = 0; ix < 16; ++ix) {
+        w[ix] = (uint32_t) aBlock[4*ix+0] << 24 |
+                (uint32_t) aBlock[4*ix+1] << 16 |
+                (uint32_t) aBlock[4*ix+2] <<  8 |
+                (uint32_t) aBlock[4*ix+3] <<  0;
+    }
+
+    for (int ix = 16; ix < 64; ++ix) {
+        uint32_t s0 =
+            ROR32_(w[ix-15], 7) ^ ROR32_(w[ix-15], 18) ^ (w[ix-15] >> 3);
+        uint32_t s1 =
+            ROR32_(w[ix-2], 17) ^ ROR32_(w[ix-2], 19) ^ (w[ix-2] >> 10);
+        w[ix] = w[ix-16] + s0 + w[ix-7] + s1;
+    }
+
+    uint32_t a = self->mState[0];
+    uint32_t b = self->mState[1];
+    uint32_t c = self->mState[2];
+    uint32_t d = self->mState[3];
+    uint32_t e = self->mState[4];
+    uint32_t f = self->mState[5];
+    uint32_t g = self->mState[6];
+    uint32_t h = self->mState[7];
+
+    for (int ix = 0; ix < 64; ++ix) {
+        uint32_t s1 = ROR32_(e, 6) ^ ROR32_(e, 11) ^ ROR32_(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + sha256K_[ix] + w[ix];
+        uint32_t s0 = ROR32_(a, 2) ^ ROR32_(a, 13) ^ ROR32_(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    self->mState[0] += a;
+    self->mState[1] += b;
+    self->mState[2] += c;
+    self->mState[3] += d;
+    self->mState[4] += e;
+    self->mState[5] += f;
+    self->mState[6] += g;
+    self->mState[7] += h;
+}
+
+/******************************************************************************/
+void
+sha256_init(struct Sha256 *self)
+{
+    static const uint32_t initialState[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(self->mState, initialState, sizeof(self->mState));
+    self->mLength = 0;
+    self->mBlockLen = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+void
+sha256_update(struct Sha256 *self, const void *aData, size_t aLen)
+{
+    const unsigned char *data = aData;
+
+    self->mLength += aLen;
+
+    while (aLen) {
+        size_t chunkLen = SHA256_BLOCK_LEN - self->mBlockLen;
+        if (chunkLen > aLen)
+            chunkLen = aLen;
+
+        memcpy(self->mBlock + self->mBlockLen, data, chunkLen);
+        self->mBlockLen += chunkLen;
+
+        data += chunkLen;
+        aLen -= chunkLen;
+
+        if (SHA256_BLOCK_LEN == self->mBlockLen) {
+            sha256_block_(self, self->mBlock);
+            self->mBlockLen = 0;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void
+sha256_final(struct Sha256 *self, unsigned char *aDigest)
+{
+    uint64_t bitLength = self->mLength * 8;
+
+    static const unsigned char padding[SHA256_BLOCK_LEN] = { 0x80 };
+
+    size_t padLen = SHA256_BLOCK_LEN - 8 - self->mBlockLen;
+    if (SHA256_BLOCK_LEN - 8 <= self->mBlockLen)
+        padLen += SHA256_BLOCK_LEN;
+
+    sha256_update(self, padding, padLen);
+
+    unsigned char lengthBytes[8];
+    for (int ix = 0; ix < 8; ++ix)
+        lengthBytes[ix] = bitLength >> (56 - 8 * ix);
+
+    sha256_update(self, lengthBytes, sizeof(lengthBytes));
+
+    for (int ix = 0; ix < 8; ++ix) {
+        aDigest[4*ix+0] = self->mState[ix] >> 24;
+        aDigest[4*ix+1] = self->mState[ix] >> 16;
+        aDigest[4*ix+2] = self->mState[ix] >>  8;
+        aDigest[4*ix+3] = self->mState[ix] >>  0;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void
+sha256(const void *aData, size_t aLen, unsigned char *aDigest)
+{
+    struct Sha256 sha;
+
+    sha256_init(&sha);
+    sha256_update(&sha, aData, aLen);
+    sha256_final(&sha, aDigest);
+}
+
+/******************************************************************************/
@@ -0,0 +1,210 @@
+/**
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+
+#include "sha512.h"
+
+#include <string.h>
+
+/******************************************************************************/
+static const uint64_t sha512K_[80] = {
+    UINT64_C(0x428a2f98d728ae22), UINT64_C(0x7137449123ef65cd),
+    UINT64_C(0xb5c0fbcfec4d3b2f), UINT64_C(0xe9b5dba58189dbbc),
+    UINT64_C(0x3956c25bf348b538), UINT64_C(0x59f111f1b605d019),
+    UINT64_C(0x923f82a4af194f9b), UINT64_C(0xab1c5ed5da6d8118),
+    UINT64_C(0xd807aa98a3030242), UINT64_C(0x12835b0145706fbe),
+    UINT64_C(0x243185be4ee4b28c), UINT64_C(0x550c7dc3d5ffb4e2),
+    UINT64_C(0x72be5d74f27b896f), UINT64_C(0x80deb1fe3b1696b1),
+    UINT64_C(0x9bdc06a725c71235), UINT64_C(0xc19bf174cf692694),
+    UINT64_C(0xe49b69c19ef14ad2), UINT64_C(0xefbe4786384f25e3),
+    UINT64_C(0x0fc19dc68b8cd5b5), UINT64_C(0x240ca1cc77ac9c65),
+    UINT64_C(0x2de92c6f592b0275), UINT64_C(0x4a7484aa6ea6e483),
+    UINT64_C(0x5cb0a9dcbd41fbd4), UINT64_C(0x76f988da831153b5),
+    UINT64_C(0x983e5152ee66dfab), UINT64_C(0xa831c66d2db43210),
+    UINT64_C(0xb00327c898fb213f), UINT64_C(0xbf597fc7beef0ee4),
+    UINT64_C(0xc6e00bf33da88fc2), UINT64_C(0xd5a79147930aa725),
+    UINT64_C(0x06ca6351e003826f), UINT64_C(0x142929670a0e6e70),
+    UINT64_C(0x27b70a8546d22ffc), UINT64_C(0x2e1b21385c26c926),
+    UINT64_C(0x4d2c6dfc5ac42aed), UINT64_C(0x53380d139d95b3df),
+    UINT64_C(0x650a73548baf63de), UINT64_C(0x766a0abb3c77b2a8),
+    UINT64_C(0x81c2c92e47edaee6), UINT64_C(0x92722c851482353b),
+    UINT64_C(0xa2bfe8a14cf10364), UINT64_C(0xa81a664bbc423001),
+    UINT64_C(0xc24b8b70d0f89791), UINT64_C(0xc76c51a30654be30),
+    UINT64_C(0xd192e819d6ef5218), UINT64_C(0xd69906245565a910),
+    UINT64_C(0xf40e35855771202a), UINT64_C(0x106aa07032bbd1b8),
+    UINT64_C(0x19a4c116b8d2d0c8), UINT64_C(0x1e376c085141ab53),
+    UINT64_C(0x2748774cdf8eeb99), UINT64_C(0x34b0bcb5e19b48a8),
+    UINT64_C(0x391c0cb3c5c95a63), UINT64_C(0x4ed8aa4ae3418acb),
+    UINT64_C(0x5b9cca4f7763e373), UINT64_C(0x682e6ff3d6b2b8a3),
+    UINT64_C(0x748f82ee5defb2fc), UINT64_C(0x78a5636f43172f60),
+    UINT64_C(0x84c87814a1f0ab72), UINT64_C(0x8cc702081a6439ec),
+    UINT64_C(0x90befffa23631e28), UINT64_C(0xa4506cebde82bde9),
+    UINT64_C(0xbef9a3f7b2c67915), UINT64_C(0xc67178f2e372532b),
+    UINT64_C(0xca273eceea26619c), UINT64_C(0xd186b8c721c0c207),
+    UINT64_C(0xeada7dd6cde0eb1e), UINT64_C(0xf57d4f7fee6ed178),
+    UINT64_C(0x06f067aa72176fba), UINT64_C(0x0a637dc5a2c898a6),
+    UINT64_C(0x113f9804bef90dae), UINT64_C(0x1b710b35131c471b),
+    UINT64_C(0x28db77f523047d84), UINT64_C(0x32caab7b40c72493),
+    UINT64_C(0x3c9ebe0a15c9bebc), UINT64_C(0x431d67c49c100d4c),
+    UINT64_C(0x4cc5d4becb3e42b6), UINT64_C(0x597f299cfc657e2a),
+    UINT64_C(0x5fcb6fab3ad6faec), UINT64_C(0x6c44198c4a475817),
+};
+
+#define ROR64_(Value, Bits) (((Value) >> (Bits)) | ((Value) << (64 - (Bits))))
+
+/*----------------------------------------------------------------------------*/
+static void
+sha512_block_(struct Sha512 *self, const unsigned char *aBlock)
+{
+    uint64_t w[80];
+
+    for (int ix = 0; ix < 16; ++ix) {
+        w[ix] = 0;
+        for (int bx = 0; bx < 8; ++bx)
+            w[ix] = (w[ix] << 8) | aBlock[8*ix+bx];
+    }
+
+    for (int ix = 16; ix < 80; ++ix) {
+        uint64_t s0 =
+            ROR64_(w[ix-15], 1) ^ ROR64_(w[ix-15], 8) ^ (w[ix-15] >> 7);
+        uint64_t s1 =
+            ROR64_(w[ix-2], 19) ^ ROR64_(w[ix-2], 61) ^ (w[ix-2] >> 6);
+        w[ix] = w[ix-16] + s0 + w[ix-7] + s1;
+    }
+
+    uint64_t a = self->mState[0];
+    uint64_t b = self->mState[1];
+    uint64_t c = self->mState[2];
+    uint64_t d = self->mState[3];
+    uint64_t e = self->mState[4];
+    uint64_t f = self->mState[5];
+    uint64_t g = self->mState[6];
+    uint64_t h = self->mState[7];
+
+    for (int ix = 0; ix < 80; ++ix) {
+        uint64_t s1 = ROR64_(e, 14) ^ ROR64_(e, 18) ^ ROR64_(e, 41);
+        uint64_t ch = (e & f) ^ (~e & g);
+        uint64_t t1 = h + s1 + ch + sha512K_[ix] + w[ix];
+        uint64_t s0 = ROR64_(a, 28) ^ ROR64_(a, 34) ^ ROR64_(a, 39);
+        uint64_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint64_t t2 = s0 + maj;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    self->mState[0] += a;
+    self->mState[1] += b;
+    self->mState[2] += c;
+    self->mState[3] += d;
+    self->mState[4] += e;
+    self->mState[5] += f;
+    self->mState[6] += g;
+    self->mState[7] += h;
+}
+
+/******************************************************************************/
+void
+sha512_init(struct Sha512 *self)
+{
+    static const uint64_t initialState[8] = {
+    UINT64_C(0x6a09e667f3bcc908), UINT64_C(0xbb67ae8584caa73b),
+    UINT64_C(0x3c6ef372fe94f82b), UINT64_C(0xa54ff53a5f1d36f1),
+    UINT64_C(0x510e527fade682d1), UINT64_C(0x9b05688c2b3e6c1f),
+    UINT64_C(0x1f83d9abfb41bd6b), UINT64_C(0x5be0cd19137e2179),
+    };
+
+    memcpy(self->mState, initialState, sizeof(self->mState));
+    self->mLength = 0;
+    self->mBlockLen = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+void
+sha512_update(struct Sha512 *self, const void *aData, size_t aLen)
+{
+    const unsigned char *data = aData;
+
+    self->mLength += aLen;
+
+    while (aLen) {
+        size_t chunkLen = SHA512_BLOCK_LEN - self->mBlockLen;
+        if (chunkLen > aLen)
+            chunkLen = aLen;
+
+        memcpy(self->mBlock + self->mBlockLen, data, chunkLen);
+        self->mBlockLen += chunkLen;
+
+        data += chunkLen;
+        aLen -= chunkLen;
+
+        if (SHA512_BLOCK_LEN == self->mBlockLen) {
+            sha512_block_(self, self->mBlock);
+            self->mBlockLen = 0;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void
+sha512_final(struct Sha512 *self, unsigned char *aDigest)
+{
+    uint64_t bitLength = self->mLength * 8;
+
+    static const unsigned char padding[SHA512_BLOCK_LEN] = { 0x80 };
+
+    /* The message length is encoded in 128 bits, of which only the
+     * low 64 bits can be non-zero here.
+     */
+
+    size_t padLen = SHA512_BLOCK_LEN - 16 - self->mBlockLen;
+    if (SHA512_BLOCK_LEN - 16 <= self->mBlockLen)
+        padLen += SHA512_BLOCK_LEN;
+
+    sha512_update(self, padding, padLen);
+
+    unsigned char lengthBytes[16] = { };
+    for (int ix = 0; ix < 8; ++ix)
+        lengthBytes[8+ix] = bitLength >> (56 - 8 * ix);
+
+    sha512_update(self, lengthBytes, sizeof(lengthBytes));
+
+    for (int ix = 0; ix < 8; ++ix) {
+        for (int bx = 0; bx < 8; ++bx)
+            aDigest[8*ix+bx] = self->mState[ix] >> (56 - 8 * bx);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void
+sha512(const void *aData, size_t aLen, unsigned char *aDigest)
+{
+    struct Sha512 sha;
+
+    sha512_init(&sha);
+    sha512_update(&sha, aData, aLen);
+    sha512_final(&sha, aDigest);
+}
+
+/******************************************************************************/
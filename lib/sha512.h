@@ -0,0 +1,40 @@
+#ifndef SHA512_H_
+#define SHA512_H_
+/**
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA512_DIGEST_LEN 64
+#define SHA512_BLOCK_LEN  128
+
+struct Sha512 {
+    uint64_t mState[8];
+    uint64_t mLength;
+    size_t   mBlockLen;
+    unsigned char mBlock[SHA512_BLOCK_LEN];
+};
+
+void sha512_init(struct Sha512 *self);
+void sha512_update(struct Sha512 *self, const void *aData, size_t aLen);
+void sha512_final(struct Sha512 *self, unsigned char *aDigest);
+
+void sha512(const void *aData, size_t aLen, unsigned char *aDigest);
+
+#endif
@@ -0,0 +1,195 @@
+/**
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "shm.h"
+
+#include "err.h"
+#include "fd.h"
+#include "un.h"
+
+#include "macros.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/******************************************************************************/
+int
+shm_name(const char *aPath, char *aName, size_t aNameLen)
+{
+    int rc = -1;
+
+    char *path = 0;
+
+    /* Shared memory names are limited in length on some platforms,
+     * so name the segment using a hash of the canonical path of the
+     * socket. Both the agent and its readers can compute the name
+     * because the socket exists for the lifetime of the agent. A
+     * socket in the abstract namespace has no path, and its name is
+     * already canonical.
+     *
+     * Segment names are global, so include the user in the name to
+     * keep the segments of different users apart.
+     */
+
+    path = un_abstract(aPath) ? strdup(aPath) : realpath(aPath, 0);
+    if (!path)
+        goto Finally;
+
+    uint32_t hash = 2166136261u;
+    for (const char *ch = path; *ch; ++ch) {
+        hash ^= (unsigned char) *ch;
+        hash *= 16777619u;
+    }
+
+    if (aNameLen <= snprintf(aName, aNameLen,
+            "/ssh-double-agent.%lu.%08" PRIx32,
+            (unsigned long) geteuid(), hash)) {
+        errno = ENAMETOOLONG;
+        goto Finally;
+    }
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        free(path);
+    });
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+shm_create(const char *aName, size_t aSize)
+{
+    int rc = -1;
+
+    int shmFd = -1;
+
+    /* Any segment left behind by a previous agent that used the same
+     * socket path is stale because the socket path is now owned by
+     * the caller. A segment created by another user cannot be removed,
+     * and the exclusive create then fails rather than use it.
+     */
+
+    if (shm_unlink(aName) && ENOENT != errno)
+        goto Finally;
+
+    shmFd = shm_open(aName, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (-1 == shmFd)
+        goto Finally;
+
+    if (ftruncate(shmFd, aSize))
+        goto Finally;
+
+    if (fd_cloexec(shmFd))
+        goto Finally;
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        if (rc) {
+            if (-1 != shmFd) {
+                shmFd = fd_close(shmFd);
+                shm_unlink(aName);
+            }
+        }
+    });
+
+    return rc ? rc : shmFd;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+shm_attach(const char *aName)
+{
+    int rc = -1;
+
+    int shmFd = -1;
+
+    shmFd = shm_open(aName, O_RDONLY, 0);
+    if (-1 == shmFd)
+        goto Finally;
+
+    /* Only trust a segment created by the caller, because any user can
+     * create a segment with the expected name.
+     */
+
+    struct stat shmStat;
+    if (fstat(shmFd, &shmStat))
+        goto Finally;
+
+    if (geteuid() != shmStat.st_uid) {
+        errno = EPERM;
+        goto Finally;
+    }
+
+    if (fd_cloexec(shmFd))
+        goto Finally;
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        if (rc)
+            shmFd = fd_close(shmFd);
+    });
+
+    return rc ? rc : shmFd;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+shm_remove(const char *aName)
+{
+    return shm_unlink(aName);
+}
+
+/*----------------------------------------------------------------------------*/
+void *
+shm_map(int aFd, size_t aSize, int aWritable)
+{
+    int prot = PROT_READ | (aWritable ? PROT_WRITE : 0);
+
+    void *addr = mmap(0, aSize, prot, MAP_SHARED, aFd, 0);
+
+    return MAP_FAILED == addr ? 0 : addr;
+}
+
+/*----------------------------------------------------------------------------*/
+void *
+shm_unmap(void *aAddr, size_t aSize)
+{
+    if (aAddr)
+        munmap(aAddr, aSize);
+
+    return 0;
+}
+
+/******************************************************************************/
@@ -0,0 +1,259 @@
+/**
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "trace.h"
+
+#include "clk.h"
+#include "err.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/******************************************************************************/
+#define TRACE_RECORDS 1024
+
+int trace_;
+
+static const char *tracePath_;
+static char traceFile_[PATH_MAX];
+
+static unsigned traceConnection_;
+
+static atomic_uint traceHead_;
+static struct TraceRecord traceRing_[TRACE_RECORDS];
+
+/******************************************************************************/
+static int
+trace_name_(void)
+{
+    int rc = -1;
+
+    /* Compute the name of the dump file in advance so that the
+     * dump can be written from a signal handler.
+     */
+
+    int nameLen = snprintf(
+        traceFile_, sizeof(traceFile_), "%s.%d", tracePath_, getpid());
+
+    if (sizeof(traceFile_) <= nameLen) {
+        errno = ENAMETOOLONG;
+        goto Finally;
+    }
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+trace_dump_signal_(int aSignal)
+{
+    trace_dump();
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+trace_crash_signal_(int aSignal)
+{
+    trace_dump();
+    raise(aSignal);
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+trace_exit_(void)
+{
+    trace_dump();
+}
+
+/******************************************************************************/
+int
+trace_enable(const char *aPath)
+{
+    int rc = -1;
+
+    tracePath_ = aPath;
+
+    if (trace_name_())
+        goto Finally;
+
+    struct sigaction dumpAction = {
+        .sa_handler = trace_dump_signal_,
+        .sa_flags = SA_RESTART,
+    };
+
+    if (sigaction(SIGUSR1, &dumpAction, 0))
+        goto Finally;
+
+    static const int crashSignals[] = {
+        SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGSEGV,
+    };
+
+    struct sigaction crashAction = {
+        .sa_handler = trace_crash_signal_,
+        .sa_flags = SA_RESETHAND,
+    };
+
+    for (int sx = 0; sx < NUMBEROF(crashSignals); ++sx) {
+        if (sigaction(crashSignals[sx], &crashAction, 0))
+            goto Finally;
+    }
+
+    if (atexit(trace_exit_))
+        goto Finally;
+
+    trace_ = 1;
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+void
+trace_fork(unsigned aConnection)
+{
+    if (trace_) {
+        traceConnection_ = aConnection;
+        atomic_store_explicit(&traceHead_, 0, memory_order_relaxed);
+
+        if (trace_name_())
+            trace_ = 0;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+int
+trace_resume(void)
+{
+    /* Tracing can only be resumed if it was enabled with a path */
+
+    if (!tracePath_ || trace_name_()) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    trace_ = 1;
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+void
+trace_suspend(void)
+{
+    trace_ = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+void
+trace_record(unsigned aEvent, uint64_t aArg0, uint64_t aArg1)
+{
+    unsigned head = atomic_load_explicit(&traceHead_, memory_order_relaxed);
+
+    struct TraceRecord *record = &traceRing_[head % TRACE_RECORDS];
+
+    record->mTime = clk_monotonic_ns();
+    record->mSeq = head;
+    record->mEvent = aEvent;
+    record->mConnection = traceConnection_;
+    record->mArg[0] = aArg0;
+    record->mArg[1] = aArg1;
+
+    /* Only publish the record once it is complete, so that a dump
+     * from a signal handler never includes a partial record.
+     */
+
+    atomic_store_explicit(&traceHead_, head + 1, memory_order_release);
+}
+
+/*----------------------------------------------------------------------------*/
+int
+trace_dump(void)
+{
+    int rc = -1;
+
+    int errCode = errno;
+
+    int traceFd = -1;
+
+    if (!trace_) {
+        rc = 0;
+        goto Finally;
+    }
+
+    unsigned head = atomic_load_explicit(&traceHead_, memory_order_acquire);
+
+    /* The oldest slot in a full ring might be in the process of being
+     * overwritten by the interrupted writer, so leave it out.
+     */
+
+    unsigned tail = 0;
+    if (TRACE_RECORDS <= head)
+        tail = head - TRACE_RECORDS + 1;
+
+    traceFd = open(traceFile_, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (-1 == traceFd)
+        goto Finally;
+
+    struct TraceHeader header = {
+        .mMagic = TRACE_MAGIC,
+        .mVersion = TRACE_VERSION,
+        .mPid = getpid(),
+        .mRecords = head - tail,
+    };
+
+    if (sizeof(header) != write(traceFd, &header, sizeof(header)))
+        goto Finally;
+
+    while (tail != head) {
+        unsigned slot = tail % TRACE_RECORDS;
+        unsigned records = TRACE_RECORDS - slot;
+        if (records > head - tail)
+            records = head - tail;
+
+        ssize_t recordsLen = records * sizeof(traceRing_[0]);
+
+        if (recordsLen != write(traceFd, &traceRing_[slot], recordsLen))
+            goto Finally;
+
+        tail += records;
+    }
+
+    rc = 0;
+
+Finally:
+
+    if (-1 != traceFd)
+        close(traceFd);
+
+    errno = errCode;
+
+    return rc;
+}
+
+/******************************************************************************/
@@ -0,0 +1,63 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+/**
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "macros.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/******************************************************************************/
+/* Trace records are kept in a fixed size ring in each process, and
+ * written to a file named after the process when the process exits,
+ * crashes, or receives SIGUSR1. When tracing is disabled, each
+ * trace point costs a single test of trace_.
+ */
+
+#define TRACE_MAGIC   0x74726163
+#define TRACE_VERSION 1
+
+#define TRACE(Event, Arg0, Arg1) \
+    if (!trace_) { } else trace_record((Event), (Arg0), (Arg1))
+
+extern int trace_;
+
+struct TraceHeader {
+    uint32_t mMagic;
+    uint32_t mVersion;
+    uint32_t mPid;
+    uint32_t mRecords;
+};
+
+struct TraceRecord {
+    uint64_t mTime;
+    uint32_t mSeq;
+    uint16_t mEvent;
+    uint16_t mConnection;
+    uint64_t mArg[2];
+};
+
+int trace_enable(const char *aPath);
+void trace_fork(unsigned aConnection);
+
+int trace_resume(void);
+void trace_suspend(void);
+
+void trace_record(unsigned aEvent, uint64_t aArg0, uint64_t aArg1);
+int trace_dump(void);
+
+#endif
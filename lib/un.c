@@ -20,15 +20,63 @@
 
 #include "macros.h"
 
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
 
+#if defined(__linux__)
+#include <linux/sockios.h>
+#endif
+
 /******************************************************************************/
+/* A name that starts with @ is placed in the Linux abstract namespace,
+ * where it has no presence in the filesystem, and is not subject to file
+ * permissions. Otherwise the name is a filesystem path.
+ */
+
+static socklen_t
+un_address_(const char *aPath, struct sockaddr_un *aSockAddr)
+{
+    memset(aSockAddr, 0, sizeof(*aSockAddr));
+
+    aSockAddr->sun_family = AF_UNIX;
+
+    if (!un_abstract(aPath)) {
+        strncpy(aSockAddr->sun_path, aPath, sizeof(aSockAddr->sun_path));
+        aSockAddr->sun_path[sizeof(aSockAddr->sun_path)-1] = 0;
+
+        return sizeof(*aSockAddr);
+    }
+
+    size_t nameLen = strlen(aPath + 1);
+    if (sizeof(aSockAddr->sun_path) - 1 < nameLen)
+        nameLen = sizeof(aSockAddr->sun_path) - 1;
+
+    memcpy(aSockAddr->sun_path + 1, aPath + 1, nameLen);
+
+    return offsetof(struct sockaddr_un, sun_path) + 1 + nameLen;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+un_abstract(const char *aPath)
+{
+#if defined(__linux__)
+    return '@' == aPath[0];
+#else
+    return 0;
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
 int
 un_connect(const char *aPath)
 {
@@ -38,13 +86,10 @@ un_connect(const char *aPath)
     if (-1 == unFd)
         goto Finally;
 
-    struct sockaddr_un sockAddr = { };
-
-    sockAddr.sun_family = AF_UNIX;
-    strncpy(sockAddr.sun_path, aPath, sizeof(sockAddr.sun_path));
-    sockAddr.sun_path[sizeof(sockAddr.sun_path)-1] = 0;
+    struct sockaddr_un sockAddr;
+    socklen_t sockAddrLen = un_address_(aPath, &sockAddr);
 
-    if (connect(unFd, (void *) &sockAddr, sizeof(sockAddr)))
+    if (connect(unFd, (void *) &sockAddr, sockAddrLen))
         goto Finally;
 
     rc = 0;
@@ -73,15 +118,12 @@ un_listen(const char *aPath)
     if (-1 == unFd)
         goto Finally;
 
-    struct sockaddr_un sockAddr = { };
-
-    sockAddr.sun_family = AF_UNIX;
-    strncpy(sockAddr.sun_path, aPath, sizeof(sockAddr.sun_path));
-    sockAddr.sun_path[sizeof(sockAddr.sun_path)-1] = 0;
+    struct sockaddr_un sockAddr;
+    socklen_t sockAddrLen = un_address_(aPath, &sockAddr);
 
     prevMask = umask(0177);
 
-    if (bind(unFd, (void *) &sockAddr, sizeof(sockAddr)))
+    if (bind(unFd, (void *) &sockAddr, sockAddrLen))
         goto Finally;
 
     if (listen(unFd, 0))
@@ -105,6 +147,98 @@ Finally:
     return rc ? rc : unFd;
 }
 
+/*----------------------------------------------------------------------------*/
+int
+un_listening(int aUnFd)
+{
+    int rc = -1;
+
+    int domain;
+    socklen_t domainLen = sizeof(domain);
+
+    if (getsockopt(aUnFd, SOL_SOCKET, SO_DOMAIN, &domain, &domainLen))
+        goto Finally;
+
+    int type;
+    socklen_t typeLen = sizeof(type);
+
+    if (getsockopt(aUnFd, SOL_SOCKET, SO_TYPE, &type, &typeLen))
+        goto Finally;
+
+    int listening;
+    socklen_t listeningLen = sizeof(listening);
+
+    if (getsockopt(aUnFd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &listeningLen))
+        goto Finally;
+
+    if (AF_UNIX != domain || SOCK_STREAM != type || !listening) {
+        errno = ENOTSOCK;
+        goto Finally;
+    }
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+un_name(int aUnFd, char *aPath, size_t aPathLen)
+{
+    int rc = -1;
+
+    /* Recover the name that the socket is bound to, using the same
+     * convention as un_address_() for names in the abstract namespace.
+     */
+
+    struct sockaddr_un sockAddr;
+    socklen_t sockAddrLen = sizeof(sockAddr);
+
+    if (getsockname(aUnFd, (void *) &sockAddr, &sockAddrLen))
+        goto Finally;
+
+    size_t pathOffset = offsetof(struct sockaddr_un, sun_path);
+
+    if (AF_UNIX != sockAddr.sun_family || pathOffset >= sockAddrLen) {
+        errno = EINVAL;
+        goto Finally;
+    }
+
+    const char *name = sockAddr.sun_path;
+    size_t nameLen = sockAddrLen - pathOffset;
+
+    const char *prefix = "";
+
+    if (!name[0]) {
+        prefix = "@";
+        ++name;
+        --nameLen;
+    } else {
+        nameLen = strnlen(name, nameLen);
+    }
+
+    if (aPathLen <= snprintf(
+            aPath, aPathLen, "%s%.*s", prefix, (int) nameLen, name)) {
+        errno = ENAMETOOLONG;
+        goto Finally;
+    }
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+un_unlink(const char *aPath)
+{
+    return un_abstract(aPath) ? 0 : remove(aPath);
+}
+
 /*----------------------------------------------------------------------------*/
 int
 un_accept(int aUnFd)
@@ -122,4 +256,97 @@ Finally:
     return rc ? rc : clientFd;
 }
 
+/*----------------------------------------------------------------------------*/
+int
+un_peer(int aUnFd, pid_t *aPid, uid_t *aUid)
+{
+    int rc = -1;
+
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t credLen = sizeof(cred);
+
+    if (getsockopt(aUnFd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen))
+        goto Finally;
+
+    *aPid = cred.pid;
+    *aUid = cred.uid;
+#else
+    gid_t gid;
+
+    if (getpeereid(aUnFd, aUid, &gid))
+        goto Finally;
+
+    *aPid = 0;
+#endif
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+un_send_limit(int aUnFd, size_t aBufLen, unsigned aTimeoutMs)
+{
+    int rc = -1;
+
+    /* The send buffer bounds the output queued for the peer, and the
+     * timeout bounds how long a blocking send waits for the peer to
+     * make room, after which the send fails with EAGAIN.
+     */
+
+    if (aBufLen) {
+        int bufLen = aBufLen;
+
+        if (setsockopt(
+                aUnFd, SOL_SOCKET, SO_SNDBUF, &bufLen, sizeof(bufLen)))
+            goto Finally;
+    }
+
+    if (aTimeoutMs) {
+        struct timeval timeout = {
+            .tv_sec = aTimeoutMs / 1000,
+            .tv_usec = aTimeoutMs % 1000 * 1000,
+        };
+
+        if (setsockopt(
+                aUnFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)))
+            goto Finally;
+    }
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+un_send_queued(int aUnFd, size_t *aQueued)
+{
+    int rc = -1;
+
+#if defined(SIOCOUTQ)
+    int queued;
+
+    if (ioctl(aUnFd, SIOCOUTQ, &queued))
+        goto Finally;
+
+    *aQueued = queued;
+#else
+    errno = ENOSYS;
+    goto Finally;
+#endif
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
 /******************************************************************************/
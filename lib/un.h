@@ -16,8 +16,18 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/types.h>
+
+int un_abstract(const char *aPath);
 int un_connect(const char *aPath);
 int un_listen(const char *aPath);
+int un_listening(int aUnFd);
+int un_name(int aUnFd, char *aPath, size_t aPathLen);
+int un_unlink(const char *aPath);
 int un_accept(int aUnFd);
+int un_peer(int aUnFd, pid_t *aPid, uid_t *aUid);
+
+int un_send_limit(int aUnFd, size_t aBufLen, unsigned aTimeoutMs);
+int un_send_queued(int aUnFd, size_t *aQueued);
 
 #endif
@@ -0,0 +1,602 @@
+/**
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "usage.h"
+
+#include "clk.h"
+#include "fd.h"
+
+#include "macros.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/******************************************************************************/
+#define USAGE_MAGIC_   0x75736167
+#define USAGE_VERSION_ 2
+
+#define USAGE_EPOCH_BITS_ 16
+#define USAGE_SCORE_BITS_ (64 - USAGE_EPOCH_BITS_)
+#define USAGE_SCORE_MASK_ ((UINT64_C(1) << USAGE_SCORE_BITS_) - 1)
+#define USAGE_EPOCH_MASK_ ((UINT64_C(1) << USAGE_EPOCH_BITS_) - 1)
+
+#define USAGE_TRIES_ 64
+#define USAGE_WAYS_  8
+
+static const unsigned char usageNoHost_[USAGE_KEY_LEN];
+
+/*----------------------------------------------------------------------------*/
+static size_t
+usage_size_(unsigned aRecords)
+{
+    return sizeof(struct UsageTable) + aRecords * sizeof(struct UsageRecord);
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+usage_init_(struct UsageTable *self, unsigned aRecords, unsigned aHalfLife)
+{
+    self->mMagic = USAGE_MAGIC_;
+    self->mVersion = USAGE_VERSION_;
+    self->mRecords = aRecords;
+    self->mHalfLife = aHalfLife ? aHalfLife : 1;
+}
+
+/*----------------------------------------------------------------------------*/
+static uint64_t
+usage_epoch_(const struct UsageTable *self, uint64_t aNowNs)
+{
+    return (aNowNs / 1000000000 / self->mHalfLife) & USAGE_EPOCH_MASK_;
+}
+
+/*----------------------------------------------------------------------------*/
+static uint64_t
+usage_decay_(uint64_t aPacked, uint64_t aEpoch)
+{
+    uint64_t score = aPacked & USAGE_SCORE_MASK_;
+    uint64_t epochs = (aEpoch - (aPacked >> USAGE_SCORE_BITS_)) & USAGE_EPOCH_MASK_;
+
+    return epochs >= USAGE_SCORE_BITS_ ? 0 : score >> epochs;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+usage_snapshot_(const struct UsageRecord *aRecord, struct UsageEntry *aEntry)
+{
+    for (unsigned tx = 0; tx < USAGE_TRIES_; ++tx) {
+
+        uint32_t seq = atomic_load_explicit(
+            &aRecord->mSeq, memory_order_acquire);
+
+        if (!(seq & 1)) {
+            memcpy(aEntry, &aRecord->mEntry, sizeof(*aEntry));
+
+            atomic_thread_fence(memory_order_acquire);
+
+            if (seq == atomic_load_explicit(
+                    &aRecord->mSeq, memory_order_relaxed))
+                return 0;
+        }
+
+        sched_yield();
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+usage_lock_(struct UsageRecord *aRecord, uint32_t *aSeq)
+{
+    for (unsigned tx = 0; tx < USAGE_TRIES_; ++tx) {
+
+        uint32_t seq = atomic_load_explicit(
+            &aRecord->mSeq, memory_order_relaxed);
+
+        if (!(seq & 1) && atomic_compare_exchange_weak_explicit(
+                &aRecord->mSeq, &seq, seq + 1,
+                memory_order_acquire, memory_order_relaxed)) {
+            *aSeq = seq;
+            return 0;
+        }
+
+        sched_yield();
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+usage_unlock_(struct UsageRecord *aRecord, uint32_t aSeq)
+{
+    atomic_store_explicit(&aRecord->mSeq, aSeq + 2, memory_order_release);
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+usage_insert_lock_(struct UsageTable *self)
+{
+    int pid = getpid();
+
+    for (unsigned tx = 0; tx < USAGE_TRIES_; ++tx) {
+
+        int holder = 0;
+
+        if (atomic_compare_exchange_strong(&self->mInsertPid, &holder, pid))
+            return 0;
+
+        if (kill(holder, 0) && ESRCH == errno &&
+                atomic_compare_exchange_strong(
+                    &self->mInsertPid, &holder, pid))
+            return 0;
+
+        sched_yield();
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+usage_insert_unlock_(struct UsageTable *self)
+{
+    atomic_store(&self->mInsertPid, 0);
+}
+
+/*----------------------------------------------------------------------------*/
+static unsigned
+usage_ways_(const struct UsageTable *self)
+{
+    return self->mRecords < USAGE_WAYS_ ? self->mRecords : USAGE_WAYS_;
+}
+
+/*----------------------------------------------------------------------------*/
+static unsigned
+usage_slot_(
+    const struct UsageTable *self,
+    const unsigned char *aKey, const unsigned char *aHost)
+{
+    /* Records for a server host key are placed by the host rather than
+     * by the key, so that the keys used with a host can be recalled
+     * without knowing them beforehand.
+     */
+
+    const unsigned char *digest =
+        memcmp(aHost, usageNoHost_, USAGE_KEY_LEN) ? aHost : aKey;
+
+    uint64_t hash = 0;
+    for (int bx = 0; bx < sizeof(hash); ++bx)
+        hash = (hash << 8) | digest[bx];
+
+    return hash % self->mRecords;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+usage_find_(
+    const struct UsageTable *self,
+    const unsigned char *aKey, const unsigned char *aHost,
+    struct UsageEntry *aEntry)
+{
+    unsigned slot = usage_slot_(self, aKey, aHost);
+    unsigned ways = usage_ways_(self);
+
+    for (unsigned wx = 0; wx < ways; ++wx) {
+
+        unsigned rx = (slot + wx) % self->mRecords;
+
+        if (usage_snapshot_(&self->mRecord[rx], aEntry))
+            continue;
+
+        if (aEntry->mLastUsedNs &&
+                !memcmp(aEntry->mKey, aKey, USAGE_KEY_LEN) &&
+                !memcmp(aEntry->mHost, aHost, USAGE_KEY_LEN))
+            return rx;
+    }
+
+    return -1;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+usage_victim_(
+    const struct UsageTable *self,
+    const unsigned char *aKey, const unsigned char *aHost)
+{
+    int victim = -1;
+    uint64_t lastUsedNs = UINT64_MAX;
+
+    unsigned slot = usage_slot_(self, aKey, aHost);
+    unsigned ways = usage_ways_(self);
+
+    for (unsigned wx = 0; lastUsedNs && wx < ways; ++wx) {
+
+        unsigned rx = (slot + wx) % self->mRecords;
+
+        struct UsageEntry entry;
+
+        if (usage_snapshot_(&self->mRecord[rx], &entry))
+            continue;
+
+        if (entry.mLastUsedNs < lastUsedNs) {
+            lastUsedNs = entry.mLastUsedNs;
+            victim = rx;
+        }
+    }
+
+    return victim;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+usage_update_(
+    struct UsageTable *self, unsigned aIndex,
+    const unsigned char *aKey, const unsigned char *aHost,
+    uint64_t aNowNs, int aClaim)
+{
+    int rc = -1;
+
+    struct UsageRecord *record = &self->mRecord[aIndex];
+    struct UsageEntry *entry = &record->mEntry;
+
+    uint32_t seq;
+    if (usage_lock_(record, &seq))
+        goto Finally;
+
+    /* The record might have been reclaimed for another key after
+     * it was found, in which case it can only be claimed again by
+     * a writer that holds the insertion lock.
+     */
+
+    if (!entry->mLastUsedNs ||
+            memcmp(entry->mKey, aKey, USAGE_KEY_LEN) ||
+            memcmp(entry->mHost, aHost, USAGE_KEY_LEN)) {
+
+        if (!aClaim) {
+            usage_unlock_(record, seq);
+            errno = ESTALE;
+            goto Finally;
+        }
+
+        memcpy(entry->mKey, aKey, USAGE_KEY_LEN);
+        memcpy(entry->mHost, aHost, USAGE_KEY_LEN);
+        entry->mScore = 0;
+        entry->mCount = 0;
+        entry->mFirstUsedNs = aNowNs;
+    }
+
+    uint64_t epoch = usage_epoch_(self, aNowNs);
+
+    uint64_t score = usage_decay_(entry->mScore, epoch) + USAGE_UNIT;
+    if (score > USAGE_SCORE_MASK_)
+        score = USAGE_SCORE_MASK_;
+
+    entry->mScore = (epoch << USAGE_SCORE_BITS_) | score;
+    entry->mCount += 1;
+    entry->mLastUsedNs = aNowNs;
+
+    usage_unlock_(record, seq);
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+usage_record_(
+    struct UsageTable *self,
+    const unsigned char *aKey, const unsigned char *aHost, uint64_t aNowNs)
+{
+    int locked = 0;
+
+    struct UsageEntry entry;
+
+    int rx = usage_find_(self, aKey, aHost, &entry);
+
+    if (-1 == rx || usage_update_(self, rx, aKey, aHost, aNowNs, 0)) {
+
+        if (usage_insert_lock_(self))
+            goto Finally;
+
+        locked = 1;
+
+        rx = usage_find_(self, aKey, aHost, &entry);
+        if (-1 == rx)
+            rx = usage_victim_(self, aKey, aHost);
+
+        if (-1 != rx)
+            usage_update_(self, rx, aKey, aHost, aNowNs, 1);
+    }
+
+Finally:
+
+    FINALLY({
+        if (locked)
+            usage_insert_unlock_(self);
+    });
+}
+
+/******************************************************************************/
+struct UsageTable *
+usage_create(unsigned aRecords, unsigned aHalfLife)
+{
+    struct UsageTable *self = mmap(
+        0, usage_size_(aRecords),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (MAP_FAILED == self)
+        return 0;
+
+    usage_init_(self, aRecords, aHalfLife);
+
+    return self;
+}
+
+/*----------------------------------------------------------------------------*/
+struct UsageTable *
+usage_open(const char *aPath, unsigned aRecords, unsigned aHalfLife)
+{
+    int rc = -1;
+
+    int fd = -1;
+
+    struct UsageTable *self = 0;
+
+    size_t size = usage_size_(aRecords);
+
+    fd = open(aPath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (-1 == fd)
+        goto Finally;
+
+    /* Serialise against other agents opening the same file so that
+     * only one of them initialises it. The lock is released when the
+     * file is closed, but the mapping remains.
+     */
+
+    if (flock(fd, LOCK_EX))
+        goto Finally;
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat))
+        goto Finally;
+
+    /* Only an empty file is initialised, so that naming some other
+     * file by mistake does not destroy it.
+     */
+
+    int empty = !fileStat.st_size;
+
+    if (empty) {
+        if (ftruncate(fd, size))
+            goto Finally;
+
+    } else {
+        struct UsageTable header;
+
+        if (size != fileStat.st_size ||
+                sizeof(header) != pread(fd, &header, sizeof(header), 0) ||
+                USAGE_MAGIC_ != header.mMagic ||
+                USAGE_VERSION_ != header.mVersion ||
+                aRecords != header.mRecords) {
+            errno = EINVAL;
+            goto Finally;
+        }
+    }
+
+    self = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == self) {
+        self = 0;
+        goto Finally;
+    }
+
+    if (empty)
+        usage_init_(self, aRecords, aHalfLife);
+
+    self->mHalfLife = aHalfLife ? aHalfLife : 1;
+
+    /* A record is left odd if a process dies while writing it. Release
+     * such records to the sequence number that the writer would have
+     * used, so that a writer that is still active releases the record
+     * to the same sequence number.
+     */
+
+    for (unsigned rx = 0; rx < self->mRecords; ++rx) {
+        struct UsageRecord *record = &self->mRecord[rx];
+
+        uint32_t seq = atomic_load(&record->mSeq);
+        if (seq & 1)
+            atomic_compare_exchange_strong(&record->mSeq, &seq, seq + 1);
+    }
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        fd = fd_close(fd);
+
+        if (rc)
+            self = usage_close(self);
+    });
+
+    return self;
+}
+
+/*----------------------------------------------------------------------------*/
+const struct UsageTable *
+usage_attach(const char *aPath)
+{
+    int rc = -1;
+
+    int fd = -1;
+
+    struct UsageTable *self = 0;
+    size_t size = 0;
+
+    fd = open(aPath, O_RDONLY | O_CLOEXEC);
+    if (-1 == fd)
+        goto Finally;
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat))
+        goto Finally;
+
+    size = fileStat.st_size;
+
+    if (sizeof(*self) > size) {
+        errno = EINVAL;
+        goto Finally;
+    }
+
+    self = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == self) {
+        self = 0;
+        goto Finally;
+    }
+
+    if (USAGE_MAGIC_ != self->mMagic ||
+            USAGE_VERSION_ != self->mVersion ||
+            usage_size_(self->mRecords) != size) {
+        errno = EINVAL;
+        goto Finally;
+    }
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        fd = fd_close(fd);
+
+        if (rc && self) {
+            munmap(self, size);
+            self = 0;
+        }
+    });
+
+    return self;
+}
+
+/*----------------------------------------------------------------------------*/
+struct UsageTable *
+usage_close(const struct UsageTable *self)
+{
+    if (self)
+        munmap((void *) self, usage_size_(self->mRecords));
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+void
+usage_record(
+    struct UsageTable *self, const unsigned char *aKey, const unsigned char *aHost)
+{
+    uint64_t nowNs = clk_realtime_ns();
+
+    usage_record_(self, aKey, usageNoHost_, nowNs);
+
+    if (aHost)
+        usage_record_(self, aKey, aHost, nowNs);
+}
+
+/*----------------------------------------------------------------------------*/
+uint64_t
+usage_score(const struct UsageTable *self, const unsigned char *aKey)
+{
+    struct UsageEntry entry;
+
+    if (-1 == usage_find_(self, aKey, usageNoHost_, &entry))
+        return 0;
+
+    return usage_decay_(entry.mScore, usage_epoch_(self, clk_realtime_ns()));
+}
+
+/*----------------------------------------------------------------------------*/
+int
+usage_recall(
+    const struct UsageTable *self, const unsigned char *aHost, unsigned char *aKey)
+{
+    uint64_t lastUsedNs = 0;
+
+    unsigned slot = usage_slot_(self, usageNoHost_, aHost);
+    unsigned ways = usage_ways_(self);
+
+    for (unsigned wx = 0; wx < ways; ++wx) {
+
+        unsigned rx = (slot + wx) % self->mRecords;
+
+        struct UsageEntry entry;
+
+        if (usage_snapshot_(&self->mRecord[rx], &entry))
+            continue;
+
+        if (entry.mLastUsedNs > lastUsedNs &&
+                !memcmp(entry.mHost, aHost, USAGE_KEY_LEN)) {
+            lastUsedNs = entry.mLastUsedNs;
+            memcpy(aKey, entry.mKey, USAGE_KEY_LEN);
+        }
+    }
+
+    if (!lastUsedNs) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+int
+usage_read(
+    const struct UsageTable *self, unsigned aIndex, struct UsageEntry *aEntry)
+{
+    if (aIndex >= self->mRecords) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (usage_snapshot_(&self->mRecord[aIndex], aEntry))
+        return -1;
+
+    if (!aEntry->mLastUsedNs) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    aEntry->mScore = usage_decay_(
+        aEntry->mScore, usage_epoch_(self, clk_realtime_ns()));
+
+    return 0;
+}
+
+/******************************************************************************/
@@ -0,0 +1,94 @@
+#ifndef USAGE_H_
+#define USAGE_H_
+/**
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "sha256.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/******************************************************************************/
+/* A usage table counts successful uses of each key, and of each key with
+ * each server host key, in a fixed number of records that are shared by
+ * all processes. The table is either anonymous, or backed by a file so
+ * that it survives restarts.
+ *
+ * Each record can only be placed in one of a few consecutive records,
+ * starting from a slot chosen by hashing the server host key, or the
+ * key when there is no host, so that a lookup only reads those records.
+ * When they are all in use, the least recently used of them is reclaimed.
+ *
+ * Each record is guarded by a sequence number that is odd while the
+ * record is being written. Readers retry if the record changes while
+ * being read, and writers give up rather than wait for a record that
+ * is held by another writer, so a process that dies while holding a
+ * record cannot stall the others.
+ */
+
+#define USAGE_KEY_LEN SHA256_DIGEST_LEN
+#define USAGE_UNIT    1024
+
+struct UsageEntry {
+    unsigned char mKey[USAGE_KEY_LEN];
+    unsigned char mHost[USAGE_KEY_LEN];
+
+    uint64_t mScore;
+    uint64_t mCount;
+    uint64_t mFirstUsedNs;
+    uint64_t mLastUsedNs;
+};
+
+struct UsageRecord {
+    atomic_uint_least32_t mSeq;
+    uint32_t mReserved;
+
+    struct UsageEntry mEntry;
+};
+
+struct UsageTable {
+    uint32_t mMagic;
+    uint32_t mVersion;
+    uint32_t mRecords;
+    uint32_t mHalfLife;
+
+    /* New records are inserted by at most one process at a time so
+     * that a key is not inserted twice. The lock records the pid of
+     * its holder so that it can be recovered if the holder dies.
+     */
+
+    atomic_int mInsertPid;
+    uint32_t mReserved;
+
+    struct UsageRecord mRecord[];
+};
+
+struct UsageTable *usage_create(unsigned aRecords, unsigned aHalfLife);
+struct UsageTable *usage_open(
+    const char *aPath, unsigned aRecords, unsigned aHalfLife);
+const struct UsageTable *usage_attach(const char *aPath);
+struct UsageTable *usage_close(const struct UsageTable *self);
+
+void usage_record(
+    struct UsageTable *self, const unsigned char *aKey, const unsigned char *aHost);
+uint64_t usage_score(const struct UsageTable *self, const unsigned char *aKey);
+int usage_recall(
+    const struct UsageTable *self, const unsigned char *aHost, unsigned char *aKey);
+
+int usage_read(
+    const struct UsageTable *self, unsigned aIndex, struct UsageEntry *aEntry);
+
+#endif
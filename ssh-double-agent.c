@@ -16,22 +16,36 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "clk.h"
 #include "err.h"
 #include "fd.h"
+#include "keystore.h"
+#include "policy.h"
 #include "un.h"
 #include "macros.h"
+#include "probe.h"
 #include "proc.h"
+#include "rate.h"
+#include "shm.h"
+#include "sha256.h"
 #include "sig.h"
+#include "trace.h"
+#include "usage.h"
 
+#include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 /******************************************************************************/
@@ -39,6 +53,21 @@ static int optHelp;
 static const char *argPrimaryPath;
 static const char *argFallbackPath;
 static const char *argDoubleAgentPath;
+static int argReadyFd = -1;
+static const char *argTracePath;
+static uint64_t argSlowNs = UINT64_MAX;
+static int optUsageOrder;
+static int argHostHint;
+static const char *argUsageDb;
+static const char *argPolicyPath;
+static size_t argMaxInspect = 32 * 1024;
+static unsigned argHedgePercentile;
+static int optKeystore;
+static const char *argControlPath;
+static uint64_t argIdleNs;
+static uint64_t argLifetimeNs;
+static size_t argSendBuffer;
+static uint64_t argStallNs;
 
 /******************************************************************************/
 #define SSH_AGENT_FAILURE             5
@@ -47,8 +76,423 @@ static const char *argDoubleAgentPath;
 #define SSH_AGENT_IDENTITIES_ANSWER   12
 #define SSH_AGENTC_SIGN_REQUEST       13
 #define SSH_AGENT_SIGN_RESPONSE       14
+#define SSH_AGENTC_ADD_IDENTITY       17
+#define SSH_AGENTC_REMOVE_IDENTITY    18
+#define SSH_AGENTC_REMOVE_ALL_IDENTITIES 19
 #define SSH_AGENTC_LOCK               22
 #define SSH_AGENTC_UNLOCK             23
+#define SSH_AGENTC_ADD_ID_CONSTRAINED 25
+#define SSH_AGENTC_EXTENSION          27
+
+/* Messages are limited to the same size as ssh-agent(1) accepts. Messages
+ * that are only passed through are streamed, but messages that must be
+ * inspected are read into memory, and are limited by --max-inspect.
+ */
+
+#define MESSAGE_MAX_LENGTH (256 * 1024)
+#define MESSAGE_CHUNK_LENGTH (8 * 1024)
+
+/******************************************************************************/
+/* Each request is timed in stages so that slow requests can be
+ * attributed to the client, or to one of the upstream agents.
+ */
+
+enum RequestStage {
+    STAGE_READ,
+    STAGE_UPSTREAM,
+    STAGE_WRITE,
+    STAGES,
+};
+
+struct Request {
+    uint64_t mStartNs;
+    uint64_t mMarkNs;
+    uint64_t mStageNs[STAGES];
+
+    /* The stage that the request has reached, which is used to count
+     * requests abandoned because the client went away, and whether
+     * any of the response has been written, after which the request
+     * cannot be retried.
+     */
+
+    enum RequestStage mStage;
+    int mResponded;
+
+    const char *mUpstream;
+};
+
+/******************************************************************************/
+/* The statistics segment is shared by the agent and all its connection
+ * processes, each of which updates the counters without locking. Each
+ * counter occupies its own cache line so that processes updating
+ * unrelated counters do not contend.
+ */
+
+#define STATS_MAGIC   0x73736461
+#define STATS_VERSION 14
+#define STATS_TYPES   32
+#define STATS_LATENCY 32
+
+/* The double agent consults an ordered chain of upstream agents. The
+ * primary and fallback agents named on the command line are always the
+ * first two, and further agents are appended with --agent or --chain.
+ */
+
+#define UPSTREAM_MAX     8
+#define UPSTREAM_PRIMARY 0
+#define UPSTREAM_FALLBACK 1
+
+/* Each upstream agent can be served by several equivalent replicas.
+ * Each connection uses one replica of each agent, choosing the less
+ * busy of two randomly chosen replicas, and a replica that fails is
+ * ejected for a while so that new connections avoid it.
+ */
+
+#define REPLICA_MAX      4
+#define REPLICA_PATH_MAX 108
+#define REPLICA_EJECT_NS (10 * UINT64_C(1000000000))
+
+/* A connection to an upstream agent that fails is closed, and opened
+ * again when next needed. While the agent cannot be reached, attempts
+ * to connect are spaced by an exponential backoff with jitter, so that
+ * connections do not converge on a restarting agent in step.
+ */
+
+#define RECONNECT_MIN_NS (100 * UINT64_C(1000000))
+#define RECONNECT_MAX_NS (30 * UINT64_C(1000000000))
+
+struct StatCounter {
+    _Alignas(64) atomic_uint_least64_t mValue;
+};
+
+struct StatReplica {
+    struct StatCounter mActive;
+    struct StatCounter mRequests;
+    struct StatCounter mResponses;
+    struct StatCounter mErrors;
+    struct StatCounter mLatencyNs;
+    struct StatCounter mEjectedNs;
+
+    char mPath[REPLICA_PATH_MAX];
+};
+
+/* Requests from each client are limited by token buckets kept in the
+ * statistics segment, so that all the connections of a client share
+ * its buckets, and its throttle counters can be reported. Clients are
+ * identified by a digest of their description, and when the table is
+ * full, the record of a client whose buckets have refilled is reused.
+ */
+
+#define STATS_CLIENTS   64
+#define CLIENT_NAME_MAX 64
+
+enum RateClass {
+    RATE_IDENTITIES,
+    RATE_SIGN,
+    RATE_CHANGE,
+    RATE_CLASSES
+};
+
+enum RateKey {
+    RATE_KEY_UID,
+    RATE_KEY_PID,
+    RATE_KEY_CGROUP,
+};
+
+struct StatClient {
+    _Alignas(64) atomic_uint_least64_t mKey;
+
+    atomic_uint_least64_t mBucket[RATE_CLASSES];
+    atomic_uint_least64_t mThrottled[RATE_CLASSES];
+    atomic_uint_least64_t mRejected[RATE_CLASSES];
+
+    /* The name is written when the record is claimed, while the stat
+     * command might be reading it, so it is held in atomic words and
+     * guarded by a sequence that is odd while the name is changing.
+     */
+
+    atomic_uint mNameSeq;
+    atomic_uint_least64_t mName[CLIENT_NAME_MAX / 8];
+};
+
+static struct RateLimit argRate[RATE_CLASSES];
+static int argRateKey;
+static uint64_t argRateQueueNs;
+
+/* Requests are sent to the upstream agents in order of priority, so
+ * that sign requests from interactive clients are not held behind
+ * identity queries, or other bulk requests, from other connections.
+ * A request defers to requests of higher priority that are in flight
+ * at the same upstream agent, but for no longer than --priority.
+ */
+
+enum RequestPriority {
+    PRIORITY_SIGN,
+    PRIORITY_IDENTITIES,
+    PRIORITY_OTHER,
+    PRIORITIES
+};
+
+static uint64_t argPriorityNs;
+
+/* Each request in flight occupies a slot that records the pid of the
+ * connection process together with the agent and priority, all in one
+ * word, so that the agent can release the slots of a connection process
+ * that dies, and the requests in flight are counted from the slots
+ * themselves. When all the slots are taken, a request is sent without
+ * deferring to others, and is not counted.
+ */
+
+#define STATS_INFLIGHT 128
+
+#define INFLIGHT_SLOT(Pid, Upstream, Priority) \
+    (((uint64_t) (uint32_t) (Pid) << 32) | ((Upstream) << 8) | (Priority))
+
+#define INFLIGHT_PID(Slot)      ((pid_t) ((Slot) >> 32))
+#define INFLIGHT_UPSTREAM(Slot) (((Slot) >> 8) & 0xff)
+#define INFLIGHT_PRIORITY(Slot) ((Slot) & 0xff)
+
+struct Stats {
+    uint32_t mMagic;
+    uint32_t mVersion;
+    pid_t    mPid;
+    uint32_t mUpstreams;
+    uint32_t mReplicas[UPSTREAM_MAX];
+
+    struct StatCounter mConnections;
+    struct StatCounter mRejected;
+    struct StatCounter mActive;
+    struct StatCounter mIdleClosed;
+    struct StatCounter mExpired;
+    struct StatCounter mStalled;
+    struct StatCounter mCancelled[STAGES];
+    struct StatCounter mErrors;
+
+    struct StatCounter mBytesIn;
+    struct StatCounter mBytesOut;
+
+    /* The most output found queued for any client after a response
+     * was written, which shows how close clients come to filling
+     * their send buffers.
+     */
+
+    struct StatCounter mOutputHighWater;
+
+    struct StatCounter mRequests[STATS_TYPES];
+    struct StatCounter mDuplicates;
+
+    struct {
+        struct StatCounter mRequests;
+        struct StatCounter mFailures;
+        struct StatCounter mErrors;
+        struct StatCounter mReconnects;
+    } mUpstream[UPSTREAM_MAX];
+
+    struct StatCounter mRetries;
+
+    struct StatReplica mReplica[UPSTREAM_MAX][REPLICA_MAX];
+
+    struct StatCounter mHedges;
+    struct StatCounter mHedgeWins;
+
+    /* Bucket N counts sign responses from the first agent offered
+     * each request that took less than 2^(N+1) microseconds, and at
+     * least 2^N microseconds.
+     */
+
+    struct StatCounter mSignLatency[STATS_LATENCY];
+
+    struct StatClient mClient[STATS_CLIENTS];
+
+    atomic_uint_least64_t mInflight[STATS_INFLIGHT];
+    struct StatCounter mDeferred[PRIORITIES];
+    struct StatCounter mDeferredNs[PRIORITIES];
+
+    /* Name the usage database so that readers of the statistics can
+     * also report key usage.
+     */
+
+    char mUsagePath[PATH_MAX];
+};
+
+static struct Stats *stats_;
+
+#define STAT_ADD(Counter, Value) \
+    atomic_fetch_add_explicit( \
+        &stats_->Counter.mValue, (Value), memory_order_relaxed)
+
+#define STAT_INC(Counter) STAT_ADD(Counter, 1)
+
+#define STAT_SET(Counter, Value) \
+    atomic_store_explicit( \
+        &stats_->Counter.mValue, (Value), memory_order_relaxed)
+
+#define STAT_TYPE(Type) ((Type) < STATS_TYPES ? (Type) : STATS_TYPES - 1)
+
+/******************************************************************************/
+enum TraceEvent {
+    TRACE_ACCEPT = 1,
+    TRACE_REJECT,
+    TRACE_CLOSE,
+    TRACE_REQUEST,
+    TRACE_RESPONSE,
+    TRACE_UPSTREAM_SEND,
+    TRACE_UPSTREAM_RECV,
+    TRACE_IDENTITIES,
+    TRACE_ERROR,
+    TRACE_EVENTS,
+};
+
+#define TRACE_TYPE_LENGTH(Type, Length) \
+    (((uint64_t) (Type) << 32) | (uint32_t) (Length))
+
+/******************************************************************************/
+/* Successful signatures are counted for each key so that the keys that
+ * are most likely to succeed can be offered to the client first.
+ */
+
+#define USAGE_RECORDS   256
+#define USAGE_HALF_LIFE (24 * 60 * 60)
+
+/* A connection bound to a server host key by session-bind@openssh.com
+ * can be offered the key that last succeeded for that host, either
+ * ahead of all other keys, or as the only key.
+ */
+
+enum HostHint {
+    HOST_HINT_NONE,
+    HOST_HINT_FIRST,
+    HOST_HINT_ONLY,
+};
+
+#define SESSION_BIND_EXTENSION "session-bind@openssh.com"
+
+/* Sign requests are hedged by offering them to the next agent in the
+ * chain when the first agent is slower than a percentile of recent sign
+ * latency. Until enough latencies are known, a fixed delay is used.
+ */
+
+#define HEDGE_MIN_SAMPLES 16
+#define HEDGE_DEFAULT_MS  100
+
+/* The built-in keystore replaces the primary agent, and holds ed25519
+ * keys that are signed without a round trip to another process.
+ */
+
+#define KEYSTORE_RECORDS  64
+#define KEYSTORE_KEY_TYPE "ssh-ed25519"
+#define KEYSTORE_BLOB_LEN \
+    (4 + sizeof(KEYSTORE_KEY_TYPE) - 1 + 4 + ED25519_PUBLIC_LEN)
+
+/* The number of concurrent connections is limited, and the limit can be
+ * changed at runtime through the control socket, which reads a single
+ * command line from each control connection.
+ */
+
+#define CONNECTIONS_DEFAULT 16
+#define CONTROL_LINE_MAX    1024
+#define CONTROL_TIMEOUT_MS  1000
+
+/* An upgrade replaces the image of the running agent, and passes the
+ * descriptors and settings of the agent to the new image through the
+ * environment. The original arguments are parsed again by the new image.
+ */
+
+#define UPGRADE_ENV "SSH_DOUBLE_AGENT_UPGRADE"
+
+static char **argv_;
+static char selfPath_[PATH_MAX];
+
+/******************************************************************************/
+/* Writable upstream agents receive requests that change the identities
+ * held by the agent, while read-only agents only receive queries for
+ * identities and signatures.
+ */
+
+struct Upstream {
+    int mWritable;
+    unsigned mReplicas;
+    const char *mPath[REPLICA_MAX];
+
+    /* A built-in upstream is served from the keystore in-process, and
+     * has no socket.
+     */
+
+    struct Keystore *mKeystore;
+
+    /* The replica used by the connection, and the time that the most
+     * recent request was sent to it.
+     */
+
+    int mFd;
+    unsigned mReplica;
+    uint64_t mSentNs;
+
+    /* One more than the index of the slot that holds the request in
+     * flight at the agent on behalf of the connection, or zero if there
+     * is none.
+     */
+
+    int mInflight;
+
+    /* Whether the current request was sent to the agent, whether the
+     * connection failed, and whether the agent must be reconnected
+     * after a failure, together with the state of the backoff.
+     */
+
+    int mPending;
+    int mFailed;
+    int mReconnect;
+    uint64_t mBackoffNs;
+    uint64_t mRetryNs;
+};
+
+static struct Upstream argAgent[UPSTREAM_MAX - 2];
+static unsigned argAgents;
+static const char *argReplica[REPLICA_MAX - 1];
+static unsigned argReplicas;
+
+/* Each connection remembers which upstream agent offered each key, so
+ * that a sign request can be sent directly to the agent holding the key.
+ */
+
+struct KeyRoute {
+    unsigned char mKey[SHA256_DIGEST_LEN];
+    unsigned mUpstream;
+};
+
+/******************************************************************************/
+/* Further listening sockets, or tenants, can be added to a running agent
+ * through the control socket. Each tenant has its own primary and fallback
+ * agents, policy, usage table, connection limit and statistics, so that
+ * one agent process can serve many sessions.
+ */
+
+#define TENANT_MAX 64
+
+struct Tenant {
+    int mUsed;
+    int mFd;
+    int mConnectionLimit;
+    int mActive;
+
+    struct Stats *mStats;
+    struct UsageTable *mUsage;
+    struct Policy *mPolicy;
+
+    char mPath[REPLICA_PATH_MAX];
+    char mUpstreamPath[2][REPLICA_PATH_MAX];
+};
+
+/* Connection processes serving tenants are remembered so that each is
+ * counted against its own tenant when reaped. A tenant that is removed
+ * leaves its connections to drain, and forgets them.
+ */
+
+struct TenantWorker {
+    pid_t mPid;
+    int mTenant;
+};
 
 /******************************************************************************/
 struct Agent {
@@ -57,13 +501,89 @@ struct Agent {
 
     pid_t mParentPid;
 
-    const char *mPrimaryPath;
-    const char *mFallbackPath;
     const char *mDoubleAgentPath;
-
-    int mPrimaryFd;
-    int mFallbackFd;
     int mDoubleAgentFd;
+    int mActivated;
+
+    /* Changes made through the control socket apply to connections
+     * accepted after the change, while connections that are already
+     * running keep the configuration they were forked with.
+     */
+
+    int mControlFd;
+    int mConnectionLimit;
+    char mControlPath[UPSTREAM_MAX][REPLICA_MAX][REPLICA_PATH_MAX];
+
+    unsigned mUpstreams;
+    struct Upstream mUpstream[UPSTREAM_MAX];
+
+    /* Each used slot names one more than the index of the upstream
+     * agent that offered the key, and unused slots are zero.
+     */
+
+    size_t mRouteSlots;
+    struct KeyRoute *mRoute;
+
+    struct UsageTable *mUsage;
+
+    /* The digest of the host key of the server to which the connection
+     * is bound for authentication, if the connection is bound.
+     */
+
+    int mBound;
+    unsigned char mHost[SHA256_DIGEST_LEN];
+
+    /* The policy is reloaded by the agent whenever the policy file
+     * changes, and each connection applies the policy that was
+     * current when the connection was accepted.
+     */
+
+    struct Policy *mPolicy;
+    struct stat mPolicyStat;
+
+    struct PolicyClient mClient;
+    char mClientExe[PATH_MAX];
+
+    struct StatClient *mRateClient;
+
+    int mClientFd;
+
+    enum RequestPriority mPriority;
+
+    /* The ready descriptor is held until the agent is about to poll
+     * for its first connection, and the startup timestamps are
+     * reported at that time.
+     */
+
+    int mReadyFd;
+
+    /* The statistics and the keystore are held by descriptor so that
+     * they can be passed to the image that replaces the agent during
+     * an upgrade. The replacement reports how long the agent was unable
+     * to accept connections on the control connection that requested
+     * the upgrade.
+     */
+
+    int mStatsFd;
+    int mKeystoreFd;
+
+    int mUpgradeFd;
+    uint64_t mUpgradeNs;
+
+    struct Tenant mTenant[TENANT_MAX];
+
+    unsigned mWorkers;
+    unsigned mWorkerSlots;
+    struct TenantWorker *mWorker;
+
+    struct Request mRequest;
+
+    struct {
+        uint64_t mStartNs;
+        uint64_t mBindNs;
+        uint64_t mForkNs;
+        uint64_t mSetsidNs;
+    } mStartup;
 };
 
 /******************************************************************************/
@@ -97,8 +617,38 @@ usage(void)
     static const char usageText[] =
         "[-d] [primary-path] fallback-path double-agent-path -- cmd ...\n"
         "\n"
+        "Commands:\n"
+        "  stat double-agent-path [interval [count]]\n"
+        "                      Print statistics for a running double agent\n"
+        "  trace path.pid ...  Print recorded binary trace\n"
+        "  control control-path command ...\n"
+        "                      Reconfigure or upgrade a running double agent\n"
+        "\n"
         "Options:\n"
         "  -d --debug          Emit debug information\n"
+        "  --ready-fd N        Notify readiness on file descriptor N\n"
+        "  -s --slow ms        Log requests slower than ms milliseconds\n"
+        "  -t --trace path     Record binary trace to path.pid\n"
+        "  -u --usage-order    Offer most successful identities first\n"
+        "  --host-hint mode    Offer the last key used for a host first or only\n"
+        "  --usage-db path     Keep key usage in path across restarts\n"
+        "  --policy path       Filter identities using rules in path\n"
+        "  --max-inspect bytes Largest message read into memory\n"
+        "  --hedge percentile  Hedge slow sign requests to the next agent\n"
+        "  -a --agent path     Append a read-only agent to the chain\n"
+        "  --agent-rw path     Append a writable agent to the chain\n"
+        "  --chain path        Append the agents listed in path to the chain\n"
+        "  -r --replica path   Add a replica of the fallback agent\n"
+        "  -k --keystore       Hold ed25519 keys in-process as the primary agent\n"
+        "  --control path      Accept control commands on socket path\n"
+        "  --idle-timeout ms   Close connections idle for ms milliseconds\n"
+        "  --max-lifetime ms   Close connections open for ms milliseconds\n"
+        "  --rate class=n[/b]  Limit each client to n requests per second\n"
+        "  --rate-key key      Identify clients by uid, pid, or cgroup\n"
+        "  --rate-queue ms     Delay throttled requests up to ms milliseconds\n"
+        "  --priority ms       Defer bulk requests to sign requests up to ms\n"
+        "  --send-buffer bytes Limit output queued for each client\n"
+        "  --stall-timeout ms  Close clients that stop reading for ms\n"
         "\n"
         "Environment:\n"
         "  SSH_AUTH_SOCK       Default socket path for primary agent\n"
@@ -120,6 +670,8 @@ terminate(void)
 {
     DEBUG("Terminating agent pgid %d", getpgid(0));
 
+    trace_dump();
+
     signal(SIGTERM, SIG_IGN);
     killpg(0, SIGTERM);
     sleep(3);
@@ -161,6 +713,51 @@ rd_uint32_t(const char *aBuf, uint32_t *aOut)
         *aOut = value;
 }
 
+/*----------------------------------------------------------------------------*/
+static void
+wr_uint32_t(char *aBuf, uint32_t aValue)
+{
+    aBuf[0] = (aValue >> 24) & 0xff;
+    aBuf[1] = (aValue >> 16) & 0xff;
+    aBuf[2] = (aValue >>  8) & 0xff;
+    aBuf[3] = (aValue >>  0) & 0xff;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+rd_string(const char **aBuf, uint32_t *aLen, const char **aStr, uint32_t *aStrLen)
+{
+    int rc = -1;
+
+    uint32_t strLen;
+
+    if (4 > *aLen) {
+        errno = EINVAL;
+        goto Finally;
+    }
+
+    rd_uint32_t(*aBuf, &strLen);
+
+    if (*aLen - 4 < strLen) {
+        errno = EINVAL;
+        goto Finally;
+    }
+
+    if (aStr)
+        *aStr = *aBuf + 4;
+    if (aStrLen)
+        *aStrLen = strLen;
+
+    *aBuf += 4 + strLen;
+    *aLen -= 4 + strLen;
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
 /*----------------------------------------------------------------------------*/
 static int
 send_message(int aFd, int aType, const char *aMsg, size_t aMsgLen)
@@ -188,11 +785,21 @@ Finally:
     return rc;
 }
 
+/*----------------------------------------------------------------------------*/
+static void
+count_response(int aType, uint32_t aLength)
+{
+    STAT_ADD(mBytesOut, aLength);
+    TRACE(TRACE_RESPONSE, aType, aLength);
+    PROBE(response, aType, aLength);
+}
+
 /*----------------------------------------------------------------------------*/
 static int
 send_response_success(int aFd)
 {
     DEBUG("Sending response SSH_AGENT_SUCCESS");
+    count_response(SSH_AGENT_SUCCESS, 5);
     return send_message(aFd, SSH_AGENT_SUCCESS, 0, 0);
 }
 
@@ -201,6 +808,7 @@ static int
 send_response_failure(int aFd)
 {
     DEBUG("Sending response SSH_AGENT_FAILURE");
+    count_response(SSH_AGENT_FAILURE, 5);
     return send_message(aFd, SSH_AGENT_FAILURE, 0, 0);
 }
 
@@ -218,20 +826,21 @@ transfer_response_bytes(int aSrcFd, int aDstFd, size_t aLen)
 {
     int rc = -1;
 
+    char chunk[MESSAGE_CHUNK_LENGTH];
+
     while (aLen) {
-        size_t chunkLen = 7; //8 * 1024;
+        size_t chunkLen = sizeof(chunk);
         if (chunkLen > aLen)
             chunkLen = aLen;
 
-        char chunk[chunkLen];
-        if (sizeof(chunk) != fd_read(aSrcFd, chunk, sizeof(chunk)))
+        if (chunkLen != fd_read(aSrcFd, chunk, chunkLen))
             goto Finally;
 
         if (-1 != aDstFd &&
-                sizeof(chunk) != fd_write(aDstFd, chunk, sizeof(chunk)))
+                chunkLen != fd_write(aDstFd, chunk, chunkLen))
             goto Finally;
 
-        aLen -= sizeof(chunk);
+        aLen -= chunkLen;
     }
 
     rc = 0;
@@ -280,7 +889,7 @@ message_init(
         goto Finally;
     }
 
-    if (32 * 1024 < msgLength) {
+    if (MESSAGE_MAX_LENGTH < msgLength) {
         warn("%s - Message length %" PRIu32 " overflows threshold", self->mName, msgLength);
         errno = ENOMEM;
         goto Finally;
@@ -289,6 +898,7 @@ message_init(
     int msgType = (unsigned char) msgHeader[4];
 
     DEBUG("Message type %d", msgType);
+    PROBE(message_init, self->mName, msgType, msgLength - 1);
 
     self->mType = msgType;
     self->mSize = msgLength - 1;
@@ -306,6 +916,26 @@ Finally:
     return rc ? 0 : self;
 }
 
+/*----------------------------------------------------------------------------*/
+struct Message *
+message_init_content(
+    struct Message *self, const char *aName,
+    int aType, char *aContent, uint32_t aLength)
+{
+    /* The message takes ownership of the content, which is already
+     * in memory so that nothing remains on any socket.
+     */
+
+    self->mName = aName;
+    self->mFd = -1;
+    self->mType = aType;
+    self->mSize = 0;
+    self->mPayload.mLength = aLength;
+    self->mPayload.mContent = aContent;
+
+    return self;
+}
+
 /*----------------------------------------------------------------------------*/
 int
 message_read_payload(struct Message *self)
@@ -319,6 +949,13 @@ message_read_payload(struct Message *self)
         goto Finally;
     }
 
+    if (argMaxInspect < self->mPayload.mLength) {
+        warn("%s - Message length %d exceeds inspection limit",
+            self->mName, self->mPayload.mLength);
+        errno = EMSGSIZE;
+        goto Finally;
+    }
+
     size_t length = self->mPayload.mLength;
 
     content = malloc(length);
@@ -403,12 +1040,14 @@ message_transfer_payload(struct Message *self, int aFd)
 {
     int rc = -1;
 
+    /* Content that has been read is no longer on the socket, and was
+     * already deducted from the number of remaining bytes.
+     */
+
     if (self->mPayload.mContent) {
         if (self->mPayload.mLength != fd_write(aFd, self->mPayload.mContent, self->mPayload.mLength)) {
             goto Finally;
         }
-
-        self->mSize -= self->mPayload.mLength;
     }
 
     if (transfer_response_bytes(self->mFd, aFd, self->mSize)) {
@@ -494,7 +1133,7 @@ Finally:
 int
 message_peek_bytes(struct Message *self, size_t *size, char **bytes)
 {
-    int rc = 0;
+    int rc = -1;
 
     char *buf = 0;
 
@@ -507,7 +1146,11 @@ message_peek_bytes(struct Message *self, size_t *size, char **bytes)
         goto Finally;
     }
 
-    if (16 * 1024 < length) {
+    /* Fields that are too large to inspect are discarded, and are
+     * reported without content.
+     */
+
+    if (argMaxInspect < length) {
 
         if (transfer_response_bytes(self->mFd, -1, length))
             goto Finally;
@@ -568,255 +1211,289 @@ message_content(const struct Message* self)
 }
 
 /******************************************************************************/
-static struct Message *
-query_agent_identities(
-    struct Message *self, const char *aRole, int aFd, uint32_t *aIdentities)
+static const char *
+upstream_name(unsigned aUpstream)
 {
-    int rc = -1;
+    static const char *upstreamNames[UPSTREAM_MAX] = {
+        "primary", "fallback",
+        "agent2", "agent3", "agent4", "agent5", "agent6", "agent7",
+    };
 
-    if (send_request_identities(aFd)) {
-        warn("Unable to request identities from %s agent", aRole);
-        goto Finally;
-    }
+    return UPSTREAM_MAX > aUpstream ? upstreamNames[aUpstream] : "unknown";
+}
 
-    self = message_init(self, aFd, aRole);
-    if (!self) {
-        warn("Unable to read response from %s agent", aRole);
-        goto Finally;
-    }
+/*----------------------------------------------------------------------------*/
+static int
+upstream_down(struct Agent *self, unsigned aUpstream)
+{
+    const struct Upstream *upstream = &self->mUpstream[aUpstream];
 
-    if (SSH_AGENT_IDENTITIES_ANSWER != message_type(self)) {
-        warn("Unexpected response for %s agent", aRole);
-        goto Finally;
-    }
+    return !upstream->mKeystore && -1 == upstream->mFd;
+}
 
-    uint32_t numIdentities;
-    if (message_peek_uint32_t(self, &numIdentities)) {
-        warn("Unable to read number of identities from %s agent", aRole);
-        goto Finally;
-    }
+/*----------------------------------------------------------------------------*/
+static struct StatReplica *
+upstream_replica(struct Agent *self, unsigned aUpstream)
+{
+    return &stats_->mReplica[aUpstream][self->mUpstream[aUpstream].mReplica];
+}
 
-    if (aIdentities)
-        *aIdentities = numIdentities;
+/*----------------------------------------------------------------------------*/
+static void
+defer_upstream_request(struct Agent *self, unsigned aUpstream)
+{
+    struct Upstream *upstream = &self->mUpstream[aUpstream];
 
-    rc = 0;
+    enum RequestPriority priority = self->mPriority;
 
-Finally:
+    if (!argPriorityNs || upstream->mKeystore || upstream->mInflight)
+        return;
 
-    FINALLY({
-        if (rc) {
-            if (self) {
-                message_purge(self);
-                self = message_close(self);
-            }
-        }
-    });
+    /* Requests in flight are counted in the statistics segment, which
+     * is shared by all the connection processes, so wait by polling
+     * with increasing pauses.
+     */
 
-    return rc ? 0 : self;
-}
+    uint64_t startNs = clk_monotonic_ns();
+    uint64_t nowNs = startNs;
+    uint64_t pauseNs = 50 * 1000;
 
-/*----------------------------------------------------------------------------*/
-static int
-agent_request_identities(struct Agent *self, struct Message *msg)
-{
-    int rc = -1;
+    while (nowNs - startNs < argPriorityNs) {
 
-    DEBUG("Request SSH_AGENTC_REQUEST_IDENTITIES");
+        unsigned inflight = 0;
+        for (unsigned sx = 0; sx < STATS_INFLIGHT; ++sx) {
+            uint64_t slot = atomic_load_explicit(
+                &stats_->mInflight[sx], memory_order_relaxed);
 
-    struct Message primaryMsg_, *primaryMsg = 0;
-    struct Message fallbackMsg_, *fallbackMsg = 0;
+            if (slot && aUpstream == INFLIGHT_UPSTREAM(slot) &&
+                    priority > INFLIGHT_PRIORITY(slot))
+                ++inflight;
+        }
 
-    uint32_t primaryIdentities = 0;
-    primaryMsg = query_agent_identities(
-            &primaryMsg_, "primary", self->mPrimaryFd, &primaryIdentities);
-    if (!primaryMsg)
-        goto Finally;
+        if (!inflight)
+            break;
 
-    uint32_t fallbackIdentities = 0;
-    fallbackMsg = query_agent_identities(
-            &fallbackMsg_, "fallback", self->mFallbackFd, &fallbackIdentities);
-    if (!fallbackMsg)
-        goto Finally;
+        uint64_t remainingNs = argPriorityNs - (nowNs - startNs);
+        if (pauseNs > remainingNs)
+            pauseNs = remainingNs;
 
-    uint32_t totalLength = 0;
-    totalLength += message_length(primaryMsg);
-    totalLength += message_length(fallbackMsg);
+        struct timespec pauseTime = {
+            .tv_sec = pauseNs / 1000000000,
+            .tv_nsec = pauseNs % 1000000000,
+        };
+        nanosleep(&pauseTime, 0);
 
-    uint32_t totalIdentities = 0;
-    totalIdentities += primaryIdentities;
-    totalIdentities += fallbackIdentities;
+        if (pauseNs < 1000 * 1000)
+            pauseNs *= 2;
 
-    DEBUG("Reporting a total of %" PRIu32 " identities", totalIdentities);
+        nowNs = clk_monotonic_ns();
+    }
 
-    uint32_t answerLength = totalLength + 5;
+    if (nowNs != startNs) {
+        DEBUG("Deferred request to %s agent for %" PRIu64 "us",
+            upstream_name(aUpstream), (nowNs - startNs) / 1000);
+        STAT_INC(mDeferred[priority]);
+        STAT_ADD(mDeferredNs[priority], nowNs - startNs);
+    }
 
-    int clientFd = message_fd(msg);
+    uint64_t inflight = INFLIGHT_SLOT(getpid(), aUpstream, priority);
 
-    char identitiesAnswer[] = {
-        (answerLength >> 24) & 0xff,
-        (answerLength >> 16) & 0xff,
-        (answerLength >>  8) & 0xff,
-        (answerLength >>  0) & 0xff,
-        SSH_AGENT_IDENTITIES_ANSWER,
-        (totalIdentities >> 24) & 0xff,
-        (totalIdentities >> 16) & 0xff,
-        (totalIdentities >>  8) & 0xff,
-        (totalIdentities >>  0) & 0xff,
-    };
+    for (unsigned sx = 0; sx < STATS_INFLIGHT; ++sx) {
+        uint64_t slot = 0;
 
-    if (sizeof(identitiesAnswer) !=
-            fd_write(clientFd, identitiesAnswer, sizeof(identitiesAnswer))) {
-        warn("Unable to send response %d", SSH_AGENT_IDENTITIES_ANSWER);
-        goto Finally;
+        if (atomic_compare_exchange_strong(
+                &stats_->mInflight[sx], &slot, inflight)) {
+            upstream->mInflight = sx + 1;
+            break;
+        }
     }
+}
 
-    if (message_transfer_payload(primaryMsg, clientFd)) {
-        warn("Unable to send primary identities");
-        goto Finally;
-    }
+/*----------------------------------------------------------------------------*/
+static void
+release_upstream_request(struct Agent *self, unsigned aUpstream)
+{
+    struct Upstream *upstream = &self->mUpstream[aUpstream];
 
-    if (message_transfer_payload(fallbackMsg, clientFd)) {
-        warn("Unable to send fallback identities");
-        goto Finally;
+    if (upstream->mInflight) {
+        atomic_store(&stats_->mInflight[upstream->mInflight - 1], 0);
+        upstream->mInflight = 0;
     }
+}
 
-    rc = 0;
+/*----------------------------------------------------------------------------*/
+static void
+reap_upstream_requests(struct Stats *aStats, pid_t aPid)
+{
+    /* A connection process that dies with requests in flight leaves
+     * its slots taken, and they are released when it is reaped.
+     */
 
-Finally:
+    for (unsigned sx = 0; sx < STATS_INFLIGHT; ++sx) {
+        uint64_t slot = atomic_load(&aStats->mInflight[sx]);
 
-    FINALLY({
-        if (primaryMsg) {
-            message_purge(primaryMsg);
-            primaryMsg = message_close(primaryMsg);
-        }
-        if (fallbackMsg) {
-            message_purge(fallbackMsg);
-            fallbackMsg = message_close(fallbackMsg);
+        if (slot && aPid == INFLIGHT_PID(slot) &&
+                atomic_compare_exchange_strong(
+                    &aStats->mInflight[sx], &slot, 0)) {
+            DEBUG("Released request in flight at %s agent from pid %d",
+                upstream_name(INFLIGHT_UPSTREAM(slot)), aPid);
         }
-    });
-
-    return rc;
+    }
 }
 
 /*----------------------------------------------------------------------------*/
-static int
-agent_sign_request(
-    struct Agent *self, struct Message *msg)
+static void
+count_upstream_request(struct Agent *self, unsigned aUpstream)
 {
-    int rc = -1;
-
-    DEBUG("Request SSH_AGENTC_SIGN_REQUEST");
-
-    struct Message responseMsg_, *responseMsg = 0;
-
-    if (message_read_payload(msg)) {
-        warn("Unable to read message");
-        goto Finally;
-    }
+    defer_upstream_request(self, aUpstream);
 
-    struct {
-        const char *mName;
-        int mFd;
-    } agents[] = {
-        { "primary agent", self->mPrimaryFd },
-        { "fallback agent", self->mFallbackFd },
-    };
+    self->mUpstream[aUpstream].mPending = 1;
+    self->mRequest.mStage = STAGE_UPSTREAM;
+    self->mUpstream[aUpstream].mSentNs = clk_monotonic_ns();
 
-    for (int ax = 0; ax < NUMBEROF(agents); ++ax) {
+    STAT_INC(mUpstream[aUpstream].mRequests);
+    atomic_fetch_add_explicit(
+        &upstream_replica(self, aUpstream)->mRequests.mValue,
+        1, memory_order_relaxed);
+}
 
-        if (message_send(msg, agents[ax].mFd)) {
-            warn("Unable to send sign request");
-            goto Finally;
-        }
+/*----------------------------------------------------------------------------*/
+static void
+count_upstream_response(struct Agent *self, unsigned aUpstream)
+{
+    struct StatReplica *replica = upstream_replica(self, aUpstream);
 
-        responseMsg = message_init(
-            &responseMsg_, agents[ax].mFd, agents[ax].mName);
-        if (!responseMsg) {
-            warn("Unable to read sign response");
-            goto Finally;
-        }
+    release_upstream_request(self, aUpstream);
 
-        if (SSH_AGENT_SIGN_RESPONSE == message_type(responseMsg)) {
+    self->mRequest.mStage = STAGE_WRITE;
 
-            if (message_transfer(responseMsg, message_fd(msg))) {
-                warn("Unable to transfer sign response");
-                goto Finally;
-            }
+    uint64_t latencyNs =
+        clk_monotonic_ns() - self->mUpstream[aUpstream].mSentNs;
 
-            break;
-        }
+    atomic_fetch_add_explicit(
+        &replica->mResponses.mValue, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(
+        &replica->mLatencyNs.mValue, latencyNs, memory_order_relaxed);
+}
 
-        message_purge(responseMsg);
-        responseMsg = message_close(responseMsg);
+/*----------------------------------------------------------------------------*/
+static void
+eject_replica(unsigned aUpstream, unsigned aReplica)
+{
+    struct StatReplica *replica = &stats_->mReplica[aUpstream][aReplica];
 
-    }
+    atomic_store_explicit(
+        &replica->mEjectedNs.mValue,
+        clk_monotonic_ns() + REPLICA_EJECT_NS, memory_order_relaxed);
+}
 
-    if (!responseMsg) {
-        if (send_response_failure(message_fd(msg)))
-            goto Finally;
-    }
+/*----------------------------------------------------------------------------*/
+static void
+count_upstream_error(struct Agent *self, unsigned aUpstream)
+{
+    struct Upstream *upstream = &self->mUpstream[aUpstream];
 
-    rc = 0;
+    release_upstream_request(self, aUpstream);
 
-Finally:
+    upstream->mFailed = 1;
 
-    FINALLY({
-        if (responseMsg) {
-            message_purge(responseMsg);
-            responseMsg = message_close(responseMsg);
-        }
-    });
+    STAT_INC(mUpstream[aUpstream].mErrors);
+    atomic_fetch_add_explicit(
+        &upstream_replica(self, aUpstream)->mErrors.mValue,
+        1, memory_order_relaxed);
 
-    return rc;
+    if (1 < upstream->mReplicas) {
+        warn("Ejecting %s replica %s",
+            upstream_name(aUpstream), upstream->mPath[upstream->mReplica]);
+        eject_replica(aUpstream, upstream->mReplica);
+    }
 }
 
 /*----------------------------------------------------------------------------*/
 static int
-agent_password_(
-    struct Agent *self,
-    struct Message *msg,
-    int (*aAction)(struct Agent *, size_t, const char *))
+choose_replica(unsigned aUpstream, unsigned aReplicas, unsigned aTried)
 {
-    int rc = -1;
+    unsigned candidate[REPLICA_MAX];
+    unsigned candidates = 0;
 
-    int clientFd = message_fd(msg);
-    size_t msgLen = message_length(msg);
+    uint64_t nowNs = clk_monotonic_ns();
 
-    if (4 > msgLen)
-        goto Finally;
+    const struct StatReplica *replica = stats_->mReplica[aUpstream];
 
-    msgLen -= 4;
+    /* Prefer replicas that have not been ejected, but if every
+     * remaining replica has been ejected, try them anyway.
+     */
 
-    size_t passwordLen;
-    char *password = 0;
+    for (unsigned rx = 0; rx < aReplicas; ++rx) {
+        if (!(aTried & (1u << rx)) && nowNs >= atomic_load_explicit(
+                &replica[rx].mEjectedNs.mValue, memory_order_relaxed))
+            candidate[candidates++] = rx;
+    }
 
-    if (message_peek_bytes(msg, &passwordLen, &password)) {
-        warn("Unable to read password");
-        goto Finally;
+    if (!candidates) {
+        for (unsigned rx = 0; rx < aReplicas; ++rx) {
+            if (!(aTried & (1u << rx)))
+                candidate[candidates++] = rx;
+        }
     }
 
-    DEBUG("Password length %lu", (unsigned long) passwordLen);
+    if (!candidates)
+        return -1;
 
-    if (8 < passwordLen || !password) {
+    /* Choose the less busy of two replicas chosen at random, which
+     * avoids herding all new connections onto the same replica.
+     */
 
-        if (send_response_failure(clientFd))
-            goto Finally;
+    static unsigned seed;
+    if (!seed)
+        seed = getpid() ^ nowNs;
 
-    } else {
+    unsigned lhs = candidate[rand_r(&seed) % candidates];
+    unsigned rhs = candidate[rand_r(&seed) % candidates];
 
-        int result = aAction(self, passwordLen, password);
+    uint64_t lhsActive = atomic_load_explicit(
+        &replica[lhs].mActive.mValue, memory_order_relaxed);
+    uint64_t rhsActive = atomic_load_explicit(
+        &replica[rhs].mActive.mValue, memory_order_relaxed);
 
-        if (-1 == result)
+    return lhsActive <= rhsActive ? lhs : rhs;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+connect_upstream(struct Agent *self, unsigned aUpstream)
+{
+    int rc = -1;
+
+    struct Upstream *upstream = &self->mUpstream[aUpstream];
+
+    unsigned tried = 0;
+
+    while (1) {
+        int replica = choose_replica(aUpstream, upstream->mReplicas, tried);
+        if (-1 == replica)
             goto Finally;
 
-        if (result) {
-            if (send_response_success(clientFd))
-                goto Finally;
-        } else {
-            if (send_response_failure(clientFd))
-                goto Finally;
+        tried |= 1u << replica;
+
+        upstream->mFd = un_connect(upstream->mPath[replica]);
+        if (-1 != upstream->mFd) {
+            upstream->mReplica = replica;
+            atomic_fetch_add_explicit(
+                &upstream_replica(self, aUpstream)->mActive.mValue,
+                1, memory_order_relaxed);
+            break;
         }
 
+        warn("Unable to open %s path %s",
+            upstream_name(aUpstream), upstream->mPath[replica]);
+
+        atomic_fetch_add_explicit(
+            &stats_->mReplica[aUpstream][replica].mErrors.mValue,
+            1, memory_order_relaxed);
+
+        if (1 < upstream->mReplicas)
+            eject_replica(aUpstream, replica);
     }
 
     rc = 0;
@@ -826,161 +1503,5210 @@ Finally:
     return rc;
 }
 
+/*----------------------------------------------------------------------------*/
+static void
+disconnect_upstream(struct Agent *self, unsigned aUpstream)
+{
+    struct Upstream *upstream = &self->mUpstream[aUpstream];
+
+    if (-1 != upstream->mFd) {
+        atomic_fetch_sub_explicit(
+            &upstream_replica(self, aUpstream)->mActive.mValue,
+            1, memory_order_relaxed);
+
+        upstream->mFd = fd_close(upstream->mFd);
+    }
+}
+
 /*----------------------------------------------------------------------------*/
 static int
-agent_lock_(struct Agent *self, size_t aPasswordLen, const char *aPassword)
+client_hangup(struct Agent *self)
+{
+    struct pollfd pollFd = {
+        .fd = self->mClientFd,
+    };
+
+    return 1 == poll(&pollFd, 1, 0) && (pollFd.revents & (POLLHUP | POLLERR));
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+wait_upstream_response(struct Agent *self, unsigned aUpstream)
 {
     int rc = -1;
 
-    if (self->mPassword) {
+    /* Watch the client while waiting for a response from an upstream
+     * agent, so that the request is abandoned as soon as the client
+     * goes away, rather than when the response is written to the
+     * closed socket.
+     */
 
-        rc = 0;
+    struct pollfd pollFds[2] = {
+        { .fd = self->mUpstream[aUpstream].mFd, .events = POLLIN },
+        { .fd = self->mClientFd },
+    };
 
-    } else {
+    while (1) {
+        if (-1 == poll(pollFds, NUMBEROF(pollFds), -1)) {
+            if (EINTR != errno)
+                goto Finally;
+            continue;
+        }
 
-        self->mPassword = malloc(aPasswordLen ? aPasswordLen : 1);
-        if (!self->mPassword)
+        if (pollFds[1].revents & (POLLHUP | POLLERR)) {
+            DEBUG("Abandoning request to %s agent", upstream_name(aUpstream));
+            self->mRequest.mStage = STAGE_UPSTREAM;
+            errno = ECONNABORTED;
             goto Finally;
+        }
 
-        memcpy(self->mPassword, aPassword, aPasswordLen);
-        self->mPasswordLen = aPasswordLen;
-
-        rc = 1;
+        if (pollFds[0].revents)
+            break;
     }
 
+    rc = 0;
+
 Finally:
 
     return rc;
 }
 
-static int
-agent_lock(struct Agent *self, struct Message *msg)
+/******************************************************************************/
+static void
+request_start(struct Request *self)
 {
-    DEBUG("Request SSH_AGENTC_LOCK");
-    return agent_password_(self, msg, agent_lock_);
+    uint64_t nowNs = clk_monotonic_ns();
+
+    *self = (struct Request) {
+        .mStartNs = nowNs,
+        .mMarkNs = nowNs,
+        .mUpstream = "-",
+    };
 }
 
 /*----------------------------------------------------------------------------*/
-static int
-agent_unlock_(struct Agent *self, size_t aPasswordLen, const char *aPassword)
+static void
+request_stage(struct Request *self, enum RequestStage aStage)
 {
-    int rc = -1;
-
-    if (!self->mPassword ||
-            self->mPasswordLen != aPasswordLen ||
-            memcmp(self->mPassword, aPassword, aPasswordLen)) {
+    uint64_t nowNs = clk_monotonic_ns();
 
-        rc = 0;
+    self->mStageNs[aStage] += nowNs - self->mMarkNs;
+    self->mMarkNs = nowNs;
+}
 
-    } else {
+/*----------------------------------------------------------------------------*/
+static void
+digest_fingerprint(const unsigned char *aDigest, char *aBuf, size_t aBufLen)
+{
+    static const char base64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-        free(self->mPassword);
+    const unsigned char *digest = aDigest;
 
-        self->mPassword = 0;
-        self->mPasswordLen = 0;
+    /* Follow ssh-keygen(1) by formatting the digest as unpadded
+     * base64 with a prefix naming the hash algorithm.
+     */
 
-        rc = 1;
+    char fingerprint[sizeof("SHA256:") + (SHA256_DIGEST_LEN + 2) / 3 * 4];
+    char *fp = fingerprint + sprintf(fingerprint, "SHA256:");
+
+    for (int ix = 0; ix < SHA256_DIGEST_LEN; ix += 3) {
+        uint32_t bits = digest[ix] << 16;
+        if (ix + 1 < SHA256_DIGEST_LEN)
+            bits |= digest[ix+1] << 8;
+        if (ix + 2 < SHA256_DIGEST_LEN)
+            bits |= digest[ix+2];
+
+        *fp++ = base64[(bits >> 18) & 0x3f];
+        *fp++ = base64[(bits >> 12) & 0x3f];
+        if (ix + 1 < SHA256_DIGEST_LEN)
+            *fp++ = base64[(bits >> 6) & 0x3f];
+        if (ix + 2 < SHA256_DIGEST_LEN)
+            *fp++ = base64[bits & 0x3f];
     }
+    *fp = 0;
 
-    goto Finally;
-
-Finally:
-
-    return rc;
+    snprintf(aBuf, aBufLen, "%s", fingerprint);
 }
 
-static int
-agent_unlock(struct Agent *self, struct Message *msg)
+/*----------------------------------------------------------------------------*/
+static void
+key_fingerprint(const char *aBlob, size_t aBlobLen, char *aBuf, size_t aBufLen)
 {
-    DEBUG("Request SSH_AGENTC_UNLOCK");
-    return agent_password_(self, msg, agent_unlock_);
+    unsigned char digest[SHA256_DIGEST_LEN];
+    sha256(aBlob, aBlobLen, digest);
+
+    digest_fingerprint(digest, aBuf, aBufLen);
 }
 
 /*----------------------------------------------------------------------------*/
 static int
-agent_primary_request(struct Agent *self, struct Message *msg)
+sign_request_key(const struct Message *aMsg, const char **aBlob, uint32_t *aBlobLen)
 {
     int rc = -1;
 
-    DEBUG("Request %d", message_type(msg));
-
-    struct Message response_, *response = 0;
-
-    if (message_transfer(msg, self->mPrimaryFd)) {
-        warn("Unable to forward request to primary agent");
-        goto Finally;
-    }
+    const char *content = message_content(aMsg);
+    uint32_t contentLen = message_length(aMsg);
 
-    response = message_init(&response_, self->mPrimaryFd, "primary");
-    if (!response) {
-        warn("Unable to read response from primary agent");
+    if (!content) {
+        errno = EINVAL;
         goto Finally;
     }
 
-    if (message_transfer(response, message_fd(msg))) {
-        warn("Unable to forward response from primary agent");
+    if (rd_string(&content, &contentLen, aBlob, aBlobLen))
         goto Finally;
-    }
 
     rc = 0;
 
 Finally:
 
-    FINALLY({
-        message_purge(response);
-        response = message_close(response);
-    });
-
     return rc;
 }
 
-/******************************************************************************/
-static int
-process_double_agent_request(
-    struct Agent *self,
-    int aClientFd)
+/*----------------------------------------------------------------------------*/
+static void
+request_report(
+    struct Request *self, int aType, const struct Message *aMsg,
+    const char *aOutcome)
 {
-    int rc = -1;
+    uint64_t totalNs = self->mMarkNs - self->mStartNs;
 
-    struct Message msg_, *msg;
+    if (totalNs < argSlowNs)
+        return;
 
-    msg = message_init(&msg_, aClientFd, "double agent");
-    if (!msg) {
-        warn("Unable to initialise message");
-        goto Finally;
-    }
+    /* Only compute the fingerprint of the key for requests that are
+     * reported, to keep the cost away from the fast path.
+     */
 
-    switch (message_type(msg)) {
+    char fingerprint[64] = "-";
 
-    case SSH_AGENTC_REQUEST_IDENTITIES:
-        if (agent_request_identities(self, msg))
-            goto Finally;
-        break;
+    if (SSH_AGENTC_SIGN_REQUEST == aType) {
+        const char *blob;
+        uint32_t blobLen;
 
-    case SSH_AGENTC_SIGN_REQUEST:
-        if (agent_sign_request(self, msg))
+        if (!sign_request_key(aMsg, &blob, &blobLen))
+            key_fingerprint(blob, blobLen, fingerprint, sizeof(fingerprint));
+    }
+
+    info("Slow request"
+        " type=%d"
+        " total_us=%" PRIu64
+        " read_us=%" PRIu64
+        " upstream_us=%" PRIu64
+        " write_us=%" PRIu64
+        " upstream=%s"
+        " key=%s"
+        " outcome=%s",
+        aType,
+        totalNs / 1000,
+        self->mStageNs[STAGE_READ] / 1000,
+        self->mStageNs[STAGE_UPSTREAM] / 1000,
+        self->mStageNs[STAGE_WRITE] / 1000,
+        self->mUpstream,
+        fingerprint,
+        aOutcome);
+}
+
+/*----------------------------------------------------------------------------*/
+static char *
+keystore_blob(char *aBlob, const unsigned char *aPublic)
+{
+    static const char keyType[] = KEYSTORE_KEY_TYPE;
+
+    wr_uint32_t(aBlob, sizeof(keyType) - 1);
+    memcpy(aBlob + 4, keyType, sizeof(keyType) - 1);
+    aBlob += 4 + sizeof(keyType) - 1;
+
+    wr_uint32_t(aBlob, ED25519_PUBLIC_LEN);
+    memcpy(aBlob + 4, aPublic, ED25519_PUBLIC_LEN);
+    aBlob += 4 + ED25519_PUBLIC_LEN;
+
+    return aBlob;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+keystore_public(
+    const char *aBlob, uint32_t aBlobLen, const unsigned char **aPublic)
+{
+    int rc = -1;
+
+    const char *type;
+    uint32_t typeLen;
+
+    const char *public;
+    uint32_t publicLen;
+
+    if (rd_string(&aBlob, &aBlobLen, &type, &typeLen) ||
+            rd_string(&aBlob, &aBlobLen, &public, &publicLen) ||
+            aBlobLen) {
+        errno = EINVAL;
+        goto Finally;
+    }
+
+    if (sizeof(KEYSTORE_KEY_TYPE) - 1 != typeLen ||
+            memcmp(KEYSTORE_KEY_TYPE, type, typeLen) ||
+            ED25519_PUBLIC_LEN != publicLen) {
+        errno = ENOENT;
+        goto Finally;
+    }
+
+    *aPublic = (const unsigned char *) public;
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static struct Message *
+answer_keystore_identities(
+    struct Agent *self, struct Message *aAnswerMsg,
+    unsigned aUpstream, uint32_t *aIdentities)
+{
+    int rc = -1;
+
+    const struct Keystore *keystore = self->mUpstream[aUpstream].mKeystore;
+
+    char *content = malloc(
+        keystore->mRecords * (4 + KEYSTORE_BLOB_LEN + 4 + KEYSTORE_COMMENT_LEN));
+    if (!content)
+        goto Finally;
+
+    /* The answer is modelled as though the number of identities has
+     * already been read, just like the answer from an upstream agent.
+     */
+
+    char *contentPtr = content;
+    uint32_t numIdentities = 0;
+
+    for (unsigned rx = 0; rx < keystore->mRecords; ++rx) {
+        struct KeystoreEntry entry;
+
+        if (keystore_read(keystore, rx, &entry))
+            continue;
+
+        wr_uint32_t(contentPtr, KEYSTORE_BLOB_LEN);
+        contentPtr = keystore_blob(contentPtr + 4, entry.mPublic);
+
+        wr_uint32_t(contentPtr, entry.mCommentLen);
+        memcpy(contentPtr + 4, entry.mComment, entry.mCommentLen);
+        contentPtr += 4 + entry.mCommentLen;
+
+        ++numIdentities;
+    }
+
+    aAnswerMsg = message_init_content(
+        aAnswerMsg, upstream_name(aUpstream),
+        SSH_AGENT_IDENTITIES_ANSWER, content, contentPtr - content);
+    content = 0;
+
+    count_upstream_response(self, aUpstream);
+
+    if (aIdentities)
+        *aIdentities = numIdentities;
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        free(content);
+    });
+
+    return rc ? 0 : aAnswerMsg;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+query_agent_identities(struct Agent *self, unsigned aUpstream)
+{
+    int rc = -1;
+
+    const char *upstreamName = upstream_name(aUpstream);
+
+    if (upstream_down(self, aUpstream)) {
+        DEBUG("Skipping unavailable %s agent", upstreamName);
+        rc = 0;
+        goto Finally;
+    }
+
+    count_upstream_request(self, aUpstream);
+    TRACE(TRACE_UPSTREAM_SEND, aUpstream, SSH_AGENTC_REQUEST_IDENTITIES);
+    PROBE(upstream_send, upstreamName, SSH_AGENTC_REQUEST_IDENTITIES, 0);
+
+    if (self->mUpstream[aUpstream].mKeystore) {
+        rc = 0;
+        goto Finally;
+    }
+
+    if (send_request_identities(self->mUpstream[aUpstream].mFd)) {
+        count_upstream_error(self, aUpstream);
+        warn("Unable to request identities from %s agent", upstreamName);
+        goto Finally;
+    }
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static struct Message *
+answer_agent_identities(
+    struct Agent *self, struct Message *aAnswerMsg,
+    unsigned aUpstream, uint32_t *aIdentities)
+{
+    int rc = -1;
+
+    const char *upstreamName = upstream_name(aUpstream);
+
+    if (self->mUpstream[aUpstream].mKeystore)
+        return answer_keystore_identities(
+            self, aAnswerMsg, aUpstream, aIdentities);
+
+    /* An agent that cannot be reached offers no identities, so that
+     * the identities of the other agents remain available.
+     */
+
+    if (upstream_down(self, aUpstream)) {
+        if (aIdentities)
+            *aIdentities = 0;
+
+        return message_init_content(
+            aAnswerMsg, upstreamName, SSH_AGENT_IDENTITIES_ANSWER, 0, 0);
+    }
+
+    if (wait_upstream_response(self, aUpstream))
+        return 0;
+
+    struct Message *answerMsg = message_init(
+        aAnswerMsg, self->mUpstream[aUpstream].mFd, upstreamName);
+    if (!answerMsg) {
+        warn("Unable to read response from %s agent", upstreamName);
+        goto Finally;
+    }
+
+    count_upstream_response(self, aUpstream);
+
+    TRACE(TRACE_UPSTREAM_RECV, aUpstream,
+        TRACE_TYPE_LENGTH(message_type(answerMsg), message_length(answerMsg)));
+    PROBE(upstream_recv,
+        upstreamName, message_type(answerMsg), message_length(answerMsg));
+
+    if (SSH_AGENT_IDENTITIES_ANSWER != message_type(answerMsg)) {
+        warn("Unexpected response for %s agent", upstreamName);
+        goto Finally;
+    }
+
+    uint32_t numIdentities;
+    if (message_peek_uint32_t(answerMsg, &numIdentities)) {
+        warn("Unable to read number of identities from %s agent",
+            upstreamName);
+        goto Finally;
+    }
+
+    if (aIdentities)
+        *aIdentities = numIdentities;
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        if (rc) {
+            count_upstream_error(self, aUpstream);
+            if (answerMsg) {
+                message_purge(answerMsg);
+                answerMsg = message_close(answerMsg);
+            }
+        }
+    });
+
+    return rc ? 0 : answerMsg;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+agent_allow_key(
+    struct Agent *self,
+    const unsigned char *aDigest,
+    const char *aBlob, uint32_t aBlobLen,
+    const char *aComment, uint32_t aCommentLen)
+{
+    if (!self->mPolicy)
+        return 1;
+
+    /* The key type is the first field of the key blob */
+
+    const char *type = 0;
+    uint32_t typeLen = 0;
+
+    rd_string(&aBlob, &aBlobLen, &type, &typeLen);
+
+    struct PolicyKey key = {
+        .mDigest = aDigest,
+        .mType = type,
+        .mTypeLen = typeLen,
+        .mComment = aComment,
+        .mCommentLen = aCommentLen,
+    };
+
+    int allow = policy_allow(self->mPolicy, &self->mClient, &key);
+
+    if (-1 == allow) {
+        warn("Unable to apply policy to key");
+        allow = 0;
+    }
+
+    return allow;
+}
+
+/*----------------------------------------------------------------------------*/
+struct Identity {
+    const char *mRecord;
+    uint32_t    mRecordLen;
+    const char *mBlob;
+    uint32_t    mBlobLen;
+    const char *mComment;
+    uint32_t    mCommentLen;
+    uint64_t    mScore;
+    unsigned char mKey[SHA256_DIGEST_LEN];
+    unsigned    mOrder;
+    unsigned    mUpstream;
+};
+
+static int
+parse_identities(
+    struct Message *aMsg, unsigned aUpstream,
+    uint32_t aIdentities, struct Identity *aIdentity)
+{
+    int rc = -1;
+
+    const char *content = message_content(aMsg);
+    uint32_t contentLen = content ? message_length(aMsg) : 0;
+
+    for (uint32_t ix = 0; ix < aIdentities; ++ix) {
+
+        const char *record = content;
+
+        const char *blob;
+        uint32_t blobLen;
+
+        const char *comment;
+        uint32_t commentLen;
+
+        if (rd_string(&content, &contentLen, &blob, &blobLen) ||
+                rd_string(&content, &contentLen, &comment, &commentLen)) {
+            warn("Unable to parse identity %" PRIu32 " from %s agent",
+                ix, aMsg->mName);
+            goto Finally;
+        }
+
+        aIdentity[ix] = (struct Identity) {
+            .mRecord = record,
+            .mRecordLen = content - record,
+            .mBlob = blob,
+            .mBlobLen = blobLen,
+            .mComment = comment,
+            .mCommentLen = commentLen,
+            .mUpstream = aUpstream,
+        };
+
+        sha256(blob, blobLen, aIdentity[ix].mKey);
+    }
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+compare_identity_score(const void *aLhs, const void *aRhs)
+{
+    const struct Identity *lhs = aLhs;
+    const struct Identity *rhs = aRhs;
+
+    if (lhs->mScore != rhs->mScore)
+        return lhs->mScore > rhs->mScore ? -1 : 1;
+
+    return lhs->mOrder < rhs->mOrder ? -1 : lhs->mOrder > rhs->mOrder;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+send_identities(int aFd, const struct Identity *aIdentity, uint32_t aIdentities)
+{
+    int rc = -1;
+
+    char *answer = 0;
+
+    uint32_t answerLength = 5;
+    for (uint32_t ix = 0; ix < aIdentities; ++ix)
+        answerLength += aIdentity[ix].mRecordLen;
+
+    answer = malloc(4 + answerLength);
+    if (!answer)
+        goto Finally;
+
+    char *answerPtr = answer;
+
+    wr_uint32_t(answerPtr, answerLength);
+    answerPtr += 4;
+    *answerPtr++ = SSH_AGENT_IDENTITIES_ANSWER;
+    wr_uint32_t(answerPtr, aIdentities);
+    answerPtr += 4;
+
+    for (uint32_t ix = 0; ix < aIdentities; ++ix) {
+        memcpy(answerPtr, aIdentity[ix].mRecord, aIdentity[ix].mRecordLen);
+        answerPtr += aIdentity[ix].mRecordLen;
+    }
+
+    if (4 + answerLength != fd_write(aFd, answer, 4 + answerLength))
+        goto Finally;
+
+    count_response(SSH_AGENT_IDENTITIES_ANSWER, 4 + answerLength);
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        free(answer);
+    });
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static size_t
+key_slot(const unsigned char *aKey, size_t aSlots)
+{
+    size_t hash = 0;
+    for (int bx = 0; bx < sizeof(hash); ++bx)
+        hash = (hash << 8) | aKey[bx];
+
+    return hash & (aSlots - 1);
+}
+
+/*----------------------------------------------------------------------------*/
+static uint32_t
+dedup_identities(struct Identity *aIdentity, uint32_t aIdentities)
+{
+    uint32_t identities = 0;
+
+    uint32_t *slots = 0;
+
+    /* Index the identities using an open addressed table that is at
+     * least twice the number of identities, so that the memory used
+     * is proportional to the size of the answers. Earlier identities
+     * are kept, so that identities from agents earlier in the chain
+     * take precedence.
+     */
+
+    size_t numSlots = 2;
+    while (numSlots < 2 * (size_t) aIdentities)
+        numSlots *= 2;
+
+    slots = calloc(numSlots, sizeof(*slots));
+    if (!slots) {
+        identities = aIdentities;
+        goto Finally;
+    }
+
+    for (uint32_t ix = 0; ix < aIdentities; ++ix) {
+
+        const unsigned char *key = aIdentity[ix].mKey;
+
+        size_t sx = key_slot(key, numSlots);
+
+        while (slots[sx] && memcmp(
+                aIdentity[slots[sx]-1].mKey, key, sizeof(aIdentity[ix].mKey)))
+            sx = (sx + 1) & (numSlots - 1);
+
+        if (slots[sx])
+            continue;
+
+        aIdentity[identities] = aIdentity[ix];
+        slots[sx] = ++identities;
+    }
+
+Finally:
+
+    FINALLY({
+        free(slots);
+    });
+
+    return identities;
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+route_identities(
+    struct Agent *self, const struct Identity *aIdentity, uint32_t aIdentities)
+{
+    free(self->mRoute);
+    self->mRoute = 0;
+    self->mRouteSlots = 0;
+
+    /* The identities are unique, so each key is routed to the first
+     * agent in the chain that offered it. If the table cannot be
+     * allocated, sign requests visit the agents in chain order.
+     */
+
+    size_t numSlots = 2;
+    while (numSlots < 2 * (size_t) aIdentities)
+        numSlots *= 2;
+
+    struct KeyRoute *route = calloc(numSlots, sizeof(*route));
+    if (!route)
+        return;
+
+    for (uint32_t ix = 0; ix < aIdentities; ++ix) {
+
+        const unsigned char *key = aIdentity[ix].mKey;
+
+        size_t sx = key_slot(key, numSlots);
+
+        while (route[sx].mUpstream)
+            sx = (sx + 1) & (numSlots - 1);
+
+        memcpy(route[sx].mKey, key, sizeof(route[sx].mKey));
+        route[sx].mUpstream = aIdentity[ix].mUpstream + 1;
+    }
+
+    self->mRoute = route;
+    self->mRouteSlots = numSlots;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+route_key(const struct Agent *self, const unsigned char *aKey)
+{
+    if (!self->mRoute)
+        return -1;
+
+    size_t sx = key_slot(aKey, self->mRouteSlots);
+
+    const struct KeyRoute *route = self->mRoute;
+
+    while (route[sx].mUpstream) {
+        if (!memcmp(route[sx].mKey, aKey, sizeof(route[sx].mKey)))
+            return route[sx].mUpstream - 1;
+        sx = (sx + 1) & (self->mRouteSlots - 1);
+    }
+
+    return -1;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+merge_identities(
+    struct Agent *self,
+    struct Message *msg,
+    struct Message **aUpstreamMsg, const uint32_t *aUpstreamIdentities)
+{
+    int rc = -1;
+
+    struct Identity *identities = 0;
+
+    /* Each identity comprises at least two length fields, which bounds
+     * the number of identities that a response can describe.
+     */
+
+    uint32_t totalIdentities = 0;
+
+    for (unsigned ux = 0; ux < self->mUpstreams; ++ux) {
+        if (message_length(aUpstreamMsg[ux]) / 8 < aUpstreamIdentities[ux]) {
+            errno = EINVAL;
+            warn("Mismatched number of identities from %s agent",
+                upstream_name(ux));
+            goto Finally;
+        }
+
+        if (message_length(aUpstreamMsg[ux]) &&
+                !message_content(aUpstreamMsg[ux]) &&
+                message_read_payload(aUpstreamMsg[ux])) {
+            warn("Unable to read %s identities", upstream_name(ux));
+            goto Finally;
+        }
+
+        totalIdentities += aUpstreamIdentities[ux];
+    }
+
+    identities = malloc(
+        sizeof(*identities) * (totalIdentities ? totalIdentities : 1));
+    if (!identities)
+        goto Finally;
+
+    struct Identity *upstreamIdentity = identities;
+
+    for (unsigned ux = 0; ux < self->mUpstreams; ++ux) {
+        if (parse_identities(
+                aUpstreamMsg[ux], ux,
+                aUpstreamIdentities[ux], upstreamIdentity))
+            goto Finally;
+        upstreamIdentity += aUpstreamIdentities[ux];
+    }
+
+    uint32_t uniqueIdentities = dedup_identities(identities, totalIdentities);
+
+    if (uniqueIdentities != totalIdentities) {
+        DEBUG("Removed %" PRIu32 " duplicate identities",
+            totalIdentities - uniqueIdentities);
+        STAT_ADD(mDuplicates, totalIdentities - uniqueIdentities);
+        totalIdentities = uniqueIdentities;
+    }
+
+    route_identities(self, identities, totalIdentities);
+
+    if (self->mPolicy) {
+        uint32_t allowedIdentities = 0;
+
+        for (uint32_t ix = 0; ix < totalIdentities; ++ix) {
+            const struct Identity *identity = &identities[ix];
+
+            if (agent_allow_key(
+                    self, identity->mKey,
+                    identity->mBlob, identity->mBlobLen,
+                    identity->mComment, identity->mCommentLen))
+                identities[allowedIdentities++] = *identity;
+        }
+
+        DEBUG("Policy allowed %" PRIu32 " of %" PRIu32 " identities",
+            allowedIdentities, totalIdentities);
+        totalIdentities = allowedIdentities;
+    }
+
+    unsigned char hintKey[SHA256_DIGEST_LEN];
+
+    int hint = argHostHint && self->mBound &&
+        !usage_recall(self->mUsage, self->mHost, hintKey);
+
+    for (uint32_t ix = 0; ix < totalIdentities; ++ix) {
+        identities[ix].mOrder = ix;
+
+        if (hint && !memcmp(hintKey, identities[ix].mKey, sizeof(hintKey)))
+            identities[ix].mScore = UINT64_MAX;
+        else if (optUsageOrder)
+            identities[ix].mScore = usage_score(
+                self->mUsage, identities[ix].mKey);
+        else
+            identities[ix].mScore = 0;
+    }
+
+    qsort(identities,
+        totalIdentities, sizeof(*identities), compare_identity_score);
+
+    /* Only offer the hinted key if it is still held by one of the
+     * agents, otherwise offer all the keys so that the client has
+     * an opportunity to find another.
+     */
+
+    if (HOST_HINT_ONLY == argHostHint &&
+            totalIdentities && UINT64_MAX == identities[0].mScore) {
+        DEBUG("Offering only hinted identity");
+        totalIdentities = 1;
+    }
+
+    self->mRequest.mResponded = 1;
+
+    if (send_identities(message_fd(msg), identities, totalIdentities)) {
+        warn("Unable to send identities");
+        goto Finally;
+    }
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        free(identities);
+    });
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+stream_identities(
+    struct Agent *self,
+    struct Message *msg,
+    struct Message **aUpstreamMsg, const uint32_t *aUpstreamIdentities)
+{
+    int rc = -1;
+
+    /* Answers that are too large to inspect are concatenated without
+     * being reordered, deduplicated, or filtered.
+     */
+
+    uint32_t totalLength = 0;
+    uint32_t totalIdentities = 0;
+
+    for (unsigned ux = 0; ux < self->mUpstreams; ++ux) {
+        totalLength += message_length(aUpstreamMsg[ux]);
+        totalIdentities += aUpstreamIdentities[ux];
+    }
+
+    uint32_t answerLength = totalLength + 5;
+
+    int clientFd = message_fd(msg);
+
+    self->mRequest.mResponded = 1;
+
+    char identitiesAnswer[9];
+
+    wr_uint32_t(identitiesAnswer, answerLength);
+    identitiesAnswer[4] = SSH_AGENT_IDENTITIES_ANSWER;
+    wr_uint32_t(identitiesAnswer + 5, totalIdentities);
+
+    if (sizeof(identitiesAnswer) !=
+            fd_write(clientFd, identitiesAnswer, sizeof(identitiesAnswer))) {
+        warn("Unable to send response %d", SSH_AGENT_IDENTITIES_ANSWER);
+        goto Finally;
+    }
+
+    for (unsigned ux = 0; ux < self->mUpstreams; ++ux) {
+        if (message_transfer_payload(aUpstreamMsg[ux], clientFd)) {
+            warn("Unable to send %s identities", upstream_name(ux));
+            goto Finally;
+        }
+    }
+
+    count_response(SSH_AGENT_IDENTITIES_ANSWER, 4 + answerLength);
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+agent_request_identities(struct Agent *self, struct Message *msg)
+{
+    int rc = -1;
+
+    DEBUG("Request SSH_AGENTC_REQUEST_IDENTITIES");
+
+    struct Message upstreamMsg_[UPSTREAM_MAX];
+    struct Message *upstreamMsg[UPSTREAM_MAX] = { };
+    uint32_t upstreamIdentities[UPSTREAM_MAX] = { };
+
+    /* Query every agent before reading any answer, so that the agents
+     * prepare their answers concurrently, and the wait is bounded by
+     * the slowest agent rather than the sum of all the agents.
+     */
+
+    for (unsigned ux = 0; ux < self->mUpstreams; ++ux) {
+        if (query_agent_identities(self, ux))
+            goto Finally;
+    }
+
+    int inspect = 1;
+    uint32_t totalIdentities = 0;
+
+    for (unsigned ux = 0; ux < self->mUpstreams; ++ux) {
+        upstreamMsg[ux] = answer_agent_identities(
+            self, &upstreamMsg_[ux], ux, &upstreamIdentities[ux]);
+        if (!upstreamMsg[ux])
+            goto Finally;
+
+        totalIdentities += upstreamIdentities[ux];
+
+        if (argMaxInspect < message_length(upstreamMsg[ux]))
+            inspect = 0;
+    }
+
+    request_stage(&self->mRequest, STAGE_UPSTREAM);
+
+    self->mRequest.mUpstream = "all";
+
+    DEBUG("Merging a total of %" PRIu32 " identities", totalIdentities);
+    TRACE(TRACE_IDENTITIES, self->mUpstreams, totalIdentities);
+
+    /* Answers that are streamed cannot be filtered, so refuse them
+     * rather than offer identities that the policy denies.
+     */
+
+    if (!inspect && self->mPolicy) {
+        errno = EMSGSIZE;
+        warn("Identities exceed inspection limit required by policy");
+        if (send_response_failure(message_fd(msg)))
+            goto Finally;
+    } else if (!inspect) {
+        DEBUG("Streaming identities");
+        if (stream_identities(self, msg, upstreamMsg, upstreamIdentities))
+            goto Finally;
+    } else {
+        if (merge_identities(self, msg, upstreamMsg, upstreamIdentities))
+            goto Finally;
+    }
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        for (unsigned ux = 0; ux < self->mUpstreams; ++ux) {
+            if (upstreamMsg[ux]) {
+                message_purge(upstreamMsg[ux]);
+                upstreamMsg[ux] = message_close(upstreamMsg[ux]);
+            }
+        }
+    });
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+count_sign_latency(uint64_t aNs)
+{
+    uint64_t us = aNs / 1000;
+
+    int bx = 0;
+    while (bx < STATS_LATENCY - 1 && (us >> (bx + 1)))
+        ++bx;
+
+    STAT_INC(mSignLatency[bx]);
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+hedge_delay_ms(void)
+{
+    if (!argHedgePercentile)
+        return -1;
+
+    uint64_t samples[STATS_LATENCY];
+
+    uint64_t numSamples = 0;
+    for (int bx = 0; bx < STATS_LATENCY; ++bx) {
+        samples[bx] = atomic_load_explicit(
+            &stats_->mSignLatency[bx].mValue, memory_order_relaxed);
+        numSamples += samples[bx];
+    }
+
+    if (HEDGE_MIN_SAMPLES > numSamples)
+        return HEDGE_DEFAULT_MS;
+
+    int bx;
+    uint64_t belowSamples = 0;
+    for (bx = 0; bx < STATS_LATENCY - 1; ++bx) {
+        belowSamples += samples[bx];
+        if (belowSamples * 100 >= numSamples * argHedgePercentile)
+            break;
+    }
+
+    uint64_t delayMs = ((UINT64_C(1) << (bx + 1)) + 999) / 1000;
+
+    return INT_MAX < delayMs ? INT_MAX : delayMs;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+send_sign_request(
+    struct Agent *self, struct Message *msg, unsigned aUpstream)
+{
+    int rc = -1;
+
+    count_upstream_request(self, aUpstream);
+    TRACE(TRACE_UPSTREAM_SEND, aUpstream, SSH_AGENTC_SIGN_REQUEST);
+    PROBE(upstream_send, upstream_name(aUpstream),
+        SSH_AGENTC_SIGN_REQUEST, message_length(msg));
+
+    if (message_send(msg, self->mUpstream[aUpstream].mFd)) {
+        count_upstream_error(self, aUpstream);
+        warn("Unable to send sign request to %s agent",
+            upstream_name(aUpstream));
+        goto Finally;
+    }
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+send_sign_response(
+    struct Agent *self, struct Message *msg,
+    unsigned aUpstream, struct Message *aResponseMsg)
+{
+    int rc = -1;
+
+    self->mRequest.mUpstream = upstream_name(aUpstream);
+
+    const char *blob;
+    uint32_t blobLen;
+
+    if (self->mUsage && !sign_request_key(msg, &blob, &blobLen)) {
+        unsigned char key[SHA256_DIGEST_LEN];
+        sha256(blob, blobLen, key);
+
+        usage_record(self->mUsage, key, self->mBound ? self->mHost : 0);
+    }
+
+    uint32_t responseLength = 5 + message_length(aResponseMsg);
+
+    self->mRequest.mResponded = 1;
+
+    if (message_transfer(aResponseMsg, message_fd(msg))) {
+        warn("Unable to transfer sign response");
+        goto Finally;
+    }
+
+    count_response(SSH_AGENT_SIGN_RESPONSE, responseLength);
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static struct Message *
+recv_sign_response(
+    struct Agent *self, struct Message *aResponseMsg, unsigned aUpstream)
+{
+    int rc = -1;
+
+    aResponseMsg = message_init(
+        aResponseMsg, self->mUpstream[aUpstream].mFd, upstream_name(aUpstream));
+
+    if (!aResponseMsg) {
+        count_upstream_error(self, aUpstream);
+        warn("Unable to read sign response from %s agent",
+            upstream_name(aUpstream));
+        goto Finally;
+    }
+
+    count_upstream_response(self, aUpstream);
+
+    TRACE(TRACE_UPSTREAM_RECV, aUpstream,
+        TRACE_TYPE_LENGTH(
+            message_type(aResponseMsg), message_length(aResponseMsg)));
+    PROBE(upstream_recv, upstream_name(aUpstream),
+        message_type(aResponseMsg), message_length(aResponseMsg));
+
+    if (SSH_AGENT_SIGN_RESPONSE != message_type(aResponseMsg))
+        STAT_INC(mUpstream[aUpstream].mFailures);
+
+    rc = 0;
+
+Finally:
+
+    return rc ? 0 : aResponseMsg;
+}
+
+/*----------------------------------------------------------------------------*/
+static unsigned
+route_sign_request(
+    struct Agent *self, struct Message *msg, unsigned *aOrder)
+{
+    unsigned orders = 0;
+
+    /* Offer the request first to the agent that offered the key, if
+     * known, and then to the remaining agents in chain order.
+     */
+
+    int routed = -1;
+
+    const char *blob;
+    uint32_t blobLen;
+
+    if (self->mRoute && !sign_request_key(msg, &blob, &blobLen)) {
+        unsigned char key[SHA256_DIGEST_LEN];
+        sha256(blob, blobLen, key);
+
+        routed = route_key(self, key);
+    }
+
+    if (-1 != routed) {
+        DEBUG("Routing sign request to %s agent", upstream_name(routed));
+        aOrder[orders++] = routed;
+    }
+
+    for (unsigned ux = 0; ux < self->mUpstreams; ++ux) {
+        if (ux != routed && !self->mUpstream[ux].mKeystore)
+            aOrder[orders++] = ux;
+    }
+
+    return orders;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+keystore_sign_request(
+    struct Agent *self, struct Message *msg, unsigned aUpstream)
+{
+    int rc = -1;
+
+    struct Message responseMsg_, *responseMsg = 0;
+
+    char *response = 0;
+
+    const char *content = message_content(msg);
+    uint32_t contentLen = message_length(msg);
+
+    const char *blob;
+    uint32_t blobLen;
+
+    const char *data;
+    uint32_t dataLen;
+
+    if (rd_string(&content, &contentLen, &blob, &blobLen) ||
+            rd_string(&content, &contentLen, &data, &dataLen)) {
+        warn("Unable to parse sign request");
+        goto Finally;
+    }
+
+    /* Keys that are not held by the keystore are offered to the
+     * remaining agents in the chain.
+     */
+
+    const unsigned char *public;
+    if (keystore_public(blob, blobLen, &public)) {
+        rc = 0;
+        goto Finally;
+    }
+
+    count_upstream_request(self, aUpstream);
+    TRACE(TRACE_UPSTREAM_SEND, aUpstream, SSH_AGENTC_SIGN_REQUEST);
+
+    /* The response holds the signature blob, which is the key type
+     * followed by the signature itself.
+     */
+
+    static const char keyType[] = KEYSTORE_KEY_TYPE;
+
+    uint32_t signatureLen =
+        4 + sizeof(keyType) - 1 + 4 + ED25519_SIGNATURE_LEN;
+
+    response = malloc(4 + signatureLen);
+    if (!response)
+        goto Finally;
+
+    char *responsePtr = response;
+
+    wr_uint32_t(responsePtr, signatureLen);
+    wr_uint32_t(responsePtr + 4, sizeof(keyType) - 1);
+    memcpy(responsePtr + 8, keyType, sizeof(keyType) - 1);
+    responsePtr += 8 + sizeof(keyType) - 1;
+
+    wr_uint32_t(responsePtr, ED25519_SIGNATURE_LEN);
+    responsePtr += 4;
+
+    if (keystore_sign(
+            self->mUpstream[aUpstream].mKeystore, public,
+            data, dataLen, (unsigned char *) responsePtr)) {
+        if (ENOENT != errno) {
+            count_upstream_error(self, aUpstream);
+            warn("Unable to sign with keystore");
+            goto Finally;
+        }
+
+        count_upstream_response(self, aUpstream);
+        STAT_INC(mUpstream[aUpstream].mFailures);
+        rc = 0;
+        goto Finally;
+    }
+
+    count_upstream_response(self, aUpstream);
+    TRACE(TRACE_UPSTREAM_RECV, aUpstream,
+        TRACE_TYPE_LENGTH(SSH_AGENT_SIGN_RESPONSE, 4 + signatureLen));
+
+    request_stage(&self->mRequest, STAGE_UPSTREAM);
+
+    responseMsg = message_init_content(
+        &responseMsg_, upstream_name(aUpstream),
+        SSH_AGENT_SIGN_RESPONSE, response, 4 + signatureLen);
+    response = 0;
+
+    if (send_sign_response(self, msg, aUpstream, responseMsg))
+        goto Finally;
+
+    rc = 1;
+
+Finally:
+
+    FINALLY({
+        free(response);
+        responseMsg = message_close(responseMsg);
+    });
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+agent_sign_request(
+    struct Agent *self, struct Message *msg)
+{
+    int rc = -1;
+
+    DEBUG("Request SSH_AGENTC_SIGN_REQUEST");
+
+    struct Message responseMsg_, *responseMsg = 0;
+
+    /* Sign requests are offered to each agent in turn, so they must be
+     * held in memory. Refuse requests that are too large to hold.
+     */
+
+    if (argMaxInspect < message_length(msg)) {
+        errno = EMSGSIZE;
+        warn("Sign request length %d exceeds inspection limit",
+            message_length(msg));
+        if (send_response_failure(message_fd(msg)))
+            goto Finally;
+
+        rc = 0;
+        goto Finally;
+    }
+
+    if (!message_content(msg) && message_read_payload(msg)) {
+        warn("Unable to read message");
+        goto Finally;
+    }
+
+    request_stage(&self->mRequest, STAGE_READ);
+
+    for (unsigned ux = 0; ux < self->mUpstreams; ++ux) {
+        if (!self->mUpstream[ux].mKeystore)
+            continue;
+
+        int signedByKeystore = keystore_sign_request(self, msg, ux);
+        if (-1 == signedByKeystore)
+            goto Finally;
+
+        if (signedByKeystore) {
+            rc = 0;
+            goto Finally;
+        }
+    }
+
+    unsigned order[UPSTREAM_MAX];
+    unsigned orders = route_sign_request(self, msg, order);
+
+    int outstanding[UPSTREAM_MAX] = { };
+    unsigned numOutstanding = 0;
+
+    /* The latency of the first agent that is actually sent the request
+     * is sampled to compute the hedging delay, even if earlier agents
+     * in the order were skipped because they are unavailable.
+     */
+
+    int first = -1;
+    uint64_t firstSentNs = 0;
+    uint64_t hedgeNs = 0;
+
+    /* Offer the request to one agent at a time, moving to the next
+     * agent when an agent fails. If the first agent does not respond
+     * within the hedging delay, also offer the request to the next
+     * agent, and use the first signature from either.
+     */
+
+    int hedged = 0;
+    int winner = -1;
+
+    for (unsigned next = 0, send = 1; -1 == winner; ) {
+
+        if (send) {
+            if (next == orders)
+                break;
+
+            unsigned ux = order[next++];
+            if (upstream_down(self, ux)) {
+                DEBUG("Skipping unavailable %s agent", upstream_name(ux));
+                send = next < orders || !numOutstanding;
+                continue;
+            }
+
+            if (send_sign_request(self, msg, ux))
+                goto Finally;
+
+            outstanding[ux] = 1;
+            ++numOutstanding;
+            send = 0;
+
+            if (-1 == first) {
+                first = ux;
+                firstSentNs = clk_monotonic_ns();
+
+                int delayMs = next < orders ? hedge_delay_ms() : -1;
+                if (-1 != delayMs)
+                    hedgeNs = firstSentNs + delayMs * UINT64_C(1000000);
+            }
+        }
+
+        int timeoutMs = -1;
+        if (hedgeNs) {
+            uint64_t nowNs = clk_monotonic_ns();
+            uint64_t waitMs = hedgeNs > nowNs ?
+                (hedgeNs - nowNs + 999999) / 1000000 : 0;
+
+            timeoutMs = INT_MAX < waitMs ? INT_MAX : waitMs;
+        }
+
+        struct pollfd pollFds[UPSTREAM_MAX + 1];
+        for (unsigned ux = 0; ux < self->mUpstreams; ++ux) {
+            pollFds[ux] = (struct pollfd) {
+                .fd = outstanding[ux] ? self->mUpstream[ux].mFd : -1,
+                .events = POLLIN,
+            };
+        }
+
+        pollFds[self->mUpstreams] = (struct pollfd) {
+            .fd = self->mClientFd,
+        };
+
+        int ready = poll(pollFds, self->mUpstreams + 1, timeoutMs);
+        if (-1 == ready) {
+            if (EINTR != errno) {
+                warn("Unable to wait for sign response");
+                goto Finally;
+            }
+            continue;
+        }
+
+        if (pollFds[self->mUpstreams].revents & (POLLHUP | POLLERR)) {
+            DEBUG("Abandoning sign request");
+            self->mRequest.mStage = STAGE_UPSTREAM;
+            errno = ECONNABORTED;
+            goto Finally;
+        }
+
+        if (!ready) {
+            DEBUG("Hedging sign request");
+            STAT_INC(mHedges);
+            hedged = 1;
+            hedgeNs = 0;
+            send = 1;
+            continue;
+        }
+
+        for (unsigned ux = 0; -1 == winner && ux < self->mUpstreams; ++ux) {
+            if (!pollFds[ux].revents)
+                continue;
+
+            outstanding[ux] = 0;
+            --numOutstanding;
+
+            responseMsg = recv_sign_response(self, &responseMsg_, ux);
+            if (first == ux) {
+                count_sign_latency(clk_monotonic_ns() - firstSentNs);
+                hedgeNs = 0;
+            }
+            request_stage(&self->mRequest, STAGE_UPSTREAM);
+            if (!responseMsg)
+                goto Finally;
+
+            if (SSH_AGENT_SIGN_RESPONSE == message_type(responseMsg)) {
+                winner = ux;
+                if (send_sign_response(self, msg, ux, responseMsg))
+                    goto Finally;
+            } else {
+                message_purge(responseMsg);
+                responseMsg = message_close(responseMsg);
+            }
+        }
+
+        /* Once no request is outstanding, offer the request to the
+         * next agent in the chain.
+         */
+
+        if (!numOutstanding)
+            send = 1;
+    }
+
+    if (-1 == winner) {
+        if (send_response_failure(message_fd(msg)))
+            goto Finally;
+    } else if (hedged && first != winner) {
+        STAT_INC(mHedgeWins);
+    }
+
+    /* Drain responses to losing requests that have already arrived,
+     * so that the upstream agent can be used again by later requests
+     * on this connection. Rather than wait for a slow agent, close
+     * its connection so that the next request uses a fresh one.
+     */
+
+    for (unsigned ux = 0; ux < self->mUpstreams; ++ux) {
+        if (!outstanding[ux])
+            continue;
+
+        if (responseMsg) {
+            message_purge(responseMsg);
+            responseMsg = message_close(responseMsg);
+        }
+
+        if (1 != fd_wait_rd(self->mUpstream[ux].mFd, 0)) {
+            DEBUG("Closing %s agent with sign response outstanding",
+                upstream_name(ux));
+            disconnect_upstream(self, ux);
+            continue;
+        }
+
+        responseMsg = recv_sign_response(self, &responseMsg_, ux);
+        if (first == ux)
+            count_sign_latency(clk_monotonic_ns() - firstSentNs);
+        if (!responseMsg)
+            continue;
+
+        DEBUG("Drained %s sign response", upstream_name(ux));
+    }
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        if (responseMsg) {
+            message_purge(responseMsg);
+            responseMsg = message_close(responseMsg);
+        }
+    });
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+agent_password_(
+    struct Agent *self,
+    struct Message *msg,
+    int (*aAction)(struct Agent *, size_t, const char *))
+{
+    int rc = -1;
+
+    int clientFd = message_fd(msg);
+    size_t msgLen = message_length(msg);
+
+    if (4 > msgLen)
+        goto Finally;
+
+    msgLen -= 4;
+
+    size_t passwordLen;
+    char *password = 0;
+
+    if (message_peek_bytes(msg, &passwordLen, &password)) {
+        warn("Unable to read password");
+        goto Finally;
+    }
+
+    DEBUG("Password length %lu", (unsigned long) passwordLen);
+
+    if (8 < passwordLen || !password) {
+
+        if (send_response_failure(clientFd))
+            goto Finally;
+
+    } else {
+
+        int result = aAction(self, passwordLen, password);
+
+        if (-1 == result)
+            goto Finally;
+
+        if (result) {
+            if (send_response_success(clientFd))
+                goto Finally;
+        } else {
+            if (send_response_failure(clientFd))
+                goto Finally;
+        }
+
+    }
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+agent_lock_(struct Agent *self, size_t aPasswordLen, const char *aPassword)
+{
+    int rc = -1;
+
+    if (self->mPassword) {
+
+        rc = 0;
+
+    } else {
+
+        self->mPassword = malloc(aPasswordLen ? aPasswordLen : 1);
+        if (!self->mPassword)
+            goto Finally;
+
+        memcpy(self->mPassword, aPassword, aPasswordLen);
+        self->mPasswordLen = aPasswordLen;
+
+        rc = 1;
+    }
+
+Finally:
+
+    return rc;
+}
+
+static int
+agent_lock(struct Agent *self, struct Message *msg)
+{
+    DEBUG("Request SSH_AGENTC_LOCK");
+    return agent_password_(self, msg, agent_lock_);
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+agent_unlock_(struct Agent *self, size_t aPasswordLen, const char *aPassword)
+{
+    int rc = -1;
+
+    if (!self->mPassword ||
+            self->mPasswordLen != aPasswordLen ||
+            memcmp(self->mPassword, aPassword, aPasswordLen)) {
+
+        rc = 0;
+
+    } else {
+
+        free(self->mPassword);
+
+        self->mPassword = 0;
+        self->mPasswordLen = 0;
+
+        rc = 1;
+    }
+
+    goto Finally;
+
+Finally:
+
+    return rc;
+}
+
+static int
+agent_unlock(struct Agent *self, struct Message *msg)
+{
+    DEBUG("Request SSH_AGENTC_UNLOCK");
+    return agent_password_(self, msg, agent_unlock_);
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+keystore_add_identity(struct Keystore *aKeystore, struct Message *msg)
+{
+    int rc = -1;
+
+    const char *content = message_content(msg);
+    uint32_t contentLen = message_length(msg);
+
+    const char *type;
+    uint32_t typeLen;
+
+    const char *public;
+    uint32_t publicLen;
+
+    const char *private;
+    uint32_t privateLen;
+
+    const char *comment;
+    uint32_t commentLen;
+
+    if (rd_string(&content, &contentLen, &type, &typeLen)) {
+        errno = EINVAL;
+        goto Finally;
+    }
+
+    if (sizeof(KEYSTORE_KEY_TYPE) - 1 != typeLen ||
+            memcmp(KEYSTORE_KEY_TYPE, type, typeLen)) {
+        errno = ENOTSUP;
+        warn("Unsupported keystore key type %.*s", (int) typeLen, type);
+        goto Finally;
+    }
+
+    /* The private key is the seed followed by the public key */
+
+    if (rd_string(&content, &contentLen, &public, &publicLen) ||
+            rd_string(&content, &contentLen, &private, &privateLen) ||
+            rd_string(&content, &contentLen, &comment, &commentLen) ||
+            contentLen ||
+            ED25519_PUBLIC_LEN != publicLen ||
+            ED25519_SEED_LEN + ED25519_PUBLIC_LEN != privateLen ||
+            memcmp(public, private + ED25519_SEED_LEN, publicLen)) {
+        errno = EINVAL;
+        goto Finally;
+    }
+
+    if (keystore_add(
+            aKeystore,
+            (const unsigned char *) public, (const unsigned char *) private,
+            comment, commentLen))
+        goto Finally;
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+keystore_request(struct Agent *self, struct Message *msg, unsigned aUpstream)
+{
+    int rc = -1;
+
+    struct Keystore *keystore = self->mUpstream[aUpstream].mKeystore;
+
+    int responseType = SSH_AGENT_FAILURE;
+
+    count_upstream_request(self, aUpstream);
+    TRACE(TRACE_UPSTREAM_SEND, aUpstream, message_type(msg));
+
+    /* Requests that are too large to hold cannot carry a key that the
+     * keystore would accept.
+     */
+
+    if (argMaxInspect < message_length(msg)) {
+        rc = 0;
+        goto Finally;
+    }
+
+    if (message_length(msg) &&
+            !message_content(msg) && message_read_payload(msg)) {
+        warn("Unable to read message");
+        goto Finally;
+    }
+
+    const char *content = message_content(msg);
+    uint32_t contentLen = message_length(msg);
+
+    switch (message_type(msg)) {
+    default:
+        break;
+
+    case SSH_AGENTC_ADD_IDENTITY:
+        if (!keystore_add_identity(keystore, msg))
+            responseType = SSH_AGENT_SUCCESS;
+
+        /* Wipe the private key from the request */
+
+        if (msg->mPayload.mContent)
+            explicit_bzero(msg->mPayload.mContent, msg->mPayload.mLength);
+        break;
+
+    case SSH_AGENTC_REMOVE_IDENTITY: {
+        const char *blob;
+        uint32_t blobLen;
+
+        const unsigned char *public;
+
+        if (!rd_string(&content, &contentLen, &blob, &blobLen) &&
+                !keystore_public(blob, blobLen, &public) &&
+                !keystore_remove(keystore, public))
+            responseType = SSH_AGENT_SUCCESS;
+    }   break;
+
+    case SSH_AGENTC_REMOVE_ALL_IDENTITIES:
+        if (!keystore_remove_all(keystore))
+            responseType = SSH_AGENT_SUCCESS;
+        break;
+    }
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        if (rc) {
+            count_upstream_error(self, aUpstream);
+        } else {
+            count_upstream_response(self, aUpstream);
+            TRACE(TRACE_UPSTREAM_RECV, aUpstream,
+                TRACE_TYPE_LENGTH(responseType, 0));
+
+            if (SSH_AGENT_FAILURE == responseType)
+                STAT_INC(mUpstream[aUpstream].mFailures);
+        }
+    });
+
+    return rc ? rc : responseType;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+agent_keystore_request(
+    struct Agent *self, struct Message *msg, unsigned aUpstream,
+    int *aResponseType)
+{
+    int rc = -1;
+
+    DEBUG("Request %d", message_type(msg));
+
+    int responseType = keystore_request(self, msg, aUpstream);
+    if (-1 == responseType)
+        goto Finally;
+
+    request_stage(&self->mRequest, STAGE_UPSTREAM);
+
+    self->mRequest.mUpstream = upstream_name(aUpstream);
+
+    if (aResponseType)
+        *aResponseType = responseType;
+
+    if (SSH_AGENT_SUCCESS == responseType) {
+        if (send_response_success(message_fd(msg)))
+            goto Finally;
+    } else {
+        if (send_response_failure(message_fd(msg)))
+            goto Finally;
+    }
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+agent_upstream_request(
+    struct Agent *self, struct Message *msg, unsigned aUpstream,
+    int *aResponseType)
+{
+    int rc = -1;
+
+    if (self->mUpstream[aUpstream].mKeystore)
+        return agent_keystore_request(self, msg, aUpstream, aResponseType);
+
+    DEBUG("Request %d", message_type(msg));
+
+    struct Message response_, *response = 0;
+
+    const char *upstreamName = upstream_name(aUpstream);
+    int upstreamFd = self->mUpstream[aUpstream].mFd;
+
+    if (upstream_down(self, aUpstream)) {
+        warn("Unable to reach %s agent", upstreamName);
+        if (send_response_failure(message_fd(msg)))
+            goto Finally;
+
+        if (aResponseType)
+            *aResponseType = SSH_AGENT_FAILURE;
+
+        rc = 0;
+        goto Finally;
+    }
+
+    count_upstream_request(self, aUpstream);
+    TRACE(TRACE_UPSTREAM_SEND, aUpstream, message_type(msg));
+    PROBE(upstream_send, upstreamName,
+        message_type(msg), message_length(msg));
+
+    if (message_transfer(msg, upstreamFd)) {
+        count_upstream_error(self, aUpstream);
+        warn("Unable to forward request to %s agent", upstreamName);
+        goto Finally;
+    }
+
+    if (wait_upstream_response(self, aUpstream))
+        goto Finally;
+
+    response = message_init(&response_, upstreamFd, upstreamName);
+    request_stage(&self->mRequest, STAGE_UPSTREAM);
+    if (!response) {
+        count_upstream_error(self, aUpstream);
+        warn("Unable to read response from %s agent", upstreamName);
+        goto Finally;
+    }
+
+    count_upstream_response(self, aUpstream);
+
+    TRACE(TRACE_UPSTREAM_RECV, aUpstream,
+        TRACE_TYPE_LENGTH(message_type(response), message_length(response)));
+    PROBE(upstream_recv, upstreamName,
+        message_type(response), message_length(response));
+
+    if (SSH_AGENT_FAILURE == message_type(response))
+        STAT_INC(mUpstream[aUpstream].mFailures);
+
+    self->mRequest.mUpstream = upstreamName;
+
+    int responseType = message_type(response);
+    uint32_t responseLength = 5 + message_length(response);
+
+    if (message_transfer(response, message_fd(msg))) {
+        warn("Unable to forward response from %s agent", upstreamName);
+        goto Finally;
+    }
+
+    count_response(responseType, responseLength);
+
+    if (aResponseType)
+        *aResponseType = responseType;
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        message_purge(response);
+        response = message_close(response);
+    });
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+agent_primary_request(struct Agent *self, struct Message *msg)
+{
+    return agent_upstream_request(self, msg, UPSTREAM_PRIMARY, 0);
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+agent_writable_request(struct Agent *self, struct Message *msg)
+{
+    int rc = -1;
+
+    struct Message response_, *response = 0;
+
+    unsigned writable[UPSTREAM_MAX];
+    unsigned writables = 0;
+
+    for (unsigned ux = 0; ux < self->mUpstreams; ++ux) {
+        if (self->mUpstream[ux].mWritable)
+            writable[writables++] = ux;
+    }
+
+    /* Requests that remove identities are sent to every writable agent,
+     * and succeed if any agent succeeds. Requests that are too large to
+     * hold are only passed through to the primary agent.
+     */
+
+    if (1 == writables || argMaxInspect < message_length(msg)) {
+        rc = agent_primary_request(self, msg);
+        goto Finally;
+    }
+
+    DEBUG("Request %d", message_type(msg));
+
+    if (message_length(msg) && message_read_payload(msg)) {
+        warn("Unable to read message");
+        goto Finally;
+    }
+
+    for (unsigned wx = 0; wx < writables; ++wx) {
+        unsigned ux = writable[wx];
+
+        if (self->mUpstream[ux].mKeystore || upstream_down(self, ux))
+            continue;
+
+        count_upstream_request(self, ux);
+        TRACE(TRACE_UPSTREAM_SEND, ux, message_type(msg));
+        PROBE(upstream_send, upstream_name(ux),
+            message_type(msg), message_length(msg));
+
+        if (send_message(
+                self->mUpstream[ux].mFd, message_type(msg),
+                message_content(msg), message_length(msg))) {
+            count_upstream_error(self, ux);
+            warn("Unable to forward request to %s agent", upstream_name(ux));
+            goto Finally;
+        }
+    }
+
+    int success = 0;
+
+    for (unsigned wx = 0; wx < writables; ++wx) {
+        unsigned ux = writable[wx];
+
+        if (self->mUpstream[ux].mKeystore) {
+            int responseType = keystore_request(self, msg, ux);
+            if (-1 == responseType)
+                goto Finally;
+
+            if (SSH_AGENT_SUCCESS == responseType)
+                success = 1;
+            continue;
+        }
+
+        if (upstream_down(self, ux))
+            continue;
+
+        if (wait_upstream_response(self, ux))
+            goto Finally;
+
+        response = message_init(
+            &response_, self->mUpstream[ux].mFd, upstream_name(ux));
+        if (!response) {
+            count_upstream_error(self, ux);
+            warn("Unable to read response from %s agent", upstream_name(ux));
+            goto Finally;
+        }
+
+        count_upstream_response(self, ux);
+
+        TRACE(TRACE_UPSTREAM_RECV, ux,
+            TRACE_TYPE_LENGTH(
+                message_type(response), message_length(response)));
+        PROBE(upstream_recv, upstream_name(ux),
+            message_type(response), message_length(response));
+
+        if (SSH_AGENT_SUCCESS == message_type(response))
+            success = 1;
+        else
+            STAT_INC(mUpstream[ux].mFailures);
+
+        message_purge(response);
+        response = message_close(response);
+    }
+
+    request_stage(&self->mRequest, STAGE_UPSTREAM);
+
+    self->mRequest.mUpstream = "writable";
+
+    if (success) {
+        if (send_response_success(message_fd(msg)))
+            goto Finally;
+    } else {
+        if (send_response_failure(message_fd(msg)))
+            goto Finally;
+    }
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        if (response) {
+            message_purge(response);
+            response = message_close(response);
+        }
+    });
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+agent_session_bind(
+    const char *aContent, uint32_t aLength, unsigned char *aHost)
+{
+    int rc = -1;
+
+    const char *hostKey;
+    uint32_t hostKeyLen;
+
+    if (rd_string(&aContent, &aLength, &hostKey, &hostKeyLen) ||
+            rd_string(&aContent, &aLength, 0, 0) ||
+            rd_string(&aContent, &aLength, 0, 0) ||
+            1 != aLength) {
+        errno = EINVAL;
+        goto Finally;
+    }
+
+    /* Bindings that are made while forwarding the agent name an
+     * intermediate host rather than the host that will ask for a
+     * signature.
+     */
+
+    int forwarding = aContent[0];
+
+    if (forwarding) {
+        rc = 0;
+        goto Finally;
+    }
+
+    sha256(hostKey, hostKeyLen, aHost);
+
+    rc = 1;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+agent_extension(struct Agent *self, struct Message *msg)
+{
+    int rc = -1;
+
+    DEBUG("Request SSH_AGENTC_EXTENSION");
+
+    if (!argHostHint ||
+            !message_length(msg) || argMaxInspect < message_length(msg)) {
+        rc = agent_primary_request(self, msg);
+        goto Finally;
+    }
+
+    if (message_read_payload(msg)) {
+        warn("Unable to read message");
+        goto Finally;
+    }
+
+    const char *content = message_content(msg);
+    uint32_t contentLen = message_length(msg);
+
+    const char *name;
+    uint32_t nameLen;
+
+    unsigned char host[SHA256_DIGEST_LEN];
+    int bound = 0;
+
+    if (!rd_string(&content, &contentLen, &name, &nameLen) &&
+            sizeof(SESSION_BIND_EXTENSION) - 1 == nameLen &&
+            !memcmp(SESSION_BIND_EXTENSION, name, nameLen)) {
+
+        /* The primary agent verifies the binding, so a binding that
+         * cannot be parsed here is left for the primary agent to
+         * reject.
+         */
+
+        bound = agent_session_bind(content, contentLen, host);
+        if (-1 == bound) {
+            warn("Unable to parse %s", SESSION_BIND_EXTENSION);
+            bound = 0;
+        }
+    }
+
+    int responseType;
+
+    if (agent_upstream_request(self, msg, UPSTREAM_PRIMARY, &responseType))
+        goto Finally;
+
+    /* Only a binding whose signature the primary agent has verified
+     * is used to hint at keys, so a forged binding, or one presented
+     * to a keystore that cannot verify it, leaves the session unbound.
+     */
+
+    if (bound && SSH_AGENT_SUCCESS == responseType) {
+        memcpy(self->mHost, host, sizeof(self->mHost));
+        self->mBound = 1;
+
+        if (debug_) {
+            char fingerprint[64];
+            digest_fingerprint(self->mHost, fingerprint, sizeof(fingerprint));
+            DEBUG("Session bound to host %s", fingerprint);
+        }
+    }
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/******************************************************************************/
+static enum RequestPriority
+request_priority(int aType)
+{
+    switch (aType) {
+    default:
+        return PRIORITY_OTHER;
+
+    case SSH_AGENTC_SIGN_REQUEST:
+        return PRIORITY_SIGN;
+
+    case SSH_AGENTC_REQUEST_IDENTITIES:
+        return PRIORITY_IDENTITIES;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+rate_class(int aType)
+{
+    switch (aType) {
+    default:
+        return -1;
+
+    case SSH_AGENTC_REQUEST_IDENTITIES:
+        return RATE_IDENTITIES;
+
+    case SSH_AGENTC_SIGN_REQUEST:
+        return RATE_SIGN;
+
+    case SSH_AGENTC_ADD_IDENTITY:
+    case SSH_AGENTC_ADD_ID_CONSTRAINED:
+    case SSH_AGENTC_REMOVE_IDENTITY:
+    case SSH_AGENTC_REMOVE_ALL_IDENTITIES:
+    case SSH_AGENTC_LOCK:
+    case SSH_AGENTC_UNLOCK:
+        return RATE_CHANGE;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+throttle_request(struct Agent *self, int aType)
+{
+    int rc = -1;
+
+    struct StatClient *client = self->mRateClient;
+
+    int rateClass = rate_class(aType);
+
+    if (!client || -1 == rateClass || !argRate[rateClass].mIntervalNs) {
+        rc = 0;
+        goto Finally;
+    }
+
+    /* A throttled request is held for as long as --rate-queue allows,
+     * and is otherwise refused without consulting the upstream agents.
+     */
+
+    uint64_t queuedNs = 0;
+
+    while (1) {
+        uint64_t waitNs = rate_acquire(
+            &argRate[rateClass], &client->mBucket[rateClass],
+            clk_monotonic_ns());
+
+        if (!waitNs)
+            break;
+
+        if (!queuedNs)
+            atomic_fetch_add_explicit(
+                &client->mThrottled[rateClass], 1, memory_order_relaxed);
+
+        if (argRateQueueNs < queuedNs + waitNs) {
+            atomic_fetch_add_explicit(
+                &client->mRejected[rateClass], 1, memory_order_relaxed);
+            DEBUG("Rejecting throttled request from client %u",
+                (unsigned) (client - stats_->mClient));
+            goto Finally;
+        }
+
+        DEBUG("Queueing throttled request from client %u for %" PRIu64 "us",
+            (unsigned) (client - stats_->mClient), waitNs / 1000);
+
+        struct timespec waitTime = {
+            .tv_sec = waitNs / 1000000000,
+            .tv_nsec = waitNs % 1000000000,
+        };
+        nanosleep(&waitTime, 0);
+
+        queuedNs += waitNs;
+    }
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+reconnect_upstreams(struct Agent *self)
+{
+    uint64_t nowNs = clk_monotonic_ns();
+
+    /* Agents that cannot be reached, typically because they are being
+     * restarted, are retried with jittered exponential backoff so that
+     * the workers do not reconnect in lockstep when the agent returns.
+     */
+
+    static unsigned seed;
+    if (!seed)
+        seed = getpid() ^ nowNs;
+
+    for (unsigned ux = self->mUpstreams; ux--; ) {
+        struct Upstream *upstream = &self->mUpstream[ux];
+
+        if (!upstream_down(self, ux) || nowNs < upstream->mRetryNs)
+            continue;
+
+        if (!connect_upstream(self, ux)) {
+            if (upstream->mReconnect) {
+                DEBUG("Reconnected to %s agent", upstream_name(ux));
+                STAT_INC(mUpstream[ux].mReconnects);
+                upstream->mReconnect = 0;
+            }
+            upstream->mBackoffNs = 0;
+            upstream->mRetryNs = 0;
+            continue;
+        }
+
+        uint64_t backoffNs = 2 * upstream->mBackoffNs;
+        if (backoffNs < RECONNECT_MIN_NS)
+            backoffNs = RECONNECT_MIN_NS;
+        if (backoffNs > RECONNECT_MAX_NS)
+            backoffNs = RECONNECT_MAX_NS;
+
+        upstream->mBackoffNs = backoffNs;
+        upstream->mRetryNs =
+            nowNs + backoffNs / 2 + rand_r(&seed) % (backoffNs / 2 + 1);
+
+        upstream->mReconnect = 1;
+
+        warn("Unable to connect to %s agent", upstream_name(ux));
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+reset_upstreams(struct Agent *self, int aPending)
+{
+    /* Connections that failed, or that might hold a response that
+     * will never be read, cannot be used for subsequent requests.
+     */
+
+    for (unsigned ux = 0; ux < self->mUpstreams; ++ux) {
+        struct Upstream *upstream = &self->mUpstream[ux];
+
+        if (upstream->mFailed || (aPending && upstream->mPending)) {
+            disconnect_upstream(self, ux);
+            upstream->mReconnect = 1;
+        }
+
+        upstream->mFailed = 0;
+        upstream->mPending = 0;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+upstream_failed(struct Agent *self)
+{
+    for (unsigned ux = 0; ux < self->mUpstreams; ++ux) {
+        if (self->mUpstream[ux].mFailed)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+recover_upstream_request(struct Agent *self, struct Message *msg)
+{
+    int rc = -1;
+
+    /* Identity and sign requests are idempotent, so a request that
+     * failed because an upstream agent went away is retried once on
+     * fresh connections, provided nothing was yet written to the client.
+     */
+
+    if (!upstream_failed(self) ||
+            self->mRequest.mResponded || client_hangup(self))
+        goto Finally;
+
+    DEBUG("Retrying request after upstream failure");
+    STAT_INC(mRetries);
+
+    reset_upstreams(self, 1);
+    reconnect_upstreams(self);
+
+    int retryRc;
+
+    if (SSH_AGENTC_SIGN_REQUEST == message_type(msg))
+        retryRc = agent_sign_request(self, msg);
+    else
+        retryRc = agent_request_identities(self, msg);
+
+    if (!retryRc) {
+        rc = 0;
+        goto Finally;
+    }
+
+    /* Rather than close the connection, report a failure to the
+     * client if the retry also failed before any response was written.
+     */
+
+    if (!upstream_failed(self) ||
+            self->mRequest.mResponded || client_hangup(self))
+        goto Finally;
+
+    reset_upstreams(self, 1);
+
+    if (send_response_failure(message_fd(msg)))
+        goto Finally;
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+process_double_agent_request(
+    struct Agent *self,
+    int aClientFd)
+{
+    int rc = -1;
+
+    struct Message msg_, *msg;
+
+    int msgType = 0;
+
+    request_start(&self->mRequest);
+
+    msg = message_init(&msg_, aClientFd, "double agent");
+    if (!msg) {
+        warn("Unable to initialise message");
+        goto Finally;
+    }
+
+    request_stage(&self->mRequest, STAGE_READ);
+
+    msgType = message_type(msg);
+
+    STAT_INC(mRequests[STAT_TYPE(msgType)]);
+    STAT_ADD(mBytesIn, 5 + message_length(msg));
+    TRACE(TRACE_REQUEST, msgType, message_length(msg));
+
+    self->mPriority = request_priority(msgType);
+
+    reconnect_upstreams(self);
+
+    if (throttle_request(self, msgType)) {
+        if (send_response_failure(aClientFd))
+            goto Finally;
+    } else {
+        switch (message_type(msg)) {
+
+        case SSH_AGENTC_REQUEST_IDENTITIES:
+            if (agent_request_identities(self, msg) &&
+                    recover_upstream_request(self, msg))
+                goto Finally;
+            break;
+
+        case SSH_AGENTC_SIGN_REQUEST:
+            if (agent_sign_request(self, msg) &&
+                    recover_upstream_request(self, msg))
+                goto Finally;
+            break;
+
+        case SSH_AGENTC_LOCK:
+            if (agent_lock(self, msg))
+                goto Finally;
+            break;
+
+        case SSH_AGENTC_UNLOCK:
+            if (agent_unlock(self, msg))
+                goto Finally;
+            break;
+
+        case SSH_AGENTC_EXTENSION:
+            if (agent_extension(self, msg))
+                goto Finally;
+            break;
+
+        case SSH_AGENTC_REMOVE_IDENTITY:
+        case SSH_AGENTC_REMOVE_ALL_IDENTITIES:
+            if (agent_writable_request(self, msg))
+                goto Finally;
+            break;
+
+        default:
+            if (agent_primary_request(self, msg))
+                goto Finally;
+            break;
+        }
+    }
+
+    if (message_purge(msg)) {
+        warn("Unable to purge message");
+        goto Finally;
+    }
+
+    request_stage(&self->mRequest, STAGE_WRITE);
+
+    size_t queued;
+    if (!un_send_queued(aClientFd, &queued)) {
+        uint64_t highWater = atomic_load_explicit(
+            &stats_->mOutputHighWater.mValue, memory_order_relaxed);
+
+        while (highWater < queued && !atomic_compare_exchange_weak_explicit(
+                &stats_->mOutputHighWater.mValue, &highWater, queued,
+                memory_order_relaxed, memory_order_relaxed))
+            continue;
+    }
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        const char *outcome = "ok";
+
+        if (rc) {
+            outcome = "error";
+
+            /* Only sends to the client are given a timeout, so a
+             * timeout shows that the client stopped reading.
+             */
+
+            if (argStallNs && EAGAIN == errno) {
+                warn("Closing stalled connection");
+                STAT_INC(mStalled);
+                outcome = "stalled";
+            }
+
+            /* Requests abandoned because the client went away are
+             * not errors of the double agent, or of the upstream
+             * agents.
+             */
+
+            if (client_hangup(self)) {
+                DEBUG("Request cancelled by client");
+                STAT_INC(mCancelled[self->mRequest.mStage]);
+                outcome = "cancelled";
+            } else {
+                STAT_INC(mErrors);
+            }
+
+            TRACE(TRACE_ERROR, msgType, errno);
+
+            request_stage(&self->mRequest, self->mRequest.mStage);
+        }
+
+        /* Requests that fail are reported too, because they are
+         * often the slowest.
+         */
+
+        if (msg)
+            request_report(&self->mRequest, msgType, msg, outcome);
+
+        PROBE(request_done, msgType, rc);
+
+        /* Requests abandoned by hedging, or by an error, are no
+         * longer counted as in flight once the request completes.
+         */
+
+        for (unsigned ux = 0; ux < self->mUpstreams; ++ux)
+            release_upstream_request(self, ux);
+
+        reset_upstreams(self, 0);
+
+        message_close(msg);
+    });
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+name_rate_client(struct StatClient *aClient, const char *aName)
+{
+    /* Long names, typically those of nested cgroups, are truncated
+     * from the front because the trailing components are the most
+     * distinctive.
+     */
+
+    uint64_t name[NUMBEROF(aClient->mName)] = { };
+
+    size_t nameLen = strlen(aName);
+    size_t skipLen = 0;
+    if (sizeof(name) <= nameLen)
+        skipLen = nameLen - sizeof(name) + 1;
+
+    memcpy(name, aName + skipLen, nameLen - skipLen + 1);
+
+    unsigned nameSeq = atomic_fetch_add_explicit(
+        &aClient->mNameSeq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    for (unsigned wx = 0; wx < NUMBEROF(name); ++wx)
+        atomic_store_explicit(
+            &aClient->mName[wx], name[wx], memory_order_relaxed);
+
+    atomic_store_explicit(
+        &aClient->mNameSeq, nameSeq + 2, memory_order_release);
+}
+
+/*----------------------------------------------------------------------------*/
+static struct StatClient *
+find_rate_client(int aClientFd)
+{
+    struct StatClient *client = 0;
+
+    pid_t clientPid;
+    uid_t clientUid;
+
+    if (un_peer(aClientFd, &clientPid, &clientUid)) {
+        warn("Unable to identify client");
+        goto Finally;
+    }
+
+    /* Clients whose cgroup cannot be found, for example on systems
+     * without cgroups, are identified by their user instead.
+     */
+
+    char clientName[PATH_MAX + 8];
+    snprintf(clientName, sizeof(clientName), "uid %d", (int) clientUid);
+
+    if (RATE_KEY_PID == argRateKey && clientPid)
+        snprintf(clientName, sizeof(clientName), "pid %d", (int) clientPid);
+
+    if (RATE_KEY_CGROUP == argRateKey && clientPid) {
+        char cgroup[PATH_MAX];
+        if (!proc_cgroup(clientPid, cgroup, sizeof(cgroup)))
+            snprintf(clientName, sizeof(clientName), "cgroup %s", cgroup);
+    }
+
+    unsigned char digest[SHA256_DIGEST_LEN];
+    sha256(clientName, strlen(clientName), digest);
+
+    uint64_t clientKey = 0;
+    for (int bx = 0; bx < sizeof(clientKey); ++bx)
+        clientKey = (clientKey << 8) | digest[bx];
+
+    if (!clientKey)
+        clientKey = 1;
+
+    /* Records are claimed without locking, so connections from the
+     * same client that race to claim a record probe the same sequence
+     * of records, and settle on the record claimed first.
+     */
+
+    unsigned firstSlot = clientKey % STATS_CLIENTS;
+
+    for (unsigned cx = 0; !client && cx < STATS_CLIENTS; ++cx) {
+        struct StatClient *slot =
+            &stats_->mClient[(firstSlot + cx) % STATS_CLIENTS];
+
+        uint_least64_t slotKey = 0;
+
+        if (atomic_compare_exchange_strong(&slot->mKey, &slotKey, clientKey))
+            name_rate_client(slot, clientName);
+        else if (slotKey != clientKey)
+            continue;
+
+        client = slot;
+    }
+
+    uint64_t nowNs = clk_monotonic_ns();
+
+    for (unsigned cx = 0; !client && cx < STATS_CLIENTS; ++cx) {
+        struct StatClient *slot =
+            &stats_->mClient[(firstSlot + cx) % STATS_CLIENTS];
+
+        uint_least64_t slotKey = atomic_load(&slot->mKey);
+
+        int idle = 1;
+        for (unsigned rx = 0; rx < RATE_CLASSES; ++rx)
+            idle &= rate_idle(&slot->mBucket[rx], nowNs);
+
+        if (!idle || !atomic_compare_exchange_strong(
+                &slot->mKey, &slotKey, clientKey))
+            continue;
+
+        for (unsigned rx = 0; rx < RATE_CLASSES; ++rx) {
+            atomic_store(&slot->mThrottled[rx], 0);
+            atomic_store(&slot->mRejected[rx], 0);
+        }
+        name_rate_client(slot, clientName);
+
+        client = slot;
+    }
+
+    /* Limits are not applied to clients that cannot be recorded, rather
+     * than refusing service to every new client.
+     */
+
+    if (!client)
+        warn("Unable to record client %s", clientName);
+    else
+        DEBUG("Client rate limited as %s", clientName);
+
+Finally:
+
+    return client;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+run_double_agent_connection(
+    struct Agent *self,
+    int aClientFd)
+{
+    int rc = -1;
+
+    /* Sockets in the abstract namespace are not protected by file
+     * permissions, so only serve clients of the same user. The name
+     * is taken from the socket itself, because an activated socket
+     * need not be named by the double agent path.
+     */
+
+    char socketPath[PATH_MAX];
+
+    if (un_name(aClientFd, socketPath, sizeof(socketPath))) {
+        warn("Unable to name connection to %s", self->mDoubleAgentPath);
+        goto Finally;
+    }
+
+    if (un_abstract(socketPath)) {
+        pid_t peerPid;
+        uid_t peerUid;
+
+        if (un_peer(aClientFd, &peerPid, &peerUid) || geteuid() != peerUid) {
+            warn("Refusing connection to %s", socketPath);
+            goto Finally;
+        }
+    }
+
+    /* A client that stops reading can hold at most the send buffer of
+     * output, and is disconnected if it makes no room for longer than
+     * the stall timeout.
+     */
+
+    if (argSendBuffer || argStallNs) {
+        uint64_t stallMs = argStallNs / 1000000;
+
+        if (un_send_limit(aClientFd,
+                argSendBuffer, UINT_MAX < stallMs ? UINT_MAX : stallMs)) {
+            warn("Unable to limit output to client");
+            goto Finally;
+        }
+    }
+
+    /* An upstream agent that restarts leaves its connections closed,
+     * so writes must fail with EPIPE so that the worker can reconnect.
+     */
+
+    signal(SIGPIPE, SIG_IGN);
+
+    reconnect_upstreams(self);
+
+    self->mBound = 0;
+    self->mClientFd = aClientFd;
+
+    self->mRateClient = 0;
+    for (unsigned rx = 0; rx < RATE_CLASSES; ++rx) {
+        if (argRate[rx].mIntervalNs) {
+            self->mRateClient = find_rate_client(aClientFd);
+            break;
+        }
+    }
+
+    if (self->mPolicy) {
+        pid_t clientPid;
+
+        if (un_peer(aClientFd, &clientPid, &self->mClient.mUid)) {
+            warn("Unable to identify client");
+            goto Finally;
+        }
+
+        self->mClient.mExe = 0;
+        if (clientPid && !proc_exe(
+                clientPid, self->mClientExe, sizeof(self->mClientExe)))
+            self->mClient.mExe = self->mClientExe;
+
+        DEBUG("Client uid %d exe %s",
+            (int) self->mClient.mUid,
+            self->mClient.mExe ? self->mClient.mExe : "unknown");
+    }
+
+    /* Each connection has its own process, so a single deadline, the
+     * nearer of the idle timeout and the end of the lifetime, suffices.
+     * Connections are only closed between requests.
+     */
+
+    uint64_t openNs = clk_monotonic_ns();
+    uint64_t activeNs = openNs;
+
+    while (1) {
+
+        DEBUG("Waiting for next message");
+
+        uint64_t deadlineNs = UINT64_MAX;
+
+        if (argIdleNs)
+            deadlineNs = activeNs + argIdleNs;
+        if (argLifetimeNs && openNs + argLifetimeNs < deadlineNs)
+            deadlineNs = openNs + argLifetimeNs;
+
+        int timeoutMs = -1;
+
+        if (UINT64_MAX != deadlineNs) {
+            uint64_t nowNs = clk_monotonic_ns();
+            uint64_t waitMs = deadlineNs > nowNs ?
+                (deadlineNs - nowNs + 999999) / 1000000 : 0;
+
+            timeoutMs = INT_MAX < waitMs ? INT_MAX : waitMs;
+        }
+
+        int ready = fd_wait_rd(aClientFd, timeoutMs);
+        if (-1 == ready) {
+            if (EINTR != errno)
+                goto Finally;
+            break;
+        }
+
+        if (!ready) {
+            uint64_t nowNs = clk_monotonic_ns();
+
+            if (argLifetimeNs && openNs + argLifetimeNs <= nowNs) {
+                DEBUG("Closing connection after lifetime");
+                STAT_INC(mExpired);
+                break;
+            }
+
+            if (argIdleNs && activeNs + argIdleNs <= nowNs) {
+                DEBUG("Closing idle connection");
+                STAT_INC(mIdleClosed);
+                break;
+            }
+
+            continue;
+        }
+
+        if (process_double_agent_request(self, aClientFd))
+            goto Finally;
+
+        activeNs = clk_monotonic_ns();
+    }
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        for (unsigned ux = 0; ux < self->mUpstreams; ++ux)
+            disconnect_upstream(self, ux);
+
+        free(self->mRoute);
+        self->mRoute = 0;
+        self->mRouteSlots = 0;
+    });
+
+    return rc;
+}
+
+/******************************************************************************/
+static void
+reload_double_agent_policy(struct Agent *self)
+{
+    struct stat policyStat;
+
+    if (stat(argPolicyPath, &policyStat)) {
+        warn("Unable to find policy %s", argPolicyPath);
+        return;
+    }
+
+    if (policyStat.st_ino == self->mPolicyStat.st_ino &&
+            policyStat.st_dev == self->mPolicyStat.st_dev &&
+            policyStat.st_size == self->mPolicyStat.st_size &&
+            policyStat.st_mtim.tv_sec == self->mPolicyStat.st_mtim.tv_sec &&
+            policyStat.st_mtim.tv_nsec == self->mPolicyStat.st_mtim.tv_nsec)
+        return;
+
+    /* Keep the current policy if the new policy cannot be loaded,
+     * but do not try again until the policy file changes again.
+     */
+
+    self->mPolicyStat = policyStat;
+
+    struct Policy *policy = policy_load(argPolicyPath);
+    if (!policy) {
+        warn("Retaining previous policy");
+        return;
+    }
+
+    DEBUG("Reloaded policy %s", argPolicyPath);
+
+    policy_close(self->mPolicy);
+    self->mPolicy = policy;
+}
+
+/******************************************************************************/
+static int
+report_double_agent_ready(struct Agent *self)
+{
+    int rc = -1;
+
+    uint64_t pollNs = clk_monotonic_ns();
+
+    char status[128];
+    int statusLen = snprintf(status, sizeof(status),
+        "bind=%" PRIu64 "us"
+        " fork=%" PRIu64 "us"
+        " setsid=%" PRIu64 "us"
+        " poll=%" PRIu64 "us\n",
+        (self->mStartup.mBindNs - self->mStartup.mStartNs) / 1000,
+        (self->mStartup.mForkNs - self->mStartup.mBindNs) / 1000,
+        (self->mStartup.mSetsidNs - self->mStartup.mForkNs) / 1000,
+        (pollNs - self->mStartup.mSetsidNs) / 1000);
+
+    DEBUG("Startup %.*s", statusLen - 1, status);
+
+    if (statusLen != fd_write(self->mReadyFd, status, statusLen))
+        goto Finally;
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        self->mReadyFd = fd_close(self->mReadyFd);
+    });
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+report_double_agent_upgrade(struct Agent *self)
+{
+    int rc = -1;
+
+    uint64_t pollNs = clk_monotonic_ns();
+
+    char status[128];
+    int statusLen = snprintf(status, sizeof(status),
+        "downtime %" PRIu64 "us\nok\n",
+        (pollNs - self->mUpgradeNs) / 1000);
+
+    DEBUG("Upgraded %.*s", statusLen - 4, status);
+
+    if (statusLen != fd_write(self->mUpgradeFd, status, statusLen))
+        goto Finally;
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        self->mUpgradeFd = fd_close(self->mUpgradeFd);
+    });
+
+    return rc;
+}
+
+/******************************************************************************/
+static int
+control_upstream(struct Agent *self, FILE *aReply, char *aArgs)
+{
+    int rc = -1;
+
+    const char *name = strtok(aArgs, " \t");
+
+    int upstreamIndex = -1;
+    for (unsigned ux = 0; name && ux < self->mUpstreams; ++ux) {
+        if (!strcmp(name, upstream_name(ux)))
+            upstreamIndex = ux;
+    }
+
+    if (-1 == upstreamIndex) {
+        fprintf(aReply, "error unknown upstream %s\n", name ? name : "");
+        goto Finally;
+    }
+
+    unsigned ux = upstreamIndex;
+    struct Upstream *upstream = &self->mUpstream[ux];
+
+    if (upstream->mKeystore) {
+        fprintf(aReply, "error upstream %s is built-in\n", name);
+        goto Finally;
+    }
+
+    /* Validate every path before changing anything, so that the
+     * change is applied completely or not at all.
+     */
+
+    const char *path[REPLICA_MAX + 1];
+    unsigned paths = 0;
+
+    while (paths < NUMBEROF(path) && (path[paths] = strtok(0, " \t"))) {
+        if (REPLICA_PATH_MAX <= strlen(path[paths])) {
+            fprintf(aReply, "error path too long %s\n", path[paths]);
+            goto Finally;
+        }
+        ++paths;
+    }
+
+    if (!paths || REPLICA_MAX < paths) {
+        fprintf(aReply, "error expected 1 to %d paths\n", REPLICA_MAX);
+        goto Finally;
+    }
+
+    for (unsigned rx = 0; rx < paths; ++rx) {
+        struct StatReplica *replica = &stats_->mReplica[ux][rx];
+
+        strcpy(self->mControlPath[ux][rx], path[rx]);
+        upstream->mPath[rx] = self->mControlPath[ux][rx];
+
+        /* Start afresh with replicas that change path, but leave the
+         * active count to the connections that are still running.
+         */
+
+        if (strcmp(replica->mPath, path[rx])) {
+            atomic_store(&replica->mRequests.mValue, 0);
+            atomic_store(&replica->mResponses.mValue, 0);
+            atomic_store(&replica->mErrors.mValue, 0);
+            atomic_store(&replica->mLatencyNs.mValue, 0);
+            atomic_store(&replica->mEjectedNs.mValue, 0);
+            snprintf(replica->mPath, sizeof(replica->mPath), "%s", path[rx]);
+        }
+    }
+
+    upstream->mReplicas = paths;
+    stats_->mReplicas[ux] = paths;
+
+    DEBUG("Control changed %s to %u replicas", name, paths);
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+control_limit(FILE *aReply, const char *aArgs, int *aLimit)
+{
+    int rc = -1;
+
+    char *end;
+
+    errno = 0;
+    long limit = strtol(aArgs, &end, 10);
+    if (errno || end == aArgs || *end || 1 > limit || INT_MAX < limit) {
+        fprintf(aReply, "error invalid limit %s\n", aArgs);
+        goto Finally;
+    }
+
+    *aLimit = limit;
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+control_flush(struct Agent *self, FILE *aReply)
+{
+    /* Forget ejected replicas so that new connections try them
+     * again, and force the policy to be read afresh.
+     */
+
+    for (unsigned ux = 0; ux < self->mUpstreams; ++ux) {
+        for (unsigned rx = 0; rx < REPLICA_MAX; ++rx)
+            atomic_store(&stats_->mReplica[ux][rx].mEjectedNs.mValue, 0);
+    }
+
+    if (self->mPolicy) {
+        memset(&self->mPolicyStat, 0, sizeof(self->mPolicyStat));
+        reload_double_agent_policy(self);
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+control_stat(struct Agent *self, FILE *aReply)
+{
+    fprintf(aReply, "pid %d\n", (int) getpid());
+    fprintf(aReply, "limit %d\n", self->mConnectionLimit);
+    fprintf(aReply, "active %" PRIu64 "\n",
+        (uint64_t) atomic_load(&stats_->mActive.mValue));
+    fprintf(aReply, "connections %" PRIu64 "\n",
+        (uint64_t) atomic_load(&stats_->mConnections.mValue));
+    fprintf(aReply, "rejected %" PRIu64 "\n",
+        (uint64_t) atomic_load(&stats_->mRejected.mValue));
+    fprintf(aReply, "debug %s\n", debug_ ? "on" : "off");
+    fprintf(aReply, "trace %s\n", trace_ ? "on" : "off");
+
+    for (unsigned ux = 0; ux < self->mUpstreams; ++ux) {
+        const struct Upstream *upstream = &self->mUpstream[ux];
+
+        fprintf(aReply, "upstream %s", upstream_name(ux));
+        for (unsigned rx = 0; rx < upstream->mReplicas; ++rx)
+            fprintf(aReply, " %s", upstream->mPath[rx]);
+        fprintf(aReply, "\n");
+    }
+
+    /* The memory reported for each tenant is the bookkeeping held by
+     * the agent, together with its statistics and usage table.
+     */
+
+    for (unsigned tx = 0; tx < TENANT_MAX; ++tx) {
+        const struct Tenant *tenant = &self->mTenant[tx];
+
+        if (!tenant->mUsed)
+            continue;
+
+        size_t memory = sizeof(*tenant) + sizeof(*tenant->mStats);
+        if (tenant->mUsage)
+            memory += sizeof(*tenant->mUsage) +
+                USAGE_RECORDS * sizeof(tenant->mUsage->mRecord[0]);
+
+        fprintf(aReply,
+            "tenant %s %s %s active %d limit %d memory %zu\n",
+            tenant->mPath,
+            tenant->mUpstreamPath[UPSTREAM_PRIMARY],
+            tenant->mUpstreamPath[UPSTREAM_FALLBACK],
+            tenant->mActive,
+            tenant->mConnectionLimit,
+            memory);
+    }
+
+    return 0;
+}
+
+/******************************************************************************/
+static void
+init_double_agent_stats(const struct Upstream *aUpstream, unsigned aUpstreams)
+{
+    stats_->mMagic = STATS_MAGIC;
+    stats_->mVersion = STATS_VERSION;
+    stats_->mPid = getpid();
+    stats_->mUpstreams = aUpstreams;
+
+    for (unsigned ux = 0; ux < aUpstreams; ++ux) {
+        stats_->mReplicas[ux] = aUpstream[ux].mReplicas;
+        for (unsigned rx = 0; rx < aUpstream[ux].mReplicas; ++rx)
+            snprintf(stats_->mReplica[ux][rx].mPath,
+                sizeof(stats_->mReplica[ux][rx].mPath),
+                "%s", aUpstream[ux].mPath[rx]);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static struct Tenant *
+find_tenant(struct Agent *self, const char *aPath)
+{
+    for (unsigned tx = 0; aPath && tx < TENANT_MAX; ++tx) {
+        struct Tenant *tenant = &self->mTenant[tx];
+
+        if (tenant->mUsed && !strcmp(aPath, tenant->mPath))
+            return tenant;
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+remove_tenant(struct Agent *self, struct Tenant *aTenant)
+{
+    DEBUG("Removing tenant %s", aTenant->mPath);
+
+    int tenantIndex = aTenant - self->mTenant;
+
+    for (unsigned wx = 0; wx < self->mWorkers; ++wx) {
+        if (tenantIndex == self->mWorker[wx].mTenant)
+            self->mWorker[wx].mTenant = -1;
+    }
+
+    /* Only remove the names that were created for the tenant, and not
+     * a socket path that was already in use.
+     */
+
+    if (aTenant->mStats) {
+        char statsName[64];
+        if (!shm_name(aTenant->mPath, statsName, sizeof(statsName)))
+            shm_remove(statsName);
+
+        shm_unmap(aTenant->mStats, sizeof(*aTenant->mStats));
+    }
+
+    if (-1 != aTenant->mFd) {
+        un_unlink(aTenant->mPath);
+        fd_close(aTenant->mFd);
+    }
+    usage_close(aTenant->mUsage);
+    policy_close(aTenant->mPolicy);
+
+    memset(aTenant, 0, sizeof(*aTenant));
+    aTenant->mFd = -1;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+add_tenant(struct Agent *self, FILE *aReply, char *aArgs)
+{
+    int rc = -1;
+
+    struct Tenant *tenant = 0;
+
+    const char *path = strtok(aArgs, " \t");
+    const char *primaryPath = strtok(0, " \t");
+    const char *fallbackPath = strtok(0, " \t");
+    const char *policyPath = strtok(0, " \t");
+
+    if (!fallbackPath || strtok(0, " \t")) {
+        fprintf(aReply,
+            "error expected path primary-path fallback-path [policy]\n");
+        goto Finally;
+    }
+
+    const char *checkPath[] = { path, primaryPath, fallbackPath };
+
+    for (unsigned px = 0; px < NUMBEROF(checkPath); ++px) {
+        if (REPLICA_PATH_MAX <= strlen(checkPath[px])) {
+            fprintf(aReply, "error path too long %s\n", checkPath[px]);
+            goto Finally;
+        }
+    }
+
+    if (find_tenant(self, path) || !strcmp(path, self->mDoubleAgentPath)) {
+        fprintf(aReply, "error tenant %s exists\n", path);
+        goto Finally;
+    }
+
+    for (unsigned tx = 0; !tenant && tx < TENANT_MAX; ++tx) {
+        if (!self->mTenant[tx].mUsed)
+            tenant = &self->mTenant[tx];
+    }
+
+    if (!tenant) {
+        fprintf(aReply, "error no more than %d tenants\n", TENANT_MAX);
+        goto Finally;
+    }
+
+    memset(tenant, 0, sizeof(*tenant));
+
+    tenant->mUsed = 1;
+    tenant->mConnectionLimit = CONNECTIONS_DEFAULT;
+    strcpy(tenant->mPath, path);
+    strcpy(tenant->mUpstreamPath[UPSTREAM_PRIMARY], primaryPath);
+    strcpy(tenant->mUpstreamPath[UPSTREAM_FALLBACK], fallbackPath);
+
+    tenant->mFd = un_listen(path);
+    if (-1 == tenant->mFd) {
+        fprintf(aReply, "error unable to listen on %s\n", path);
+        goto Finally;
+    }
+
+    if (fd_nonblock(tenant->mFd) || fd_cloexec(tenant->mFd)) {
+        fprintf(aReply, "error unable to configure %s\n", path);
+        goto Finally;
+    }
+
+    char statsName[64];
+    int statsFd = -1;
+
+    if (!shm_name(path, statsName, sizeof(statsName)))
+        statsFd = shm_create(statsName, sizeof(*tenant->mStats));
+
+    if (-1 != statsFd) {
+        tenant->mStats = shm_map(statsFd, sizeof(*tenant->mStats), 1);
+        statsFd = fd_close(statsFd);
+    }
+
+    if (!tenant->mStats) {
+        fprintf(aReply, "error unable to create statistics for %s\n", path);
+        goto Finally;
+    }
+
+    const struct Upstream upstream[] = {
+        [UPSTREAM_PRIMARY] = {
+            .mReplicas = 1,
+            .mPath = { tenant->mUpstreamPath[UPSTREAM_PRIMARY] },
+        },
+        [UPSTREAM_FALLBACK] = {
+            .mReplicas = 1,
+            .mPath = { tenant->mUpstreamPath[UPSTREAM_FALLBACK] },
+        },
+    };
+
+    struct Stats *agentStats = stats_;
+
+    stats_ = tenant->mStats;
+    init_double_agent_stats(upstream, NUMBEROF(upstream));
+    stats_ = agentStats;
+
+    if (optUsageOrder || argHostHint) {
+        tenant->mUsage = usage_create(USAGE_RECORDS, USAGE_HALF_LIFE);
+        if (!tenant->mUsage) {
+            fprintf(aReply, "error unable to create usage table\n");
+            goto Finally;
+        }
+    }
+
+    if (policyPath) {
+        tenant->mPolicy = policy_load(policyPath);
+        if (!tenant->mPolicy) {
+            fprintf(aReply, "error unable to load policy %s\n", policyPath);
+            goto Finally;
+        }
+    }
+
+    DEBUG("Added tenant %s", path);
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        if (rc && tenant)
+            remove_tenant(self, tenant);
+    });
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+control_tenant(struct Agent *self, FILE *aReply, char *aArgs)
+{
+    int rc = -1;
+
+    char *args = aArgs + strcspn(aArgs, " \t");
+    if (*args)
+        *args++ = 0;
+    args += strspn(args, " \t");
+
+    const char *command = aArgs;
+
+    if (!strcmp("add", command)) {
+        if (add_tenant(self, aReply, args))
+            goto Finally;
+
+    } else if (!strcmp("remove", command)) {
+        struct Tenant *tenant = find_tenant(self, args);
+        if (!tenant) {
+            fprintf(aReply, "error unknown tenant %s\n", args);
+            goto Finally;
+        }
+
+        remove_tenant(self, tenant);
+
+    } else if (!strcmp("limit", command)) {
+        struct Tenant *tenant = find_tenant(self, strtok(args, " \t"));
+        if (!tenant) {
+            fprintf(aReply, "error unknown tenant %s\n", args);
+            goto Finally;
+        }
+
+        const char *limit = strtok(0, "");
+        if (control_limit(aReply, limit ? limit : "", &tenant->mConnectionLimit))
+            goto Finally;
+
+    } else {
+        fprintf(aReply, "error unknown tenant command %s\n", command);
+        goto Finally;
+    }
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+control_upgrade(struct Agent *self, FILE *aReply, char *aArgs, int aControlFd)
+{
+    int rc = -1;
+
+    const int inheritFd[] = {
+        self->mDoubleAgentFd,
+        self->mControlFd,
+        self->mStatsFd,
+        self->mKeystoreFd,
+        aControlFd,
+    };
+
+    const char *path = *aArgs ? aArgs : selfPath_;
+
+    if (!*path) {
+        fprintf(aReply, "error no path to agent executable\n");
+        goto Finally;
+    }
+
+    /* Tenants are not passed to the new image, so they must be removed,
+     * and their connections drained, before the agent is upgraded.
+     */
+
+    for (unsigned tx = 0; tx < TENANT_MAX; ++tx) {
+        if (self->mTenant[tx].mUsed) {
+            fprintf(aReply, "error tenant %s is active\n",
+                self->mTenant[tx].mPath);
+            goto Finally;
+        }
+    }
+
+    if (self->mWorkers) {
+        fprintf(aReply, "error tenant connections are active\n");
+        goto Finally;
+    }
+
+    /* The new image adopts the listening sockets, statistics, and
+     * keystore of the agent. Connections that are already running
+     * continue in their own processes, remain children of the agent,
+     * and are reaped by the new image as they drain.
+     */
+
+    char upgrade[128];
+    snprintf(upgrade, sizeof(upgrade),
+        "%d %d %d %d %d %d %d %d %d %" PRIu64,
+        (int) self->mParentPid,
+        self->mActivated,
+        self->mDoubleAgentFd,
+        self->mControlFd,
+        self->mStatsFd,
+        self->mKeystoreFd,
+        aControlFd,
+        self->mConnectionLimit,
+        debug_,
+        clk_monotonic_ns());
+
+    for (unsigned fx = 0; fx < NUMBEROF(inheritFd); ++fx) {
+        if (-1 != inheritFd[fx] && fd_inherit(inheritFd[fx])) {
+            fprintf(aReply, "error unable to pass descriptor %d\n",
+                inheritFd[fx]);
+            goto Finally;
+        }
+    }
+
+    /* The primary path might have been taken from the environment, which
+     * names the double agent itself while the agent is running.
+     */
+
+    if (setenv(UPGRADE_ENV, upgrade, 1) ||
+            (!optKeystore && setenv("SSH_AUTH_SOCK", argPrimaryPath, 1))) {
+        fprintf(aReply, "error unable to set environment\n");
+        goto Finally;
+    }
+
+    DEBUG("Upgrading to %s", path);
+
+    execv(path, argv_);
+
+    fprintf(aReply, "error unable to execute %s\n", path);
+
+    unsetenv(UPGRADE_ENV);
+    setenv("SSH_AUTH_SOCK", self->mDoubleAgentPath, 1);
+
+Finally:
+
+    FINALLY({
+        /* The agent only continues if the upgrade failed, so no
+         * descriptor remains to be inherited by the commands that
+         * the agent runs.
+         */
+
+        for (unsigned fx = 0; fx < NUMBEROF(inheritFd); ++fx) {
+            if (-1 != inheritFd[fx])
+                fd_cloexec(inheritFd[fx]);
+        }
+    });
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+control_command(
+    struct Agent *self, FILE *aReply, char *aLine, int aControlFd)
+{
+    int rc = -1;
+
+    char *args = aLine + strcspn(aLine, " \t");
+    if (*args)
+        *args++ = 0;
+    args += strspn(args, " \t");
+
+    const char *command = aLine;
+
+    DEBUG("Control command %s", command);
+
+    if (!strcmp("upstream", command)) {
+        if (control_upstream(self, aReply, args))
+            goto Finally;
+
+    } else if (!strcmp("limit", command)) {
+        if (control_limit(aReply, args, &self->mConnectionLimit))
+            goto Finally;
+
+    } else if (!strcmp("debug", command) && !strcmp("on", args)) {
+        debug("%s", DebugEnable);
+
+    } else if (!strcmp("debug", command) && !strcmp("off", args)) {
+        debug("%s", DebugDisable);
+
+    } else if (!strcmp("trace", command) && !strcmp("on", args)) {
+        if (trace_resume()) {
+            fprintf(aReply, "error no trace path\n");
+            goto Finally;
+        }
+
+    } else if (!strcmp("trace", command) && !strcmp("off", args)) {
+        trace_suspend();
+
+    } else if (!strcmp("flush", command)) {
+        if (control_flush(self, aReply))
+            goto Finally;
+
+    } else if (!strcmp("stat", command)) {
+        if (control_stat(self, aReply))
+            goto Finally;
+
+    } else if (!strcmp("tenant", command)) {
+        if (control_tenant(self, aReply, args))
+            goto Finally;
+
+    } else if (!strcmp("upgrade", command)) {
+        if (control_upgrade(self, aReply, args, aControlFd))
+            goto Finally;
+
+    } else {
+        fprintf(aReply, "error unknown command %s\n", command);
+        goto Finally;
+    }
+
+    fprintf(aReply, "ok\n");
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+run_double_agent_control(struct Agent *self)
+{
+    int controlFd = -1;
+
+    char *reply = 0;
+    size_t replyLen = 0;
+
+    FILE *replyFile = 0;
+
+    controlFd = un_accept(self->mControlFd);
+    if (-1 == controlFd) {
+        if (EINTR != errno && EWOULDBLOCK != errno)
+            warn("Unable to accept control connection");
+        goto Finally;
+    }
+
+    /* Only the owner of the agent can change it */
+
+    pid_t controlPid;
+    uid_t controlUid;
+
+    if (un_peer(controlFd, &controlPid, &controlUid) ||
+            geteuid() != controlUid) {
+        warn("Refusing control connection");
+        goto Finally;
+    }
+
+    /* The agent serves connections while reading the command, so
+     * give up on a control client that is slow to send it.
+     */
+
+    char line[CONTROL_LINE_MAX];
+    size_t lineLen = 0;
+
+    while (!memchr(line, '\n', lineLen)) {
+        if (sizeof(line) == lineLen) {
+            warn("Control command too long");
+            goto Finally;
+        }
+
+        if (1 != fd_wait_rd(controlFd, CONTROL_TIMEOUT_MS)) {
+            warn("Unable to read control command");
+            goto Finally;
+        }
+
+        ssize_t readLen = read(controlFd, line + lineLen, sizeof(line) - lineLen);
+        if (0 >= readLen) {
+            warn("Unable to read control command");
+            goto Finally;
+        }
+
+        lineLen += readLen;
+    }
+
+    *(char *) memchr(line, '\n', lineLen) = 0;
+
+    replyFile = open_memstream(&reply, &replyLen);
+    if (!replyFile) {
+        warn("Unable to create control reply");
+        goto Finally;
+    }
+
+    control_command(self, replyFile, line, controlFd);
+
+    if (fclose(replyFile)) {
+        replyFile = 0;
+        warn("Unable to create control reply");
+        goto Finally;
+    }
+    replyFile = 0;
+
+    if (replyLen != fd_write(controlFd, reply, replyLen))
+        warn("Unable to write control reply");
+
+Finally:
+
+    FINALLY({
+        if (replyFile)
+            fclose(replyFile);
+        free(reply);
+
+        controlFd = fd_close(controlFd);
+    });
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+close_double_agent_listeners(struct Agent *self)
+{
+    self->mDoubleAgentFd = fd_close(self->mDoubleAgentFd);
+    self->mControlFd = fd_close(self->mControlFd);
+
+    for (unsigned tx = 0; tx < TENANT_MAX; ++tx) {
+        if (self->mTenant[tx].mUsed)
+            self->mTenant[tx].mFd = fd_close(self->mTenant[tx].mFd);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+reap_double_agent_tenant(struct Agent *self, pid_t aPid)
+{
+    for (unsigned wx = 0; wx < self->mWorkers; ++wx) {
+        struct TenantWorker *worker = &self->mWorker[wx];
+
+        if (aPid != worker->mPid)
+            continue;
+
+        if (-1 != worker->mTenant) {
+            struct Tenant *tenant = &self->mTenant[worker->mTenant];
+
+            reap_upstream_requests(tenant->mStats, aPid);
+
+            --tenant->mActive;
+            DEBUG("Decreasing tenant %s connection count %d",
+                tenant->mPath, tenant->mActive);
+            atomic_store_explicit(&tenant->mStats->mActive.mValue,
+                tenant->mActive, memory_order_relaxed);
+        }
+
+        *worker = self->mWorker[--self->mWorkers];
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+run_double_agent_tenant(
+    struct Agent *self, struct Tenant *aTenant, unsigned aConnectionId)
+{
+    int rc = -1;
+
+    int clientFd = -1;
+
+    /* Counters are updated in the statistics of the tenant, and the
+     * connection process keeps them as its own.
+     */
+
+    struct Stats *agentStats = stats_;
+
+    stats_ = aTenant->mStats;
+
+    clientFd = un_accept(aTenant->mFd);
+    if (-1 == clientFd) {
+        if (EINTR != errno && EWOULDBLOCK != errno) {
+            warn("Unable to accept connection to tenant %s", aTenant->mPath);
+            goto Finally;
+        }
+
+        rc = 0;
+        goto Finally;
+    }
+
+    STAT_INC(mConnections);
+
+    if (aTenant->mConnectionLimit <= aTenant->mActive) {
+        DEBUG("Tenant %s connection count at limit %d",
+            aTenant->mPath, aTenant->mActive);
+        STAT_INC(mRejected);
+        TRACE(TRACE_REJECT, aConnectionId, aTenant->mActive);
+
+        rc = 0;
+        goto Finally;
+    }
+
+    /* Make room to remember the connection before it is started, so
+     * that every connection process can be attributed when reaped.
+     */
+
+    if (self->mWorkers == self->mWorkerSlots) {
+        unsigned workerSlots = self->mWorkerSlots ? 2 * self->mWorkerSlots : 16;
+
+        struct TenantWorker *worker = realloc(
+            self->mWorker, workerSlots * sizeof(*worker));
+        if (!worker) {
+            warn("Unable to track connection to tenant %s", aTenant->mPath);
+            goto Finally;
+        }
+
+        self->mWorker = worker;
+        self->mWorkerSlots = workerSlots;
+    }
+
+    pid_t connectionPid = fork();
+    if (-1 == connectionPid) {
+        warn("Unable to start process to run connection");
+        goto Finally;
+    }
+
+    if (!connectionPid) {
+
+        DEBUG("Tenant %s connection opened", aTenant->mPath);
+
+        trace_fork(aConnectionId);
+
+        self->mDoubleAgentPath = aTenant->mPath;
+
+        self->mUpstreams = 2;
+        for (unsigned ux = 0; ux < self->mUpstreams; ++ux) {
+            self->mUpstream[ux] = (struct Upstream) {
+                .mWritable = UPSTREAM_PRIMARY == ux,
+                .mReplicas = 1,
+                .mPath = { aTenant->mUpstreamPath[ux] },
+                .mFd = -1,
+            };
+        }
+
+        self->mUsage = aTenant->mUsage;
+        self->mPolicy = aTenant->mPolicy;
+
+        close_double_agent_listeners(self);
+        run_double_agent_connection(self, clientFd);
+
+        DEBUG("Tenant connection closed %d", clientFd);
+        TRACE(TRACE_CLOSE, aConnectionId, 0);
+
+        rc = 1;
+        goto Finally;
+    }
+
+    self->mWorker[self->mWorkers++] = (struct TenantWorker) {
+        .mPid = connectionPid,
+        .mTenant = aTenant - self->mTenant,
+    };
+
+    ++aTenant->mActive;
+    DEBUG("Increasing tenant %s connection count %d",
+        aTenant->mPath, aTenant->mActive);
+    STAT_SET(mActive, aTenant->mActive);
+    TRACE(TRACE_ACCEPT, aConnectionId, aTenant->mActive);
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        clientFd = fd_close(clientFd);
+
+        if (1 != rc)
+            stats_ = agentStats;
+    });
+
+    return rc;
+}
+
+/******************************************************************************/
+int
+run_double_agent(struct Agent *self)
+{
+    int rc = -1;
+
+    int exitcode = -1;
+
+    int clientFd = -1;
+    int signalFd = -1;
+    int processFd = -1;
+
+    signalFd = signal_fd(SIGCHLD);
+    if (-1 == signalFd) {
+        die("Unable to create descriptor to signal %d", SIGCHLD);
+        goto Finally;
+    }
+
+    if (fd_cloexec(signalFd)) {
+        die("Unable to configure signal descriptor");
+        goto Finally;
+    }
+
+    pid_t parentPid = self->mParentPid;
+
+    DEBUG("Parent pid %d\n", parentPid);
+    processFd = proc_fd(parentPid);
+    if (-1 != processFd && fd_cloexec(processFd)) {
+        die("Unable to configure process descriptor");
+        goto Finally;
+    }
+
+    if (-1 == processFd) {
+        if (ESRCH != errno) {
+            die("Unable to create descriptor to pid %d", parentPid);
+            goto Finally;
+        }
+
+        /* The child process has been orphaned, and now adopted by an
+         * ancestor (likely init(1)). The parent no longer accessible,
+         * so force the parent pid to be zero to ensure that it will not
+         * match anything returned by getppid(2).
+         */
+
+        parentPid = 0;
+    }
+
+    /* After an upgrade, the connections started by the previous image
+     * are still running, and are counted against the limit until they
+     * are reaped.
+     */
+
+    int numConnections = atomic_load(&stats_->mActive.mValue);
+    unsigned connectionId = atomic_load(&stats_->mConnections.mValue);
+
+    if (-1 != self->mUpgradeFd) {
+        if (report_double_agent_upgrade(self))
+            warn("Unable to report agent upgrade");
+
+    } else if (report_double_agent_ready(self)) {
+        die("Unable to report agent readiness");
+        goto Finally;
+    }
+
+    /* Note that parent termination will race proc_fd(), so it is
+     * also theoretically possible that proc_fd() succeeds but
+     * binds to a new process that acquired the process pid previously
+     * belonging to the parent.
+     *
+     * Since getppid(2) must return an ancestor, and that ancestor
+     * was pre-existing, it is sufficient to compare the result from
+     * getppid(2) to detect this case.
+     */
+
+    while (getppid() == parentPid) {
+
+        DEBUG("Reaping processes");
+
+        while (1) {
+
+            pid_t waitedPid = waitpid(-1, 0, WNOHANG);
+            if (-1 == waitedPid) {
+                if (ECHILD != errno) {
+                    die("Unable to wait for child processes");
+                    goto Finally;
+                }
+                waitedPid = 0;
+            }
+
+            if (!waitedPid)
+                break;
+
+            DEBUG("Reaped process pid %d", waitedPid);
+
+            if (reap_double_agent_tenant(self, waitedPid))
+                continue;
+
+            reap_upstream_requests(stats_, waitedPid);
+
+            --numConnections;
+            DEBUG("Decreasing connection count %d", numConnections);
+            STAT_SET(mActive, numConnections);
+        }
+
+        struct pollfd pollFds[4 + TENANT_MAX] = {
+            { .fd = self->mDoubleAgentFd, .events = POLLIN },
+            { .fd = signalFd,             .events = POLLIN },
+            { .fd = processFd,            .events = POLLIN },
+            { .fd = self->mControlFd,     .events = POLLIN },
+        };
+
+        for (unsigned tx = 0; tx < TENANT_MAX; ++tx) {
+            const struct Tenant *tenant = &self->mTenant[tx];
+
+            pollFds[4 + tx].fd = tenant->mUsed ? tenant->mFd : -1;
+            pollFds[4 + tx].events = POLLIN;
+        }
+
+        DEBUG("Polling for activity");
+
+        int fds = poll(pollFds, NUMBEROF(pollFds), -1);
+        if (-1 == fds) {
+            if (EINTR != errno) {
+                die("Unable to poll for activity");
+                goto Finally;
+            }
+            fds = 0;
+        }
+
+        DEBUG("Polling signal activity");
+
+        int signalEvent = signal_fd_read(signalFd);
+        if (-1 == signalEvent) {
+            die("Unable to read signal descriptor");
+            goto Finally;
+        }
+
+        DEBUG("Polling process activity");
+
+        int processEvent = proc_fd_read(processFd);
+        if (-1 == processEvent) {
+            die("Unable to read process descriptor");
+            goto Finally;
+        }
+
+        if (processEvent)
+            break;
+
+        if (pollFds[3].revents) {
+            DEBUG("Polling control activity");
+            run_double_agent_control(self);
+        }
+
+        for (unsigned tx = 0; exitcode < 0 && tx < TENANT_MAX; ++tx) {
+            struct Tenant *tenant = &self->mTenant[tx];
+
+            if (!tenant->mUsed || !pollFds[4 + tx].revents)
+                continue;
+
+            DEBUG("Polling tenant %s activity", tenant->mPath);
+
+            int tenantRc = run_double_agent_tenant(self, tenant, ++connectionId);
+            if (1 == tenantRc)
+                exitcode = 0;
+        }
+
+        if (exitcode >= 0)
+            break;
+
+        DEBUG("Polling connection activity");
+
+        DEBUG("Agent waiting for next connection");
+
+        clientFd = un_accept(self->mDoubleAgentFd);
+        if (-1 == clientFd) {
+            if (EINTR != errno && EWOULDBLOCK != errno) {
+                die("Unable to accept client connection");
+                goto Finally;
+            }
+
+            continue;
+        }
+
+        STAT_INC(mConnections);
+
+        ++connectionId;
+
+        if (self->mConnectionLimit <= numConnections) {
+
+            DEBUG("Connection count at limit %d", numConnections);
+            STAT_INC(mRejected);
+            TRACE(TRACE_REJECT, connectionId, numConnections);
+
+        } else {
+
+            if (self->mPolicy)
+                reload_double_agent_policy(self);
+
+            ++numConnections;
+            DEBUG("Increasing connection count %d", numConnections);
+            STAT_SET(mActive, numConnections);
+            TRACE(TRACE_ACCEPT, connectionId, numConnections);
+            PROBE(accept, connectionId, numConnections);
+
+            pid_t connectionPid = fork();
+            if (-1 == connectionPid) {
+                die("Unable to start process to run connection");
+                goto Finally;
+            }
+
+            if (!connectionPid) {
+
+                DEBUG("Agent connection opened");
+
+                trace_fork(connectionId);
+
+                close_double_agent_listeners(self);
+                run_double_agent_connection(self, clientFd);
+
+                DEBUG("Agent connection closed %d", clientFd);
+                TRACE(TRACE_CLOSE, connectionId, 0);
+
+                exitcode = 0;
+                break;
+            }
+
+        }
+
+        clientFd = fd_close(clientFd);
+    }
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        clientFd = fd_close(clientFd);
+        signalFd = fd_close(signalFd);
+        processFd = fd_close(processFd);
+
+        if (exitcode >= 0)
+            exit(exitcode);
+
+        for (unsigned tx = 0; tx < TENANT_MAX; ++tx) {
+            if (self->mTenant[tx].mUsed)
+                remove_tenant(self, &self->mTenant[tx]);
+        }
+
+        free(self->mWorker);
+    });
+
+    return rc;
+}
+
+/******************************************************************************/
+static int
+listen_activated(void)
+{
+    int rc = -1;
+
+    int activatedFd = -1;
+
+    /* Follow the LISTEN_FDS convention of service managers, where the
+     * passed descriptors start at 3, and are meant for the process
+     * named by LISTEN_PID. The variables are removed so that they are
+     * not seen by the command.
+     */
+
+    const char *listenPid = getenv("LISTEN_PID");
+    const char *listenFds = getenv("LISTEN_FDS");
+
+    if (!listenPid || !listenFds || getpid() != atoi(listenPid)) {
+        errno = ENOENT;
+        goto Finally;
+    }
+
+    if (strcmp("1", listenFds)) {
+        errno = EINVAL;
+        goto Finally;
+    }
+
+    if (un_listening(3))
+        goto Finally;
+
+    activatedFd = 3;
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        unsetenv("LISTEN_PID");
+        unsetenv("LISTEN_FDS");
+        unsetenv("LISTEN_FDNAMES");
+    });
+
+    return rc ? rc : activatedFd;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+open_double_agent_usage(struct UsageTable **aUsage)
+{
+    int rc = -1;
+
+    struct UsageTable *usage = 0;
+
+    if (argUsageDb) {
+        usage = usage_open(argUsageDb, USAGE_RECORDS, USAGE_HALF_LIFE);
+        if (!usage) {
+            die("Unable to open usage database %s", argUsageDb);
+            goto Finally;
+        }
+
+        if (!realpath(argUsageDb, stats_->mUsagePath)) {
+            die("Unable to resolve usage database %s", argUsageDb);
+            goto Finally;
+        }
+
+    } else if (optUsageOrder || argHostHint) {
+        usage = usage_create(USAGE_RECORDS, USAGE_HALF_LIFE);
+        if (!usage) {
+            die("Unable to create usage table");
+            goto Finally;
+        }
+    }
+
+    *aUsage = usage;
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+open_double_agent_policy(struct Policy **aPolicy, struct stat *aPolicyStat)
+{
+    int rc = -1;
+
+    struct Policy *policy = 0;
+
+    if (argPolicyPath) {
+        if (stat(argPolicyPath, aPolicyStat)) {
+            die("Unable to find policy %s", argPolicyPath);
+            goto Finally;
+        }
+
+        policy = policy_load(argPolicyPath);
+        if (!policy) {
+            die("Unable to load policy %s", argPolicyPath);
+            goto Finally;
+        }
+    }
+
+    *aPolicy = policy;
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/******************************************************************************/
+int
+spawn_double_agent(
+    const struct Upstream *aUpstream,
+    unsigned aUpstreams,
+    const char *aDoubleAgentPath,
+    int aReadyFd)
+{
+    int rc = -1;
+
+    uint64_t startNs = clk_monotonic_ns();
+
+    for (unsigned ux = 0; ux < aUpstreams; ++ux) {
+        for (unsigned rx = 0; rx < aUpstream[ux].mReplicas; ++rx)
+            DEBUG("Upstream %s %s path %s",
+                upstream_name(ux),
+                aUpstream[ux].mWritable ? "writable" : "read-only",
+                aUpstream[ux].mPath[rx]);
+    }
+    DEBUG("Double agent path %s", aDoubleAgentPath);
+
+    const char *removePath = 0;
+    const char *removeControlPath = 0;
+    int removeStats = 0;
+
+    pid_t childPid = -1;
+
+    int doubleAgentFd = -1;
+    int controlFd = -1;
+    int readyPipe[2] = { -1, -1 };
+    int statsFd = -1;
+
+    /* A socket that is passed by a service manager is already bound and
+     * listening, and its path belongs to the service manager.
+     */
+
+    int activated = 0;
+
+    doubleAgentFd = listen_activated();
+    if (-1 != doubleAgentFd) {
+        DEBUG("Activated socket %d", doubleAgentFd);
+        activated = 1;
+
+    } else if (ENOENT != errno) {
+        die("Unable to use activated socket");
+        goto Finally;
+
+    } else {
+        doubleAgentFd = un_listen(aDoubleAgentPath);
+        if (-1 == doubleAgentFd) {
+            die("Unable to create double agent path %s", aDoubleAgentPath);
+            goto Finally;
+        }
+    }
+
+    if (argControlPath) {
+        controlFd = un_listen(argControlPath);
+        if (-1 == controlFd) {
+            die("Unable to create control path %s", argControlPath);
+            goto Finally;
+        }
+
+        if (-1 == fd_nonblock(controlFd)) {
+            die("Unable to configure non-blocking control socket");
+            goto Finally;
+        }
+    }
+
+    uint64_t bindNs = clk_monotonic_ns();
+
+    /* Name the statistics after the socket that is actually served,
+     * which for an activated socket is chosen by the service manager.
+     */
+
+    char socketPath[PATH_MAX];
+    if (un_name(doubleAgentFd, socketPath, sizeof(socketPath))) {
+        die("Unable to name double agent socket");
+        goto Finally;
+    }
+
+    char statsName[64];
+    if (shm_name(socketPath, statsName, sizeof(statsName))) {
+        die("Unable to name statistics for %s", socketPath);
+        goto Finally;
+    }
+
+    statsFd = shm_create(statsName, sizeof(*stats_));
+    if (-1 == statsFd) {
+        die("Unable to create statistics %s", statsName);
+        goto Finally;
+    }
+
+    stats_ = shm_map(statsFd, sizeof(*stats_), 1);
+    if (!stats_) {
+        die("Unable to map statistics %s", statsName);
+        goto Finally;
+    }
+
+    struct UsageTable *usage = 0;
+    struct Policy *policy = 0;
+    struct stat policyStat = { };
+
+    if (open_double_agent_usage(&usage))
+        goto Finally;
+
+    if (open_double_agent_policy(&policy, &policyStat))
+        goto Finally;
+
+    if (-1 == fd_nonblock(doubleAgentFd)) {
+        die("Unable to configure non-blocking socket");
+        goto Finally;
+    }
+
+    if (setenv("SSH_AUTH_SOCK", aDoubleAgentPath, 1)) {
+        die("Unable to set SSH_AUTH_SOCK");
+        goto Finally;
+    }
+
+    pid_t selfPid = getpid();
+
+    DEBUG("Agent parent pid %d", selfPid);
+
+    /* The command is only started after the agent is ready to
+     * poll for connections, so that requests from the command
+     * do not race the agent startup.
+     */
+
+    if (pipe(readyPipe)) {
+        die("Unable to create ready pipe");
+        goto Finally;
+    }
+
+    childPid = fork();
+    if (-1 == childPid) {
+        die("Unable to create child process");
+        goto Finally;
+    }
+
+    if (childPid) {
+
+        readyPipe[1] = fd_close(readyPipe[1]);
+        controlFd = fd_close(controlFd);
+
+        char status[128];
+        ssize_t statusLen = fd_read(readyPipe[0], status, sizeof(status));
+        if (-1 == statusLen) {
+            die("Unable to read agent readiness");
+            goto Finally;
+        }
+
+        if (!statusLen) {
+            die("Agent pid %d failed to start", childPid);
+            goto Finally;
+        }
+
+        DEBUG("Agent ready");
+
+        if (-1 != aReadyFd) {
+            char readyMsg[sizeof(status) + 32];
+            int readyLen = snprintf(readyMsg, sizeof(readyMsg),
+                "READY=1\nSTATUS=%.*s", (int) statusLen, status);
+
+            if (readyLen != fd_write(aReadyFd, readyMsg, readyLen))
+                warn("Unable to notify readiness on fd %d", aReadyFd);
+
+            fd_close(aReadyFd);
+        }
+
+    } else {
+
+        uint64_t forkNs = clk_monotonic_ns();
+
+        DEBUG("Agent pid %d", getpid());
+
+        trace_fork(0);
+
+        removePath = activated ? 0 : aDoubleAgentPath;
+        removeControlPath = argControlPath;
+        removeStats = 1;
+
+        init_double_agent_stats(aUpstream, aUpstreams);
+
+        readyPipe[0] = fd_close(readyPipe[0]);
+        fd_close(aReadyFd);
+
+        if (-1 == setsid()) {
+            die("Unable to create new session leader");
+            goto Finally;
+        }
+
+        uint64_t setsidNs = clk_monotonic_ns();
+
+        if (stdio_pipe()) {
+            die("Unable to create stdio pipe");
+            goto Finally;
+        }
+
+        /* Memory locks are not inherited across fork, so the keystore
+         * is created by the agent, which outlives every connection.
+         */
+
+        struct Keystore *keystore = 0;
+        int keystoreFd = -1;
+
+        if (optKeystore) {
+            keystore = keystore_create(KEYSTORE_RECORDS, &keystoreFd);
+            if (!keystore) {
+                die("Unable to create keystore");
+                goto Finally;
+            }
+        }
+
+        struct Agent agent = {
+
+            .mDoubleAgentPath = aDoubleAgentPath,
+
+            .mParentPid = selfPid,
+
+            .mDoubleAgentFd = doubleAgentFd,
+
+            .mControlFd = controlFd,
+            .mConnectionLimit = CONNECTIONS_DEFAULT,
+
+            .mUpstreams = aUpstreams,
+
+            .mUsage = usage,
+
+            .mPolicy = policy,
+            .mPolicyStat = policyStat,
+
+            .mReadyFd = readyPipe[1],
+
+            .mActivated = activated,
+
+            .mStatsFd = statsFd,
+            .mKeystoreFd = keystoreFd,
+
+            .mUpgradeFd = -1,
+
+            .mStartup = {
+                .mStartNs = startNs,
+                .mBindNs = bindNs,
+                .mForkNs = forkNs,
+                .mSetsidNs = setsidNs,
+            },
+        };
+
+        readyPipe[1] = -1;
+        controlFd = -1;
+
+        for (unsigned ux = 0; ux < aUpstreams; ++ux) {
+            agent.mUpstream[ux] = aUpstream[ux];
+            agent.mUpstream[ux].mFd = -1;
+        }
+
+        agent.mUpstream[UPSTREAM_PRIMARY].mKeystore = keystore;
+
+        if (run_double_agent(&agent))
+            goto Finally;
+
+        DEBUG("Agent closed");
+
+    }
+
+    rc = 0;
+
+Finally:
+    FINALLY({
+        if (removePath)
+            un_unlink(removePath);
+
+        if (removeStats)
+            shm_remove(statsName);
+
+        if (removeControlPath)
+            un_unlink(removeControlPath);
+
+        doubleAgentFd = fd_close(doubleAgentFd);
+        controlFd = fd_close(controlFd);
+        statsFd = fd_close(statsFd);
+        readyPipe[0] = fd_close(readyPipe[0]);
+        readyPipe[1] = fd_close(readyPipe[1]);
+
+        if (!childPid)
+            terminate();
+    });
+
+    return rc;
+}
+
+/******************************************************************************/
+static int
+resume_double_agent(
+    const struct Upstream *aUpstream,
+    unsigned aUpstreams,
+    const char *aDoubleAgentPath,
+    const char *aUpgrade)
+{
+    int rc = -1;
+
+    const char *removePath = aDoubleAgentPath;
+    const char *removeControlPath = argControlPath;
+
+    int parentPid;
+    int activated;
+    int doubleAgentFd = -1;
+    int controlFd = -1;
+    int statsFd = -1;
+    int keystoreFd = -1;
+    int upgradeFd = -1;
+    int connectionLimit;
+    int debugEnabled;
+    uint64_t upgradeNs;
+
+    if (10 != sscanf(aUpgrade, "%d %d %d %d %d %d %d %d %d %" SCNu64,
+                &parentPid,
+                &activated,
+                &doubleAgentFd,
+                &controlFd,
+                &statsFd,
+                &keystoreFd,
+                &upgradeFd,
+                &connectionLimit,
+                &debugEnabled,
+                &upgradeNs)) {
+        die("Unable to parse upgrade state %s", aUpgrade);
+        goto Finally;
+    }
+
+    if (activated)
+        removePath = 0;
+
+    debug("%s", debugEnabled ? DebugEnable : DebugDisable);
+
+    DEBUG("Agent pid %d resuming after upgrade", getpid());
+
+    if (setenv("SSH_AUTH_SOCK", aDoubleAgentPath, 1)) {
+        die("Unable to set SSH_AUTH_SOCK");
+        goto Finally;
+    }
+
+    if (fd_cloexec(statsFd) || fd_cloexec(upgradeFd) ||
+            (-1 != keystoreFd && fd_cloexec(keystoreFd))) {
+        die("Unable to configure upgrade descriptors");
+        goto Finally;
+    }
+
+    char socketPath[PATH_MAX];
+    if (un_name(doubleAgentFd, socketPath, sizeof(socketPath))) {
+        die("Unable to name double agent socket");
+        goto Finally;
+    }
+
+    char statsName[64];
+    if (shm_name(socketPath, statsName, sizeof(statsName))) {
+        die("Unable to name statistics for %s", socketPath);
+        goto Finally;
+    }
+
+    /* Statistics are only carried across an upgrade if the layout is
+     * unchanged. Otherwise the statistics are replaced, and the previous
+     * segment is left to the connections that are still running.
+     */
+
+    struct stat statsStat;
+    if (fstat(statsFd, &statsStat)) {
+        die("Unable to find statistics %s", statsName);
+        goto Finally;
+    }
+
+    if (sizeof(*stats_) == statsStat.st_size)
+        stats_ = shm_map(statsFd, sizeof(*stats_), 1);
+
+    int resumeStats = stats_ &&
+        STATS_MAGIC == stats_->mMagic &&
+        STATS_VERSION == stats_->mVersion &&
+        aUpstreams == stats_->mUpstreams;
+
+    if (!resumeStats) {
+        warn("Replacing statistics %s", statsName);
+
+        if (stats_)
+            stats_ = shm_unmap(stats_, sizeof(*stats_));
+        statsFd = fd_close(statsFd);
+
+        statsFd = shm_create(statsName, sizeof(*stats_));
+        if (-1 == statsFd) {
+            die("Unable to create statistics %s", statsName);
+            goto Finally;
+        }
+
+        stats_ = shm_map(statsFd, sizeof(*stats_), 1);
+        if (!stats_) {
+            die("Unable to map statistics %s", statsName);
+            goto Finally;
+        }
+
+        init_double_agent_stats(aUpstream, aUpstreams);
+    }
+
+    struct UsageTable *usage = 0;
+    struct Policy *policy = 0;
+    struct stat policyStat = { };
+
+    if (open_double_agent_usage(&usage))
+        goto Finally;
+
+    if (open_double_agent_policy(&policy, &policyStat))
+        goto Finally;
+
+    struct Keystore *keystore = 0;
+
+    if (optKeystore) {
+        keystore = keystore_attach(keystoreFd);
+        if (!keystore) {
+            die("Unable to attach keystore");
+            goto Finally;
+        }
+    }
+
+    struct Agent agent = {
+
+        .mDoubleAgentPath = aDoubleAgentPath,
+
+        .mParentPid = parentPid,
+
+        .mDoubleAgentFd = doubleAgentFd,
+
+        .mControlFd = controlFd,
+        .mConnectionLimit = connectionLimit,
+
+        .mUpstreams = aUpstreams,
+
+        .mUsage = usage,
+
+        .mPolicy = policy,
+        .mPolicyStat = policyStat,
+
+        .mReadyFd = -1,
+
+        .mActivated = activated,
+
+        .mStatsFd = statsFd,
+        .mKeystoreFd = keystoreFd,
+
+        .mUpgradeFd = upgradeFd,
+        .mUpgradeNs = upgradeNs,
+    };
+
+    upgradeFd = -1;
+
+    /* Upstream paths changed through the control socket are recorded
+     * in the statistics, and take precedence over the arguments.
+     */
+
+    for (unsigned ux = 0; ux < aUpstreams; ++ux) {
+        struct Upstream *upstream = &agent.mUpstream[ux];
+
+        *upstream = aUpstream[ux];
+        upstream->mFd = -1;
+
+        if (!resumeStats)
+            continue;
+
+        upstream->mReplicas = stats_->mReplicas[ux];
+        for (unsigned rx = 0; rx < upstream->mReplicas; ++rx) {
+            snprintf(agent.mControlPath[ux][rx],
+                sizeof(agent.mControlPath[ux][rx]),
+                "%s", stats_->mReplica[ux][rx].mPath);
+            upstream->mPath[rx] = agent.mControlPath[ux][rx];
+        }
+    }
+
+    agent.mUpstream[UPSTREAM_PRIMARY].mKeystore = keystore;
+
+    if (run_double_agent(&agent))
+        goto Finally;
+
+    DEBUG("Agent closed");
+
+    rc = 0;
+
+Finally:
+    FINALLY({
+        if (removePath)
+            un_unlink(removePath);
+
+        shm_remove(statsName);
+
+        if (removeControlPath)
+            un_unlink(removeControlPath);
+
+        doubleAgentFd = fd_close(doubleAgentFd);
+        controlFd = fd_close(controlFd);
+        statsFd = fd_close(statsFd);
+        upgradeFd = fd_close(upgradeFd);
+
+        terminate();
+    });
+
+    return rc;
+}
+
+/******************************************************************************/
+static uint64_t
+stat_read(const struct StatCounter *aCounter)
+{
+    return atomic_load_explicit(&aCounter->mValue, memory_order_relaxed);
+}
+
+/*----------------------------------------------------------------------------*/
+#define STATS_COLUMNS (19 + 3 * UPSTREAM_MAX)
+
+static unsigned
+stat_upstreams(const struct Stats *aStats)
+{
+    return UPSTREAM_MAX < aStats->mUpstreams ?
+        UPSTREAM_MAX : aStats->mUpstreams;
+}
+
+static void
+stat_sample(const struct Stats *aStats, uint64_t *aSample)
+{
+    uint64_t requests[STATS_TYPES];
+    for (int tx = 0; tx < STATS_TYPES; ++tx)
+        requests[tx] = stat_read(&aStats->mRequests[tx]);
+
+    uint64_t otherRequests = 0;
+    for (int tx = 0; tx < STATS_TYPES; ++tx)
+        otherRequests += requests[tx];
+
+    int sx = 0;
+
+    aSample[sx++] = stat_read(&aStats->mConnections);
+    aSample[sx++] = stat_read(&aStats->mRejected);
+    aSample[sx++] = stat_read(&aStats->mActive);
+    aSample[sx++] = stat_read(&aStats->mIdleClosed);
+    aSample[sx++] = stat_read(&aStats->mExpired);
+    aSample[sx++] = stat_read(&aStats->mStalled);
+
+    static const int groups[][3] = {
+        { SSH_AGENTC_REQUEST_IDENTITIES },
+        { SSH_AGENTC_SIGN_REQUEST },
+        { SSH_AGENTC_ADD_IDENTITY, SSH_AGENTC_ADD_ID_CONSTRAINED },
+        { SSH_AGENTC_REMOVE_IDENTITY, SSH_AGENTC_REMOVE_ALL_IDENTITIES },
+        { SSH_AGENTC_LOCK, SSH_AGENTC_UNLOCK },
+        { SSH_AGENTC_EXTENSION },
+    };
+
+    for (int gx = 0; gx < NUMBEROF(groups); ++gx) {
+        uint64_t groupRequests = 0;
+        for (int tx = 0; tx < NUMBEROF(groups[gx]) && groups[gx][tx]; ++tx)
+            groupRequests += requests[groups[gx][tx]];
+        otherRequests -= groupRequests;
+        aSample[sx++] = groupRequests;
+    }
+
+    aSample[sx++] = otherRequests;
+    aSample[sx++] = stat_read(&aStats->mDuplicates);
+
+    for (unsigned rx = 0; rx < stat_upstreams(aStats); ++rx) {
+        aSample[sx++] = stat_read(&aStats->mUpstream[rx].mRequests);
+        aSample[sx++] = stat_read(&aStats->mUpstream[rx].mFailures);
+        aSample[sx++] = stat_read(&aStats->mUpstream[rx].mErrors);
+    }
+
+    aSample[sx++] = stat_read(&aStats->mHedges);
+    aSample[sx++] = stat_read(&aStats->mHedgeWins);
+
+    aSample[sx++] = stat_read(&aStats->mBytesIn);
+    aSample[sx++] = stat_read(&aStats->mBytesOut);
+    aSample[sx++] = stat_read(&aStats->mErrors);
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+compare_usage_entry(const void *aLhs, const void *aRhs)
+{
+    const struct UsageEntry *lhs = aLhs;
+    const struct UsageEntry *rhs = aRhs;
+
+    return lhs->mLastUsedNs > rhs->mLastUsedNs ? -1 :
+        lhs->mLastUsedNs < rhs->mLastUsedNs;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+stat_usage(const char *aPath)
+{
+    int rc = -1;
+
+    const struct UsageTable *usage = 0;
+    struct UsageEntry *entries = 0;
+
+    usage = usage_attach(aPath);
+    if (!usage) {
+        warn("Unable to open usage database %s", aPath);
+        goto Finally;
+    }
+
+    entries = malloc(sizeof(*entries) * (usage->mRecords ? usage->mRecords : 1));
+    if (!entries)
+        goto Finally;
+
+    unsigned numEntries = 0;
+    for (unsigned rx = 0; rx < usage->mRecords; ++rx) {
+        if (!usage_read(usage, rx, &entries[numEntries]))
+            ++numEntries;
+    }
+
+    qsort(entries, numEntries, sizeof(*entries), compare_usage_entry);
+
+    static const unsigned char noHost[USAGE_KEY_LEN];
+
+    printf("\n%6s %8s %-19s %s\n", "count", "score", "last-used", "key [host]");
+
+    for (unsigned ex = 0; ex < numEntries; ++ex) {
+        const struct UsageEntry *entry = &entries[ex];
+
+        char lastUsed[32];
+        time_t lastUsedTime = entry->mLastUsedNs / 1000000000;
+        strftime(lastUsed, sizeof(lastUsed),
+            "%Y-%m-%d %H:%M:%S", localtime(&lastUsedTime));
+
+        char key[64];
+        digest_fingerprint(entry->mKey, key, sizeof(key));
+
+        char host[64] = "";
+        if (memcmp(noHost, entry->mHost, sizeof(noHost)))
+            digest_fingerprint(entry->mHost, host, sizeof(host));
+
+        printf("%6" PRIu64 " %8.2f %-19s %s%s%s%s\n",
+            entry->mCount, (double) entry->mScore / USAGE_UNIT,
+            lastUsed, key, *host ? " [" : "", host, *host ? "]" : "");
+    }
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        free(entries);
+        usage = usage_close(usage);
+    });
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+stat_replicas(const struct Stats *aStats)
+{
+    uint64_t nowNs = clk_monotonic_ns();
+
+    printf("%-9s %4s %8s %8s %5s %8s %-7s %s\n",
+        "agent", "act", "req", "resp", "err", "lat_us", "state", "path");
+
+    for (unsigned ux = 0; ux < stat_upstreams(aStats); ++ux) {
+
+        unsigned replicas = aStats->mReplicas[ux];
+        if (REPLICA_MAX < replicas)
+            replicas = REPLICA_MAX;
+
+        for (unsigned rx = 0; rx < replicas; ++rx) {
+            const struct StatReplica *replica = &aStats->mReplica[ux][rx];
+
+            uint64_t responses = stat_read(&replica->mResponses);
+            uint64_t latencyNs = stat_read(&replica->mLatencyNs);
+
+            printf("%-9s %4" PRIu64 " %8" PRIu64 " %8" PRIu64
+                   " %5" PRIu64 " %8" PRIu64 " %-7s %.*s\n",
+                upstream_name(ux),
+                stat_read(&replica->mActive),
+                stat_read(&replica->mRequests),
+                responses,
+                stat_read(&replica->mErrors),
+                responses ? latencyNs / responses / 1000 : 0,
+                nowNs < stat_read(&replica->mEjectedNs) ? "ejected" : "ok",
+                (int) sizeof(replica->mPath), replica->mPath);
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+stat_client_name(const struct StatClient *aClient, char *aName)
+{
+    uint64_t name[NUMBEROF(aClient->mName)];
+
+    unsigned nameSeq = atomic_load_explicit(
+        &aClient->mNameSeq, memory_order_acquire);
+
+    for (unsigned wx = 0; wx < NUMBEROF(name); ++wx)
+        name[wx] = atomic_load_explicit(
+            &aClient->mName[wx], memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_acquire);
+
+    if ((nameSeq & 1) || nameSeq != atomic_load_explicit(
+            &aClient->mNameSeq, memory_order_relaxed))
+        return -1;
+
+    memcpy(aName, name, sizeof(name));
+    aName[sizeof(name) - 1] = 0;
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+stat_clients(const struct Stats *aStats)
+{
+    printf("%-7s %7s %7s %7s %7s %7s %7s  %s\n",
+        "client",
+        "id-thr", "id-rej", "sg-thr", "sg-rej", "ch-thr", "ch-rej",
+        "name");
+
+    for (unsigned cx = 0; cx < STATS_CLIENTS; ++cx) {
+        const struct StatClient *client = &aStats->mClient[cx];
+
+        if (!atomic_load_explicit(&client->mKey, memory_order_relaxed))
+            continue;
+
+        printf("%-7u", cx);
+        for (unsigned rx = 0; rx < RATE_CLASSES; ++rx)
+            printf(" %7" PRIu64 " %7" PRIu64,
+                (uint64_t) atomic_load_explicit(
+                    &client->mThrottled[rx], memory_order_relaxed),
+                (uint64_t) atomic_load_explicit(
+                    &client->mRejected[rx], memory_order_relaxed));
+
+        char name[CLIENT_NAME_MAX];
+        printf("  %s\n", stat_client_name(client, name) ? "-" : name);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+stat_priorities(const struct Stats *aStats)
+{
+    static const char *priorityNames[PRIORITIES] = {
+        [PRIORITY_SIGN]       = "sign",
+        [PRIORITY_IDENTITIES] = "ident",
+        [PRIORITY_OTHER]      = "other",
+    };
+
+    printf("%-9s %8s %8s\n", "priority", "deferred", "delay_us");
+
+    for (unsigned px = 0; px < PRIORITIES; ++px) {
+        uint64_t deferred = stat_read(&aStats->mDeferred[px]);
+        uint64_t deferredNs = stat_read(&aStats->mDeferredNs[px]);
+
+        printf("%-9s %8" PRIu64 " %8" PRIu64 "\n",
+            priorityNames[px],
+            deferred,
+            deferred ? deferredNs / deferred / 1000 : 0);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static void
+stat_reconnects(const struct Stats *aStats)
+{
+    printf("%-9s %10s\n", "agent", "reconnects");
+
+    for (unsigned ux = 0; ux < stat_upstreams(aStats); ++ux) {
+        printf("%-9s %10" PRIu64 "\n",
+            upstream_name(ux),
+            stat_read(&aStats->mUpstream[ux].mReconnects));
+    }
+
+    printf("retries %" PRIu64 "\n", stat_read(&aStats->mRetries));
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+stat_double_agent(int argc, char **argv)
+{
+    int rc = -1;
+
+    int statsFd = -1;
+    const struct Stats *stats = 0;
+
+    if (2 > argc || 4 < argc)
+        usage();
+
+    const char *doubleAgentPath = argv[1];
+
+    long interval = 0;
+    long count = 1;
+
+    if (2 < argc) {
+        char *end;
+        interval = strtol(argv[2], &end, 10);
+        if (end == argv[2] || *end || 0 >= interval)
+            usage();
+        count = 0;
+    }
+
+    if (3 < argc) {
+        char *end;
+        count = strtol(argv[3], &end, 10);
+        if (end == argv[3] || *end || 0 >= count)
+            usage();
+    }
+
+    char statsName[64];
+    if (shm_name(doubleAgentPath, statsName, sizeof(statsName))) {
+        warn("Unable to find double agent %s", doubleAgentPath);
+        goto Finally;
+    }
+
+    statsFd = shm_attach(statsName);
+    if (-1 == statsFd) {
+        warn("Unable to open statistics %s", statsName);
+        goto Finally;
+    }
+
+    struct stat statsStat;
+    if (fstat(statsFd, &statsStat)) {
+        warn("Unable to query statistics %s", statsName);
+        goto Finally;
+    }
+
+    if (sizeof(*stats) > statsStat.st_size) {
+        errno = EINVAL;
+        warn("Mismatched statistics size %s", statsName);
+        goto Finally;
+    }
+
+    stats = shm_map(statsFd, sizeof(*stats), 0);
+    if (!stats) {
+        warn("Unable to map statistics %s", statsName);
+        goto Finally;
+    }
+
+    if (STATS_MAGIC != stats->mMagic || STATS_VERSION != stats->mVersion) {
+        errno = EINVAL;
+        warn("Mismatched statistics version %s", statsName);
+        goto Finally;
+    }
+
+    /* Mirror vmstat(8) by showing totals since the agent started on the
+     * first line, and the activity in each interval on subsequent lines.
+     */
+
+    unsigned upstreams = stat_upstreams(stats);
+
+    printf("%s %s",
+        "-----------connections-----------",
+        "-------------------requests--------------------");
+    for (unsigned rx = 0; rx < upstreams; ++rx) {
+        static const char dashes[] = "--------";
+        const char *name = upstream_name(rx);
+        int nameLen = strlen(name);
+        printf(" %.*s%s%.*s",
+            (17 - nameLen) / 2, dashes,
+            name,
+            17 - nameLen - (17 - nameLen) / 2, dashes);
+    }
+    printf(" %s %s\n",
+        "---hedge---",
+        "---------bytes---------");
+    printf("%5s %5s %4s %5s %5s %4s %5s %5s %5s %5s %5s %5s %5s %5s",
+        "conn", "rej", "act", "idle", "exp", "stl",
+        "ident", "sign", "add", "rm", "lock", "ext", "other", "dup");
+    for (unsigned rx = 0; rx < upstreams; ++rx)
+        printf(" %5s %5s %5s", "req", "fail", "err");
+    printf(" %5s %5s %8s %8s %5s\n",
+        "iss", "won",
+        "in", "out", "err");
+
+    uint64_t prevSample[STATS_COLUMNS] = { };
+
+    for (long ix = 0; !count || ix < count; ++ix) {
+
+        if (ix)
+            sleep(interval);
+
+        uint64_t sample[NUMBEROF(prevSample)] = { };
+        stat_sample(stats, sample);
+
+        uint64_t delta[NUMBEROF(sample)];
+        for (int sx = 0; sx < NUMBEROF(sample); ++sx)
+            delta[sx] = sample[sx] - prevSample[sx];
+
+        /* The number of active connections is a gauge, not a counter */
+        delta[2] = sample[2];
+
+        printf("%5" PRIu64 " %5" PRIu64 " %4" PRIu64
+               " %5" PRIu64 " %5" PRIu64 " %4" PRIu64
+               " %5" PRIu64 " %5" PRIu64 " %5" PRIu64 " %5" PRIu64
+               " %5" PRIu64 " %5" PRIu64 " %5" PRIu64 " %5" PRIu64,
+            delta[0], delta[1], delta[2],
+            delta[3], delta[4], delta[5],
+            delta[6], delta[7], delta[8], delta[9],
+            delta[10], delta[11], delta[12], delta[13]);
+
+        const uint64_t *upstreamDelta = delta + 14;
+        for (unsigned rx = 0; rx < upstreams; ++rx, upstreamDelta += 3)
+            printf(" %5" PRIu64 " %5" PRIu64 " %5" PRIu64,
+                upstreamDelta[0], upstreamDelta[1], upstreamDelta[2]);
+
+        printf(" %5" PRIu64 " %5" PRIu64
+               " %8" PRIu64 " %8" PRIu64 " %5" PRIu64 "\n",
+            upstreamDelta[0], upstreamDelta[1],
+            upstreamDelta[2], upstreamDelta[3], upstreamDelta[4]);
+        fflush(stdout);
+
+        memcpy(prevSample, sample, sizeof(prevSample));
+
+        if (kill(stats->mPid, 0) && ESRCH == errno)
+            break;
+    }
+
+    /* Replicas, client throttling, deferrals, output, cancellations,
+     * and key usage are only reported once because they are not
+     * reported by interval.
+     */
+
+    int replicated = 0;
+    for (unsigned ux = 0; ux < stat_upstreams(stats); ++ux)
+        replicated |= 1 < stats->mReplicas[ux];
+
+    if (!interval && replicated)
+        stat_replicas(stats);
+
+    int clients = 0;
+    for (unsigned cx = 0; cx < STATS_CLIENTS; ++cx)
+        clients |= !!atomic_load_explicit(
+            &stats->mClient[cx].mKey, memory_order_relaxed);
+
+    if (!interval && clients)
+        stat_clients(stats);
+
+    int deferred = 0;
+    for (unsigned px = 0; px < PRIORITIES; ++px)
+        deferred |= !!stat_read(&stats->mDeferred[px]);
+
+    if (!interval && deferred)
+        stat_priorities(stats);
+
+    uint64_t highWater = stat_read(&stats->mOutputHighWater);
+    if (!interval && highWater)
+        printf("output high-water %" PRIu64 " bytes\n", highWater);
+
+    uint64_t cancelled[STAGES];
+    for (unsigned sx = 0; sx < STAGES; ++sx)
+        cancelled[sx] = stat_read(&stats->mCancelled[sx]);
+
+    if (!interval &&
+            (cancelled[STAGE_READ] ||
+             cancelled[STAGE_UPSTREAM] || cancelled[STAGE_WRITE]))
+        printf("cancelled read %" PRIu64
+               " upstream %" PRIu64 " write %" PRIu64 "\n",
+            cancelled[STAGE_READ],
+            cancelled[STAGE_UPSTREAM],
+            cancelled[STAGE_WRITE]);
+
+    int reconnected = !!stat_read(&stats->mRetries);
+    for (unsigned ux = 0; ux < stat_upstreams(stats); ++ux)
+        reconnected |= !!stat_read(&stats->mUpstream[ux].mReconnects);
+
+    if (!interval && reconnected)
+        stat_reconnects(stats);
+
+    if (!interval && stats->mUsagePath[0]) {
+        if (stat_usage(stats->mUsagePath))
             goto Finally;
+    }
+
+    rc = 0;
+
+Finally:
+
+    FINALLY({
+        stats = shm_unmap((void *) stats, sizeof(*stats));
+        statsFd = fd_close(statsFd);
+    });
+
+    return rc;
+}
+
+/******************************************************************************/
+static void
+trace_print(const struct TraceHeader *aHeader, const struct TraceRecord *aRecord)
+{
+    static const char *eventNames[TRACE_EVENTS] = {
+        [TRACE_ACCEPT]        = "accept",
+        [TRACE_REJECT]        = "reject",
+        [TRACE_CLOSE]         = "close",
+        [TRACE_REQUEST]       = "request",
+        [TRACE_RESPONSE]      = "response",
+        [TRACE_UPSTREAM_SEND] = "upstream-send",
+        [TRACE_UPSTREAM_RECV] = "upstream-recv",
+        [TRACE_IDENTITIES]    = "identities",
+        [TRACE_ERROR]         = "error",
+    };
+
+    const char *eventName = 0;
+    if (aRecord->mEvent < TRACE_EVENTS)
+        eventName = eventNames[aRecord->mEvent];
+
+    printf("%" PRIu64 ".%06" PRIu64 " %" PRIu32 " %" PRIu16 " %" PRIu32 " ",
+        aRecord->mTime / 1000000000,
+        aRecord->mTime % 1000000000 / 1000,
+        aHeader->mPid,
+        aRecord->mConnection,
+        aRecord->mSeq);
+
+    if (eventName)
+        printf("%s", eventName);
+    else
+        printf("event-%" PRIu16, aRecord->mEvent);
+
+    uint64_t arg0 = aRecord->mArg[0];
+    uint64_t arg1 = aRecord->mArg[1];
+
+    switch (aRecord->mEvent) {
+    default:
+        printf(" %" PRIu64 " %" PRIu64 "\n", arg0, arg1);
         break;
 
-    case SSH_AGENTC_LOCK:
-        if (agent_lock(self, msg))
-            goto Finally;
+    case TRACE_ACCEPT:
+    case TRACE_REJECT:
+        printf(" connection=%" PRIu64 " active=%" PRIu64 "\n", arg0, arg1);
         break;
 
-    case SSH_AGENTC_UNLOCK:
-        if (agent_unlock(self, msg))
-            goto Finally;
+    case TRACE_CLOSE:
+        printf(" connection=%" PRIu64 "\n", arg0);
         break;
 
-    default:
-        if (agent_primary_request(self, msg))
-            goto Finally;
+    case TRACE_REQUEST:
+    case TRACE_RESPONSE:
+        printf(" type=%" PRIu64 " length=%" PRIu64 "\n", arg0, arg1);
+        break;
+
+    case TRACE_UPSTREAM_SEND:
+        printf(" agent=%s type=%" PRIu64 "\n", upstream_name(arg0), arg1);
+        break;
+
+    case TRACE_UPSTREAM_RECV:
+        printf(" agent=%s type=%" PRIu64 " length=%" PRIu64 "\n",
+            upstream_name(arg0), arg1 >> 32, arg1 & 0xffffffff);
+        break;
+
+    case TRACE_IDENTITIES:
+        printf(" agents=%" PRIu64 " identities=%" PRIu64 "\n", arg0, arg1);
+        break;
+
+    case TRACE_ERROR:
+        printf(" type=%" PRIu64 " errno=%" PRIu64 "\n", arg0, arg1);
         break;
     }
+}
 
-    if (message_purge(msg)) {
-        warn("Unable to purge message");
-        goto Finally;
+/*----------------------------------------------------------------------------*/
+static int
+trace_double_agent(int argc, char **argv)
+{
+    int rc = -1;
+
+    int traceFd = -1;
+
+    if (2 > argc)
+        usage();
+
+    /* Each line starts with the monotonic time of the record so that
+     * the output from several processes can be merged using sort(1).
+     */
+
+    for (int ax = 1; ax < argc; ++ax) {
+
+        const char *tracePath = argv[ax];
+
+        traceFd = open(tracePath, O_RDONLY);
+        if (-1 == traceFd) {
+            warn("Unable to open trace %s", tracePath);
+            goto Finally;
+        }
+
+        struct TraceHeader header;
+        if (sizeof(header) != fd_read(traceFd, (char *) &header, sizeof(header)) ||
+                TRACE_MAGIC != header.mMagic ||
+                TRACE_VERSION != header.mVersion) {
+            errno = EINVAL;
+            warn("Unable to read trace header %s", tracePath);
+            goto Finally;
+        }
+
+        for (uint32_t rx = 0; rx < header.mRecords; ++rx) {
+            struct TraceRecord record;
+            if (sizeof(record) != fd_read(traceFd, (char *) &record, sizeof(record))) {
+                errno = EINVAL;
+                warn("Unable to read trace record %s", tracePath);
+                goto Finally;
+            }
+
+            trace_print(&header, &record);
+        }
+
+        traceFd = fd_close(traceFd);
     }
 
     rc = 0;
@@ -988,7 +6714,7 @@ process_double_agent_request(
 Finally:
 
     FINALLY({
-        message_close(msg);
+        traceFd = fd_close(traceFd);
     });
 
     return rc;
@@ -996,213 +6722,296 @@ Finally:
 
 /******************************************************************************/
 static int
-run_double_agent_connection(
-    struct Agent *self,
-    int aClientFd)
+control_double_agent(int argc, char **argv)
 {
     int rc = -1;
 
-    int fallbackFd = -1;
-    int primaryFd = -1;
+    int controlFd = -1;
+
+    char *line = 0;
+    size_t lineLen = 0;
+
+    if (3 > argc)
+        usage();
+
+    const char *controlPath = argv[1];
+
+    for (int ax = 2; ax < argc; ++ax)
+        lineLen += strlen(argv[ax]) + 1;
+
+    if (CONTROL_LINE_MAX < lineLen) {
+        errno = E2BIG;
+        warn("Control command too long");
+        goto Finally;
+    }
+
+    line = malloc(lineLen + 1);
+    if (!line)
+        goto Finally;
+
+    char *linePtr = line;
+    for (int ax = 2; ax < argc; ++ax)
+        linePtr += sprintf(linePtr, "%s%c", argv[ax], ax + 1 < argc ? ' ' : '\n');
 
-    fallbackFd = un_connect(self->mFallbackPath);
-    if (-1 == fallbackFd) {
-        die("Unable to open fallback path %s", self->mFallbackPath);
+    controlFd = un_connect(controlPath);
+    if (-1 == controlFd) {
+        warn("Unable to connect to control path %s", controlPath);
         goto Finally;
     }
 
-    primaryFd = un_connect(self->mPrimaryPath);
-    if (-1 == primaryFd) {
-        die("Unable to open primary path %s", self->mPrimaryPath);
+    if (lineLen != fd_write(controlFd, line, lineLen)) {
+        warn("Unable to send control command");
         goto Finally;
     }
 
-    self->mFallbackFd = fallbackFd;
-    self->mPrimaryFd = primaryFd;
+    /* The reply ends with a line that is either ok, or describes
+     * the error.
+     */
 
-    while (1) {
+    char reply[CONTROL_LINE_MAX];
+    char tail[3] = { };
 
-        DEBUG("Waiting for next message");
+    while (1) {
+        ssize_t replyLen = read(controlFd, reply, sizeof(reply));
+        if (-1 == replyLen) {
+            if (EINTR == errno)
+                continue;
+            warn("Unable to read control reply");
+            goto Finally;
+        }
 
-        int ready = fd_wait_rd(aClientFd, -1);
-        if (-1 == ready) {
-            if (EINTR != errno)
-                goto Finally;
+        if (!replyLen)
             break;
-        }
 
-        if (process_double_agent_request(self, aClientFd))
+        if (replyLen != fd_write(STDOUT_FILENO, reply, replyLen))
             goto Finally;
+
+        for (ssize_t rx = 0; rx < replyLen; ++rx) {
+            tail[0] = tail[1];
+            tail[1] = tail[2];
+            tail[2] = reply[rx];
+        }
     }
 
+    if (memcmp(tail, "ok\n", sizeof(tail)))
+        goto Finally;
+
     rc = 0;
 
 Finally:
 
     FINALLY({
-        primaryFd = fd_close(primaryFd);
-        fallbackFd = fd_close(fallbackFd);
-
-        self->mPrimaryFd = -1;
-        self->mFallbackFd = -1;
+        free(line);
+        controlFd = fd_close(controlFd);
     });
 
     return rc;
 }
 
 /******************************************************************************/
-int
-run_double_agent(struct Agent *self)
+static int
+parse_fd(const char *aArg, int *aFd)
 {
     int rc = -1;
 
-    int exitcode = -1;
+    char *end;
 
-    int clientFd = -1;
-    int signalFd = -1;
-    int processFd = -1;
+    errno = 0;
+    long fd = strtol(aArg, &end, 10);
+    if (errno || end == aArg || *end || 0 > fd || INT_MAX < fd) {
+        errno = EINVAL;
+        goto Finally;
+    }
 
-    signalFd = signal_fd(SIGCHLD);
-    if (-1 == signalFd) {
-        die("Unable to create descriptor to signal %d", SIGCHLD);
+    *aFd = fd;
+
+    rc = 0;
+
+Finally:
+
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+parse_ms(const char *aArg, uint64_t *aNs)
+{
+    int rc = -1;
+
+    char *end;
+
+    errno = 0;
+    unsigned long long ms = strtoull(aArg, &end, 10);
+    if (errno || end == aArg || *end || '-' == *aArg ||
+            UINT64_MAX / 1000000 < ms) {
+        errno = EINVAL;
         goto Finally;
     }
 
-    pid_t parentPid = self->mParentPid;
+    *aNs = ms * 1000000;
 
-    DEBUG("Parent pid %d\n", parentPid);
-    processFd = proc_fd(parentPid);
-    if (-1 == processFd) {
-        if (ESRCH != errno) {
-            die("Unable to create descriptor to pid %d", parentPid);
-            goto Finally;
-        }
+    rc = 0;
 
-        /* The child process has been orphaned, and now adopted by an
-         * ancestor (likely init(1)). The parent no longer accessible,
-         * so force the parent pid to be zero to ensure that it will not
-         * match anything returned by getppid(2).
-         */
+Finally:
 
-        parentPid = 0;
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+parse_size(const char *aArg, size_t *aSize)
+{
+    int rc = -1;
+
+    char *end;
+
+    errno = 0;
+    unsigned long long size = strtoull(aArg, &end, 10);
+    if (errno || end == aArg || *end || '-' == *aArg ||
+            !size || MESSAGE_MAX_LENGTH < size) {
+        errno = EINVAL;
+        goto Finally;
     }
 
-    int numConnections = 0;
+    *aSize = size;
 
-    /* Note that parent termination will race proc_fd(), so it is
-     * also theoretically possible that proc_fd() succeeds but
-     * binds to a new process that acquired the process pid previously
-     * belonging to the parent.
-     *
-     * Since getppid(2) must return an ancestor, and that ancestor
-     * was pre-existing, it is sufficient to compare the result from
-     * getppid(2) to detect this case.
-     */
+    rc = 0;
 
-    while (getppid() == parentPid) {
+Finally:
 
-        DEBUG("Reaping processes");
+    return rc;
+}
 
-        while (1) {
+/*----------------------------------------------------------------------------*/
+static int
+parse_percentile(const char *aArg, unsigned *aPercentile)
+{
+    int rc = -1;
 
-            pid_t waitedPid = waitpid(-1, 0, WNOHANG);
-            if (-1 == waitedPid) {
-                if (ECHILD != errno) {
-                    die("Unable to wait for child processes");
-                    goto Finally;
-                }
-                waitedPid = 0;
-            }
+    char *end;
 
-            if (!waitedPid)
-                break;
+    errno = 0;
+    unsigned long percentile = strtoul(aArg, &end, 10);
+    if (errno || end == aArg || *end || '-' == *aArg ||
+            !percentile || 100 < percentile) {
+        errno = EINVAL;
+        goto Finally;
+    }
 
-            DEBUG("Reaped process pid %d", waitedPid);
-            --numConnections;
-            DEBUG("Decreasing connection count %d", numConnections);
-        }
+    *aPercentile = percentile;
 
-        struct pollfd pollFds[3] = {
-            { .fd = self->mDoubleAgentFd, .events = POLLIN },
-            { .fd = signalFd,             .events = POLLIN },
-            { .fd = processFd,            .events = POLLIN },
-        };
+    rc = 0;
 
-        DEBUG("Polling for activity");
+Finally:
 
-        int fds = poll(pollFds, NUMBEROF(pollFds), -1);
-        if (-1 == fds) {
-            if (EINTR != errno) {
-                die("Unable to poll for activity");
-                goto Finally;
-            }
-            fds = 0;
-        }
+    return rc;
+}
 
-        DEBUG("Polling signal activity");
+/*----------------------------------------------------------------------------*/
+static int
+parse_agent(const char *aArg, int aWritable)
+{
+    int rc = -1;
 
-        int signalEvent = signal_fd_read(signalFd);
-        if (-1 == signalEvent) {
-            die("Unable to read signal descriptor");
-            goto Finally;
-        }
+    if (NUMBEROF(argAgent) == argAgents) {
+        errno = E2BIG;
+        warn("Unable to add more than %u agents", UPSTREAM_MAX);
+        goto Finally;
+    }
 
-        DEBUG("Polling process activity");
+    if (!*aArg) {
+        errno = EINVAL;
+        goto Finally;
+    }
 
-        int processEvent = proc_fd_read(processFd);
-        if (-1 == processEvent) {
-            die("Unable to read process descriptor");
-            goto Finally;
-        }
+    argAgent[argAgents++] = (struct Upstream) {
+        .mWritable = aWritable,
+        .mReplicas = 1,
+        .mPath = { aArg },
+        .mFd = -1,
+    };
 
-        if (processEvent)
-            break;
+    rc = 0;
 
-        DEBUG("Polling connection activity");
+Finally:
 
-        DEBUG("Agent waiting for next connection");
+    return rc;
+}
 
-        clientFd = un_accept(self->mDoubleAgentFd);
-        if (-1 == clientFd) {
-            if (EINTR != errno && EWOULDBLOCK != errno) {
-                die("Unable to accept client connection");
-                goto Finally;
-            }
+/*----------------------------------------------------------------------------*/
+static int
+parse_chain(const char *aPath)
+{
+    int rc = -1;
 
-            continue;
-        }
+    FILE *file = 0;
+    char *line = 0;
+    size_t lineSize = 0;
 
-        if (16 <= numConnections) {
+    file = fopen(aPath, "re");
+    if (!file) {
+        warn("Unable to open chain %s", aPath);
+        goto Finally;
+    }
 
-            DEBUG("Connection count at limit %d", numConnections);
+    unsigned lineNo = 0;
 
-        } else {
+    while (-1 != getline(&line, &lineSize, file)) {
 
-            ++numConnections;
-            DEBUG("Increasing connection count %d", numConnections);
+        ++lineNo;
 
-            pid_t connectionPid = fork();
-            if (-1 == connectionPid) {
-                die("Unable to start process to run connection");
-                goto Finally;
-            }
+        char *text = line + strspn(line, " \t\n");
+        if (!*text || '#' == *text)
+            continue;
 
-            if (!connectionPid) {
+        char *save;
+        char *role = strtok_r(text, " \t\n", &save);
 
-                DEBUG("Agent connection opened");
+        int writable = -1;
+        if (!strcmp("rw", role))
+            writable = 1;
+        else if (!strcmp("ro", role))
+            writable = 0;
 
-                self->mDoubleAgentFd = fd_close(self->mDoubleAgentFd);
-                run_double_agent_connection(self, clientFd);
+        /* Several paths on the same line name replicas of the same
+         * agent.
+         */
 
-                DEBUG("Agent connection closed %d", clientFd);
+        struct Upstream upstream = {
+            .mWritable = writable,
+            .mFd = -1,
+        };
 
-                exitcode = 0;
+        for (char *path; (path = strtok_r(0, " \t\n", &save)); ) {
+            if (REPLICA_MAX == upstream.mReplicas) {
+                writable = -1;
                 break;
             }
+            upstream.mPath[upstream.mReplicas++] = path;
+        }
+
+        if (-1 == writable || !upstream.mReplicas) {
+            errno = EINVAL;
+            warn("Unable to parse chain %s line %u", aPath, lineNo);
+            goto Finally;
+        }
+
+        if (parse_agent(upstream.mPath[0], writable))
+            goto Finally;
 
+        struct Upstream *agent = &argAgent[argAgents-1];
+
+        for (unsigned rx = 0; rx < upstream.mReplicas; ++rx) {
+            agent->mPath[rx] = strdup(upstream.mPath[rx]);
+            if (!agent->mPath[rx])
+                goto Finally;
         }
+        agent->mReplicas = upstream.mReplicas;
+    }
 
-        clientFd = fd_close(clientFd);
+    if (ferror(file)) {
+        warn("Unable to read chain %s", aPath);
+        goto Finally;
     }
 
     rc = 0;
@@ -1210,125 +7019,179 @@ run_double_agent(struct Agent *self)
 Finally:
 
     FINALLY({
-        clientFd = fd_close(clientFd);
-        signalFd = fd_close(signalFd);
-        processFd = fd_close(processFd);
+        free(line);
 
-        if (exitcode >= 0)
-            exit(exitcode);
+        if (file)
+            fclose(file);
     });
 
     return rc;
 }
 
-/******************************************************************************/
-int
-spawn_double_agent(
-    const char *aFallbackPath,
-    const char *aPrimaryPath,
-    const char *aDoubleAgentPath)
+/*----------------------------------------------------------------------------*/
+static int
+parse_replica(const char *aArg)
 {
     int rc = -1;
 
-    DEBUG("Fallback path %s", aFallbackPath);
-    DEBUG("Primary path %s", aPrimaryPath);
-    DEBUG("Double agent path %s", aDoubleAgentPath);
-
-    const char *removePath = 0;
-
-    pid_t childPid = -1;
-
-    int doubleAgentFd = -1;
-
-    doubleAgentFd = un_listen(aDoubleAgentPath);
-    if (-1 == doubleAgentFd) {
-        die("Unable to create double agent path %s", aDoubleAgentPath);
+    if (NUMBEROF(argReplica) == argReplicas) {
+        errno = E2BIG;
+        warn("Unable to add more than %u replicas", REPLICA_MAX);
         goto Finally;
     }
 
-    if (-1 == fd_nonblock(doubleAgentFd)) {
-        die("Unable to configure non-blocking socket");
+    if (!*aArg) {
+        errno = EINVAL;
         goto Finally;
     }
 
-    if (setenv("SSH_AUTH_SOCK", aDoubleAgentPath, 1)) {
-        die("Unable to set SSH_AUTH_SOCK");
-        goto Finally;
-    }
+    argReplica[argReplicas++] = aArg;
 
-    pid_t selfPid = getpid();
+    rc = 0;
 
-    DEBUG("Agent parent pid %d", selfPid);
+Finally:
 
-    childPid = fork();
-    if (-1 == childPid) {
-        die("Unable to create child process");
+    return rc;
+}
+
+/*----------------------------------------------------------------------------*/
+static int
+parse_host_hint(const char *aArg, int *aHint)
+{
+    int rc = -1;
+
+    if (!strcmp("first", aArg))
+        *aHint = HOST_HINT_FIRST;
+    else if (!strcmp("only", aArg))
+        *aHint = HOST_HINT_ONLY;
+    else {
+        errno = EINVAL;
         goto Finally;
     }
 
-    if (!childPid) {
-
-        DEBUG("Agent pid %d", getpid());
+    rc = 0;
 
-        removePath = aDoubleAgentPath;
+Finally:
 
-        if (-1 == setsid()) {
-            die("Unable to create new session leader");
-            goto Finally;
-        }
+    return rc;
+}
 
-        if (stdio_pipe()) {
-            die("Unable to create stdio pipe");
-            goto Finally;
-        }
+/*----------------------------------------------------------------------------*/
+static int
+parse_rate(const char *aArg)
+{
+    int rc = -1;
 
-        struct Agent agent = {
+    static const char *classNames[RATE_CLASSES] = {
+        [RATE_IDENTITIES] = "ident",
+        [RATE_SIGN]       = "sign",
+        [RATE_CHANGE]     = "change",
+    };
 
-            .mPrimaryPath = aPrimaryPath,
-            .mFallbackPath = aFallbackPath,
-            .mDoubleAgentPath = aDoubleAgentPath,
+    /* Each limit is written as class=rate or class=rate/burst, where the
+     * rate is the number of requests each second, and the burst
+     * defaults to the rate.
+     */
 
-            .mParentPid = selfPid,
+    const char *rate = strchr(aArg, '=');
+    if (!rate) {
+        errno = EINVAL;
+        goto Finally;
+    }
 
-            .mDoubleAgentFd = doubleAgentFd,
-            .mPrimaryFd = -1,
-            .mFallbackFd = -1,
-        };
+    int rateClass = -1;
+    for (int cx = 0; cx < RATE_CLASSES; ++cx) {
+        if (strlen(classNames[cx]) == rate - aArg &&
+                !strncmp(classNames[cx], aArg, rate - aArg))
+            rateClass = cx;
+    }
 
-        if (run_double_agent(&agent))
-            goto Finally;
+    char *end;
 
-        DEBUG("Agent closed");
+    errno = 0;
+    unsigned long perSecond = strtoul(++rate, &end, 10);
+    unsigned long burst = perSecond;
+    if (!errno && end != rate && '/' == *end) {
+        const char *burstArg = end + 1;
+        burst = strtoul(burstArg, &end, 10);
+        if (end == burstArg)
+            errno = EINVAL;
+    }
 
+    if (-1 == rateClass || errno || end == rate || *end ||
+            '-' == *rate || UINT_MAX < perSecond || UINT_MAX < burst) {
+        errno = EINVAL;
+        goto Finally;
     }
 
+    if (rate_limit(&argRate[rateClass], perSecond, burst))
+        goto Finally;
+
     rc = 0;
 
 Finally:
-    FINALLY({
-        if (removePath)
-            remove(removePath);
 
-        doubleAgentFd = fd_close(doubleAgentFd);
+    return rc;
+}
 
-        if (!childPid)
-            terminate();
-    });
+/*----------------------------------------------------------------------------*/
+static int
+parse_rate_key(const char *aArg, int *aKey)
+{
+    int rc = -1;
+
+    if (!strcmp("uid", aArg))
+        *aKey = RATE_KEY_UID;
+    else if (!strcmp("pid", aArg))
+        *aKey = RATE_KEY_PID;
+    else if (!strcmp("cgroup", aArg))
+        *aKey = RATE_KEY_CGROUP;
+    else {
+        errno = EINVAL;
+        goto Finally;
+    }
+
+    rc = 0;
+
+Finally:
 
     return rc;
 }
 
-/******************************************************************************/
+/*----------------------------------------------------------------------------*/
 static char **
 parse_options(int argc, char **argv)
 {
     int rc = -1;
 
-    static char shortOpts[] = "+hd";
+    static char shortOpts[] = "+a:hdkr:s:t:u";
 
     static struct option longOpts[] = {
         { "help",      no_argument,       0, 'h' },
         { "debug",     no_argument,       0, 'd' },
+        { "ready-fd",  required_argument, 0, 'R' },
+        { "slow",      required_argument, 0, 's' },
+        { "trace",     required_argument, 0, 't' },
+        { "usage-order", no_argument,     0, 'u' },
+        { "host-hint", required_argument, 0, 'H' },
+        { "usage-db",  required_argument, 0, 'D' },
+        { "policy",    required_argument, 0, 'P' },
+        { "max-inspect", required_argument, 0, 'I' },
+        { "hedge",     required_argument, 0, 'G' },
+        { "agent",     required_argument, 0, 'a' },
+        { "agent-rw",  required_argument, 0, 'W' },
+        { "chain",     required_argument, 0, 'C' },
+        { "replica",   required_argument, 0, 'r' },
+        { "keystore",  no_argument,       0, 'k' },
+        { "control",   required_argument, 0, 'c' },
+        { "idle-timeout", required_argument, 0, 'i' },
+        { "max-lifetime", required_argument, 0, 'L' },
+        { "rate",      required_argument, 0, 'Q' },
+        { "rate-key",  required_argument, 0, 'K' },
+        { "rate-queue", required_argument, 0, 'q' },
+        { "priority",  required_argument, 0, 'p' },
+        { "send-buffer", required_argument, 0, 'B' },
+        { "stall-timeout", required_argument, 0, 'T' },
         { 0 },
     };
 
@@ -1353,6 +7216,115 @@ parse_options(int argc, char **argv)
         case 'd':
             debug("%s", DebugEnable); break;
 
+        case 'R':
+            if (parse_fd(optarg, &argReadyFd))
+                goto Finally;
+            break;
+
+        case 's':
+            if (parse_ms(optarg, &argSlowNs))
+                goto Finally;
+            break;
+
+        case 't':
+            argTracePath = optarg;
+            break;
+
+        case 'u':
+            optUsageOrder = 1;
+            break;
+
+        case 'H':
+            if (parse_host_hint(optarg, &argHostHint))
+                goto Finally;
+            break;
+
+        case 'D':
+            argUsageDb = optarg;
+            break;
+
+        case 'P':
+            argPolicyPath = optarg;
+            break;
+
+        case 'I':
+            if (parse_size(optarg, &argMaxInspect))
+                goto Finally;
+            break;
+
+        case 'G':
+            if (parse_percentile(optarg, &argHedgePercentile))
+                goto Finally;
+            break;
+
+        case 'a':
+            if (parse_agent(optarg, 0))
+                goto Finally;
+            break;
+
+        case 'W':
+            if (parse_agent(optarg, 1))
+                goto Finally;
+            break;
+
+        case 'C':
+            if (parse_chain(optarg))
+                goto Finally;
+            break;
+
+        case 'r':
+            if (parse_replica(optarg))
+                goto Finally;
+            break;
+
+        case 'k':
+            optKeystore = 1;
+            break;
+
+        case 'c':
+            argControlPath = optarg;
+            break;
+
+        case 'i':
+            if (parse_ms(optarg, &argIdleNs))
+                goto Finally;
+            break;
+
+        case 'L':
+            if (parse_ms(optarg, &argLifetimeNs))
+                goto Finally;
+            break;
+
+        case 'Q':
+            if (parse_rate(optarg))
+                goto Finally;
+            break;
+
+        case 'K':
+            if (parse_rate_key(optarg, &argRateKey))
+                goto Finally;
+            break;
+
+        case 'q':
+            if (parse_ms(optarg, &argRateQueueNs))
+                goto Finally;
+            break;
+
+        case 'p':
+            if (parse_ms(optarg, &argPriorityNs))
+                goto Finally;
+            break;
+
+        case 'B':
+            if (parse_size(optarg, &argSendBuffer))
+                goto Finally;
+            break;
+
+        case 'T':
+            if (parse_ms(optarg, &argStallNs))
+                goto Finally;
+            break;
+
         }
     }
 
@@ -1400,6 +7372,20 @@ main(int argc, char **argv)
 
     srand(getpid());
 
+    if (1 < argc && !strcmp("stat", argv[1]))
+        return stat_double_agent(argc - 1, argv + 1) ? EXIT_FAILURE : 0;
+
+    if (1 < argc && !strcmp("trace", argv[1]))
+        return trace_double_agent(argc - 1, argv + 1) ? EXIT_FAILURE : 0;
+
+    if (1 < argc && !strcmp("control", argv[1]))
+        return control_double_agent(argc - 1, argv + 1) ? EXIT_FAILURE : 0;
+
+    argv_ = argv;
+
+    if (!realpath("/proc/self/exe", selfPath_))
+        selfPath_[0] = 0;
+
     char **cmd = parse_options(argc, argv);
     if (!cmd || !cmd[0])
         usage();
@@ -1411,12 +7397,65 @@ main(int argc, char **argv)
     DEBUG("Fallback path %s", argFallbackPath);
     DEBUG("Double agent path %s", argDoubleAgentPath);
 
+    if (optKeystore) {
+        if (argPrimaryPath)
+            die("Primary path %s conflicts with keystore", argPrimaryPath);
+        argPrimaryPath = "keystore";
+    }
+
     if (!argPrimaryPath)
         argPrimaryPath = getenv("SSH_AUTH_SOCK");
     if (!argPrimaryPath)
         die("Unable to find primary path via SSH_AUTH_SOCK");
 
-    if (spawn_double_agent(argFallbackPath, argPrimaryPath, argDoubleAgentPath))
+    if (argTracePath && trace_enable(argTracePath))
+        die("Unable to enable trace to %s", argTracePath);
+
+    /* Keys are only ever added to the primary agent, and the fallback
+     * agent is never changed by the double agent.
+     */
+
+    struct Upstream upstream[UPSTREAM_MAX] = {
+        [UPSTREAM_PRIMARY] = {
+            .mWritable = 1,
+            .mReplicas = 1,
+            .mPath = { argPrimaryPath },
+            .mFd = -1,
+        },
+        [UPSTREAM_FALLBACK] = {
+            .mWritable = 0,
+            .mReplicas = 1,
+            .mPath = { argFallbackPath },
+            .mFd = -1,
+        },
+    };
+
+    for (unsigned rx = 0; rx < argReplicas; ++rx) {
+        struct Upstream *fallback = &upstream[UPSTREAM_FALLBACK];
+        fallback->mPath[fallback->mReplicas++] = argReplica[rx];
+    }
+
+    unsigned upstreams = 2;
+    for (unsigned ax = 0; ax < argAgents; ++ax)
+        upstream[upstreams++] = argAgent[ax];
+
+    /* The agent is replaced during an upgrade by a new image that
+     * adopts the running agent rather than spawning another.
+     */
+
+    const char *upgrade = getenv(UPGRADE_ENV);
+    if (upgrade) {
+        char upgradeState[128];
+        snprintf(upgradeState, sizeof(upgradeState), "%s", upgrade);
+        unsetenv(UPGRADE_ENV);
+
+        return resume_double_agent(
+            upstream, upstreams, argDoubleAgentPath, upgradeState) ?
+            EXIT_FAILURE : 0;
+    }
+
+    if (spawn_double_agent(
+            upstream, upstreams, argDoubleAgentPath, argReadyFd))
         goto Finally;
 
     if (execvp(cmd[0], cmd))